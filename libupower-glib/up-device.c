@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <glib-object.h>
+#include <gio/gunixfdlist.h>
 #include <string.h>
 
 #include "up-device.h"
@@ -56,8 +57,35 @@ struct _UpDevicePrivate
 	/* For use when a UpDevice isn't backed by a D-Bus object
 	 * by the UPower daemon */
 	GHashTable		*offline_props;
+
+	/* type → UpDeviceHistoryCache, see up_device_get_history_cached_sync() */
+	GHashTable		*history_cache;
 };
 
+typedef struct {
+	guint64			 generation;
+	guint64			 epoch;
+	GPtrArray		*items;		/* oldest first */
+} UpDeviceHistoryCache;
+
+/* The serialized forms of (udu) and (dd), so that replies can be read
+ * in place rather than point by point. */
+typedef struct {
+	guint32			 time;
+	guint32			 padding1;
+	gdouble			 value;
+	guint32			 state;
+	guint32			 padding2;
+} UpDeviceHistoryTuple;
+
+typedef struct {
+	gdouble			 value;
+	gdouble			 accuracy;
+} UpDeviceStatsTuple;
+
+G_STATIC_ASSERT (sizeof (UpDeviceHistoryTuple) == 24);
+G_STATIC_ASSERT (sizeof (UpDeviceStatsTuple) == 16);
+
 enum {
 	PROP_0,
 	PROP_UPDATE_TIME,
@@ -94,6 +122,8 @@ enum {
 	PROP_CHARGE_END_THRESHOLD,
 	PROP_CHARGE_THRESHOLD_ENABLED,
 	PROP_CHARGE_THRESHOLD_SUPPORTED,
+	PROP_HISTORY_GENERATION,
+	PROP_HISTORY_EPOCH,
 	PROP_LAST
 };
 
@@ -436,6 +466,53 @@ up_device_refresh_sync (UpDevice *device, GCancellable *cancellable, GError **er
 	return up_exported_device_call_refresh_sync (device->priv->proxy_device, cancellable, error);
 }
 
+/**
+ * up_device_history_append_variant:
+ *
+ * Converts the a(udu) returned by the GetHistory methods, reading the
+ * points straight from the serialized data.
+ **/
+static void
+up_device_history_append_variant (GPtrArray *array, GVariant *gva)
+{
+	const UpDeviceHistoryTuple *tuples;
+	gsize len;
+	gsize i;
+
+	tuples = g_variant_get_fixed_array (gva, &len, sizeof (UpDeviceHistoryTuple));
+	for (i = 0; i < len; i++) {
+		UpHistoryItem *obj;
+
+		obj = up_history_item_new ();
+		up_history_item_set_time (obj, tuples[i].time);
+		up_history_item_set_value (obj, tuples[i].value);
+		up_history_item_set_state (obj, tuples[i].state);
+		g_ptr_array_add (array, obj);
+	}
+}
+
+/**
+ * up_device_history_from_variant:
+ **/
+static GPtrArray *
+up_device_history_from_variant (GVariant *gva, GError **error)
+{
+	GPtrArray *array;
+	gsize len;
+
+	/* no data */
+	len = g_variant_n_children (gva);
+	if (len == 0) {
+		g_set_error_literal (error, 1, 0, "no data");
+		return NULL;
+	}
+
+	/* convert */
+	array = g_ptr_array_new_full (len, (GDestroyNotify) g_object_unref);
+	up_device_history_append_variant (array, gva);
+	return array;
+}
+
 /**
  * up_device_get_history_sync:
  * @device: a #UpDevice instance.
@@ -458,11 +535,8 @@ up_device_get_history_sync (UpDevice *device, const gchar *type, guint timespec,
 {
 	GError *error_local = NULL;
 	GVariant *gva = NULL;
-	guint i;
 	GPtrArray *array = NULL;
 	gboolean ret;
-	gsize len;
-	GVariantIter *iter;
 
 	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
 	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
@@ -482,43 +556,480 @@ up_device_get_history_sync (UpDevice *device, const gchar *type, guint timespec,
 		goto out;
 	}
 
-	iter = g_variant_iter_new (gva);
-	len = g_variant_iter_n_children (iter);
+	array = up_device_history_from_variant (gva, error);
+out:
+	g_clear_pointer (&gva, g_variant_unref);
+	return array;
+}
 
-	/* no data */
-	if (len == 0) {
-		g_set_error_literal (error, 1, 0, "no data");
-		g_variant_iter_free (iter);
+/**
+ * up_device_get_history_downsampled_sync:
+ * @device: a #UpDevice instance.
+ * @type: The type of history, known values are "rate" and "charge".
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the resolution of data.
+ * @method: how to reduce the data to @resolution points, known values
+ *          are "average", "lttb" and "minmax".
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets the device history like up_device_get_history_sync(), choosing
+ * how it is reduced to the resolution. "lttb" and "minmax" keep the
+ * peaks that averaging hides, so fewer points can be asked for.
+ *
+ * Return value: (element-type UpHistoryItem) (transfer full): an array of #UpHistoryItem's, in the same
+ *               order as up_device_get_history_sync(); %NULL if @error is set
+ *               or @device is invalid
+ *
+ * Since: 1.90.7
+ **/
+GPtrArray *
+up_device_get_history_downsampled_sync (UpDevice *device, const gchar *type, guint timespec, guint resolution,
+					const gchar *method, GCancellable *cancellable, GError **error)
+{
+	GError *error_local = NULL;
+	GVariant *gva = NULL;
+	GPtrArray *array = NULL;
+	gboolean ret;
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
+
+	ret = up_exported_device_call_get_history_downsampled_sync (device->priv->proxy_device,
+								    type,
+								    timespec,
+								    resolution,
+								    method,
+								    &gva,
+								    cancellable,
+								    &error_local);
+	if (!ret) {
+		g_set_error (error, 1, 0, "GetHistoryDownsampled(%s,%i,%s) on %s failed: %s", type, timespec,
+			     method, up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		goto out;
+	}
+
+	array = up_device_history_from_variant (gva, error);
+out:
+	g_clear_pointer (&gva, g_variant_unref);
+	return array;
+}
+
+/**
+ * up_device_get_history_multi_sync:
+ * @device: a #UpDevice instance.
+ * @types: (array zero-terminated=1): the types of history, known values are "rate",
+ *         "charge", "time-full" and "time-empty".
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the maximum number of time slots.
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets several types of device history in one call, averaged over the
+ * same time slots, oldest first. The arrays all have the same length
+ * and the items at the same index have the same time; the value is NaN
+ * where there is no data of that type.
+ *
+ * Return value: (element-type GPtrArray) (transfer full): an array of arrays of
+ *               #UpHistoryItem's, one for each of @types; %NULL if @error is set
+ *               or @device is invalid
+ *
+ * Since: 1.90.7
+ **/
+GPtrArray *
+up_device_get_history_multi_sync (UpDevice *device, const gchar *const *types, guint timespec,
+				  guint resolution, GCancellable *cancellable, GError **error)
+{
+	g_autofree gchar *types_string = NULL;
+	GError *error_local = NULL;
+	GVariant *times = NULL;
+	GVariant *states = NULL;
+	GVariant *values = NULL;
+	GPtrArray *array = NULL;
+	const guint32 *time;
+	const guint32 *state;
+	gsize len;
+	gsize n;
+	gboolean ret;
+	guint i, j;
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
+	g_return_val_if_fail (types != NULL, NULL);
+
+	ret = up_exported_device_call_get_history_multi_sync (device->priv->proxy_device,
+							      types,
+							      timespec,
+							      resolution,
+							      &times,
+							      &states,
+							      &values,
+							      cancellable,
+							      &error_local);
+	if (!ret) {
+		types_string = g_strjoinv (",", (gchar **) types);
+		g_set_error (error, 1, 0, "GetHistoryMulti(%s,%i) on %s failed: %s", types_string,
+			     timespec, up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		goto out;
+	}
+
+	time = g_variant_get_fixed_array (times, &len, sizeof (guint32));
+	state = g_variant_get_fixed_array (states, &n, sizeof (guint32));
+	if (n != len || g_variant_n_children (values) != g_strv_length ((gchar **) types)) {
+		g_set_error_literal (error, 1, 0, "invalid data");
 		goto out;
 	}
 
 	/* convert */
-	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	for (i = 0; i < len; i++) {
-		UpHistoryItem *obj;
-		GVariant *v;
-		gdouble value;
-		guint32 time, state;
+	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+	for (i = 0; i < g_variant_n_children (values); i++) {
+		g_autoptr(GVariant) column = g_variant_get_child_value (values, i);
+		const gdouble *value;
+		GPtrArray *items;
+
+		value = g_variant_get_fixed_array (column, &n, sizeof (gdouble));
+		if (n != len) {
+			g_set_error_literal (error, 1, 0, "invalid data");
+			g_clear_pointer (&array, g_ptr_array_unref);
+			goto out;
+		}
+		items = g_ptr_array_new_full (len, (GDestroyNotify) g_object_unref);
+		for (j = 0; j < len; j++) {
+			UpHistoryItem *obj;
+
+			obj = up_history_item_new ();
+			up_history_item_set_time (obj, time[j]);
+			up_history_item_set_value (obj, value[j]);
+			up_history_item_set_state (obj, state[j]);
+			g_ptr_array_add (items, obj);
+		}
+		g_ptr_array_add (array, items);
+	}
+out:
+	g_clear_pointer (&times, g_variant_unref);
+	g_clear_pointer (&states, g_variant_unref);
+	g_clear_pointer (&values, g_variant_unref);
+	return array;
+}
 
-		v = g_variant_iter_next_value (iter);
-		g_variant_get (v, "(udu)",
-			       &time, &value, &state);
-		g_variant_unref (v);
+typedef struct {
+	gchar			**types;
+	guint			 timespec;
+	guint			 resolution;
+} UpDeviceHistoryMultiData;
 
-		obj = up_history_item_new ();
-		up_history_item_set_time (obj, time);
-		up_history_item_set_value (obj, value);
-		up_history_item_set_state (obj, state);
+static void
+up_device_history_multi_data_free (UpDeviceHistoryMultiData *data)
+{
+	g_strfreev (data->types);
+	g_free (data);
+}
 
-		g_ptr_array_add (array, obj);
+static void
+get_history_multi_async_thread (GTask        *task,
+				gpointer      source_object,
+				gpointer      task_data,
+				GCancellable *cancellable)
+{
+	UpDeviceHistoryMultiData *data = task_data;
+	GError *error = NULL;
+	GPtrArray *array;
+
+	array = up_device_get_history_multi_sync (UP_DEVICE (source_object),
+						  (const gchar *const *) data->types,
+						  data->timespec, data->resolution,
+						  cancellable, &error);
+	if (!array)
+		g_task_return_error (task, error);
+	else
+		g_task_return_pointer (task, array, (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * up_device_get_history_multi_async:
+ * @device: a #UpDevice instance.
+ * @types: (array zero-terminated=1): the types of history, as for
+ *         up_device_get_history_multi_sync().
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the maximum number of time slots.
+ * @cancellable: (nullable): a #GCancellable or %NULL
+ * @callback: a #GAsyncReadyCallback to call when the request is satisfied
+ * @user_data: the data to pass to @callback
+ *
+ * Asynchronously gets several types of device history, see
+ * up_device_get_history_multi_sync().
+ *
+ * Since: 1.90.7
+ **/
+void
+up_device_get_history_multi_async (UpDevice            *device,
+				   const gchar *const  *types,
+				   guint                timespec,
+				   guint                resolution,
+				   GCancellable        *cancellable,
+				   GAsyncReadyCallback  callback,
+				   gpointer             user_data)
+{
+	g_autoptr(GTask) task = NULL;
+	UpDeviceHistoryMultiData *data;
+
+	g_return_if_fail (UP_IS_DEVICE (device));
+	g_return_if_fail (types != NULL);
+
+	data = g_new0 (UpDeviceHistoryMultiData, 1);
+	data->types = g_strdupv ((gchar **) types);
+	data->timespec = timespec;
+	data->resolution = resolution;
+
+	task = g_task_new (device, cancellable, callback, user_data);
+	g_task_set_source_tag (task, (gpointer) G_STRFUNC);
+	g_task_set_task_data (task, data, (GDestroyNotify) up_device_history_multi_data_free);
+
+	g_task_run_in_thread (task, get_history_multi_async_thread);
+}
+
+/**
+ * up_device_get_history_multi_finish:
+ * @device: a #UpDevice instance.
+ * @res: a #GAsyncResult obtained from the #GAsyncReadyCallback passed
+ *     to up_device_get_history_multi_async()
+ * @error: a #GError, or %NULL.
+ *
+ * Finishes an operation started with up_device_get_history_multi_async().
+ *
+ * Return value: (element-type GPtrArray) (transfer full): an array of arrays of
+ *     #UpHistoryItem's, or %NULL on error.
+ *
+ * Since: 1.90.7
+ **/
+GPtrArray *
+up_device_get_history_multi_finish (UpDevice      *device,
+				    GAsyncResult  *res,
+				    GError       **error)
+{
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (g_task_is_valid (res, device), NULL);
+	g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+	return g_task_propagate_pointer (G_TASK (res), error);
+}
+
+static void
+up_device_history_cache_free (UpDeviceHistoryCache *cache)
+{
+	g_ptr_array_unref (cache->items);
+	g_free (cache);
+}
+
+/**
+ * up_device_get_history_cached_sync:
+ * @device: a #UpDevice instance.
+ * @type: The type of history, known values are "rate" and "charge".
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets all the recorded device history, keeping a copy of it so that
+ * later calls only fetch the points added since, and do not talk to
+ * the daemon at all if #UpDevice:history-generation has not changed.
+ * The copy is dropped when #UpDevice:history-epoch changes, as the
+ * daemon has replaced the history then. This is meant for clients that redraw a graph periodically.
+ *
+ * Return value: (element-type UpHistoryItem) (transfer full): an array of #UpHistoryItem's, with the oldest
+ *               first; %NULL if @error is set or @device is invalid
+ *
+ * Since: 1.90.7
+ **/
+GPtrArray *
+up_device_get_history_cached_sync (UpDevice *device, const gchar *type, GCancellable *cancellable, GError **error)
+{
+	UpDeviceHistoryCache *cache;
+	GError *error_local = NULL;
+	GVariant *gva = NULL;
+	GPtrArray *array = NULL;
+	guint64 generation;
+	guint64 epoch;
+	guint since = 0;
+	gboolean ret;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
+
+	if (device->priv->history_cache == NULL)
+		device->priv->history_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+								     (GDestroyNotify) up_device_history_cache_free);
+	cache = g_hash_table_lookup (device->priv->history_cache, type);
+	if (cache == NULL) {
+		cache = g_new0 (UpDeviceHistoryCache, 1);
+		cache->items = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+		g_hash_table_insert (device->priv->history_cache, g_strdup (type), cache);
+	}
+
+	/* the points we have may not be there anymore */
+	epoch = up_exported_device_get_history_epoch (device->priv->proxy_device);
+	if (epoch != cache->epoch) {
+		g_ptr_array_set_size (cache->items, 0);
+		cache->epoch = epoch;
+	}
+
+	/* nothing new */
+	generation = up_exported_device_get_history_generation (device->priv->proxy_device);
+	if (cache->items->len > 0 && generation != 0 && generation == cache->generation)
+		goto copy;
+
+	/* the newest point may have moved since, so it is fetched again */
+	if (cache->items->len >= 2)
+		since = up_history_item_get_time (g_ptr_array_index (cache->items, cache->items->len - 2));
+	ret = up_exported_device_call_get_history_since_sync (device->priv->proxy_device,
+							      type,
+							      since,
+							      &gva,
+							      cancellable,
+							      &error_local);
+	if (!ret) {
+		g_set_error (error, 1, 0, "GetHistorySince(%s,%u) on %s failed: %s", type, since,
+			     up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		goto out;
 	}
-	g_variant_iter_free (iter);
 
+	/* replace what was newer than @since */
+	while (cache->items->len > 0 &&
+	       up_history_item_get_time (g_ptr_array_index (cache->items, cache->items->len - 1)) > since)
+		g_ptr_array_remove_index (cache->items, cache->items->len - 1);
+	up_device_history_append_variant (cache->items, gva);
+	cache->generation = generation;
+copy:
+	if (cache->items->len == 0) {
+		g_set_error_literal (error, 1, 0, "no data");
+		goto out;
+	}
+	array = g_ptr_array_new_full (cache->items->len, (GDestroyNotify) g_object_unref);
+	for (i = 0; i < cache->items->len; i++)
+		g_ptr_array_add (array, g_object_ref (g_ptr_array_index (cache->items, i)));
 out:
 	g_clear_pointer (&gva, g_variant_unref);
 	return array;
 }
 
+/**
+ * up_device_get_history_fd_sync:
+ * @device: a #UpDevice instance.
+ * @type: The type of history, known values are "rate" and "charge".
+ * @timespec: the amount of time to look back into time.
+ * @resolution: the resolution of data.
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Gets the device history as a file descriptor, which avoids the cost
+ * of marshalling long histories over D-Bus. The file holds 16 byte
+ * records in host byte order, each made of the time as a #guint32, the
+ * #UpDeviceState as a #guint32 and the value as a #gdouble. They are in
+ * the same order as from up_device_get_history_sync(): the most recent
+ * one first, or the oldest one first if @timespec is 0.
+ *
+ * Return value: a file descriptor positioned at the start of the data,
+ *               to be closed by the caller; -1 if @error is set
+ *
+ * Since: 1.90.7
+ **/
+gint
+up_device_get_history_fd_sync (UpDevice *device, const gchar *type, guint timespec, guint resolution, GCancellable *cancellable, GError **error)
+{
+	GError *error_local = NULL;
+	GVariant *out;
+	GUnixFDList *fds = NULL;
+	gint handle;
+	gint fd = -1;
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), -1);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, -1);
+
+	out = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (device->priv->proxy_device),
+							"GetHistoryFd",
+							g_variant_new ("(suu)", type, timespec, resolution),
+							G_DBUS_CALL_FLAGS_NONE,
+							-1,
+							NULL,
+							&fds,
+							cancellable,
+							&error_local);
+	if (out == NULL) {
+		g_set_error (error, 1, 0, "GetHistoryFd(%s,%i) on %s failed: %s", type, timespec,
+			     up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		goto out;
+	}
+
+	g_variant_get (out, "(h)", &handle);
+	if (fds == NULL || handle >= g_unix_fd_list_get_length (fds)) {
+		g_set_error_literal (error, 1, 0, "no file descriptor returned");
+		goto out;
+	}
+	fd = g_unix_fd_list_get (fds, handle, error);
+out:
+	g_clear_pointer (&out, g_variant_unref);
+	g_clear_object (&fds);
+	return fd;
+}
+
+/**
+ * up_device_import_history_sync:
+ * @device: a #UpDevice instance.
+ * @type: The type of history, known values are "rate" and "charge".
+ * @fd: a regular file holding records in the format returned by
+ *      up_device_get_history_fd_sync(), in any order.
+ * @cancellable: a #GCancellable or %NULL
+ * @error: a #GError, or %NULL.
+ *
+ * Replaces the device history of the given type, for instance to replay
+ * a saved history on a test system. This only works if the daemon was
+ * started in debug mode.
+ *
+ * Return value: %TRUE for success, else %FALSE and @error is used
+ *
+ * Since: 1.90.7
+ **/
+gboolean
+up_device_import_history_sync (UpDevice *device, const gchar *type, gint fd, GCancellable *cancellable, GError **error)
+{
+	GError *error_local = NULL;
+	GVariant *out;
+	GUnixFDList *fds;
+	gint handle;
+
+	g_return_val_if_fail (UP_IS_DEVICE (device), FALSE);
+	g_return_val_if_fail (device->priv->proxy_device != NULL, FALSE);
+
+	fds = g_unix_fd_list_new ();
+	handle = g_unix_fd_list_append (fds, fd, error);
+	if (handle < 0) {
+		g_object_unref (fds);
+		return FALSE;
+	}
+
+	out = g_dbus_proxy_call_with_unix_fd_list_sync (G_DBUS_PROXY (device->priv->proxy_device),
+							"ImportHistory",
+							g_variant_new ("(sh)", type, handle),
+							G_DBUS_CALL_FLAGS_NONE,
+							-1,
+							fds,
+							NULL,
+							cancellable,
+							&error_local);
+	g_object_unref (fds);
+	if (out == NULL) {
+		g_set_error (error, 1, 0, "ImportHistory(%s) on %s failed: %s", type,
+			     up_device_get_object_path (device), error_local->message);
+		g_error_free (error_local);
+		return FALSE;
+	}
+	g_variant_unref (out);
+	return TRUE;
+}
+
 /**
  * up_device_get_statistics_sync:
  * @device: a #UpDevice instance.
@@ -535,13 +1046,13 @@ out:
 GPtrArray *
 up_device_get_statistics_sync (UpDevice *device, const gchar *type, GCancellable *cancellable, GError **error)
 {
+	const UpDeviceStatsTuple *tuples;
 	GError *error_local = NULL;
 	GVariant *gva = NULL;
 	guint i;
 	GPtrArray *array = NULL;
 	gboolean ret;
 	gsize len;
-	GVariantIter *iter;
 
 	g_return_val_if_fail (UP_IS_DEVICE (device), NULL);
 	g_return_val_if_fail (device->priv->proxy_device != NULL, NULL);
@@ -559,35 +1070,24 @@ up_device_get_statistics_sync (UpDevice *device, const gchar *type, GCancellable
 		goto out;
 	}
 
-	iter = g_variant_iter_new (gva);
-	len = g_variant_iter_n_children (iter);
+	tuples = g_variant_get_fixed_array (gva, &len, sizeof (UpDeviceStatsTuple));
 
 	/* no data */
 	if (len == 0) {
 		g_set_error_literal (error, 1, 0, "no data");
-		g_variant_iter_free (iter);
 		goto out;
 	}
 
 	/* convert */
-	array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+	array = g_ptr_array_new_full (len, (GDestroyNotify) g_object_unref);
 	for (i = 0; i < len; i++) {
 		UpStatsItem *obj;
-		GVariant *v;
-		gdouble value, accuracy;
-
-		v = g_variant_iter_next_value (iter);
-		g_variant_get (v, "(dd)",
-			       &value, &accuracy);
-		g_variant_unref (v);
 
 		obj = up_stats_item_new ();
-		up_stats_item_set_value (obj, value);
-		up_stats_item_set_accuracy (obj, accuracy);
-
+		up_stats_item_set_value (obj, tuples[i].value);
+		up_stats_item_set_accuracy (obj, tuples[i].accuracy);
 		g_ptr_array_add (array, obj);
 	}
-	g_variant_iter_free (iter);
 
 out:
 	g_clear_pointer (&gva, g_variant_unref);
@@ -716,6 +1216,12 @@ up_device_set_property (GObject *object, guint prop_id, const GValue *value, GPa
 	case PROP_CHARGE_THRESHOLD_SUPPORTED:
 		up_exported_device_set_charge_threshold_supported (device->priv->proxy_device, g_value_get_boolean (value));
 		break;
+	case PROP_HISTORY_GENERATION:
+		up_exported_device_set_history_generation (device->priv->proxy_device, g_value_get_uint64 (value));
+		break;
+	case PROP_HISTORY_EPOCH:
+		up_exported_device_set_history_epoch (device->priv->proxy_device, g_value_get_uint64 (value));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -845,6 +1351,12 @@ up_device_get_property (GObject *object, guint prop_id, GValue *value, GParamSpe
 	case PROP_CHARGE_THRESHOLD_SUPPORTED:
 		g_value_set_boolean (value, up_exported_device_get_charge_threshold_supported (device->priv->proxy_device));
 		break;
+	case PROP_HISTORY_GENERATION:
+		g_value_set_uint64 (value, up_exported_device_get_history_generation (device->priv->proxy_device));
+		break;
+	case PROP_HISTORY_EPOCH:
+		g_value_set_uint64 (value, up_exported_device_get_history_epoch (device->priv->proxy_device));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -1317,6 +1829,37 @@ up_device_class_init (UpDeviceClass *klass)
 							       NULL, NULL,
 							       FALSE,
 							       G_PARAM_READWRITE));
+
+	/**
+	 * UpDevice:history-generation:
+	 *
+	 * A counter that goes up every time the history of the device
+	 * changes.
+	 *
+	 * Since: 1.90.7
+	 **/
+	g_object_class_install_property (object_class,
+					 PROP_HISTORY_GENERATION,
+					 g_param_spec_uint64 ("history-generation",
+							      NULL, NULL,
+							      0, G_MAXUINT64, 0,
+							      G_PARAM_READWRITE));
+
+	/**
+	 * UpDevice:history-epoch:
+	 *
+	 * A counter that goes up every time the history of the device is
+	 * replaced rather than added to, after which earlier copies of it
+	 * are no longer valid.
+	 *
+	 * Since: 1.90.7
+	 **/
+	g_object_class_install_property (object_class,
+					 PROP_HISTORY_EPOCH,
+					 g_param_spec_uint64 ("history-epoch",
+							      NULL, NULL,
+							      0, G_MAXUINT64, 0,
+							      G_PARAM_READWRITE));
 }
 
 static void
@@ -1359,6 +1902,7 @@ up_device_finalize (GObject *object)
 
 	g_clear_object (&device->priv->proxy_device);
 	g_clear_pointer (&device->priv->offline_props, g_hash_table_unref);
+	g_clear_pointer (&device->priv->history_cache, g_hash_table_unref);
 
 	G_OBJECT_CLASS (up_device_parent_class)->finalize (object);
 }
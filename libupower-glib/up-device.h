@@ -83,11 +83,51 @@ GPtrArray	*up_device_get_history_sync		(UpDevice		*device,
 							 guint			 resolution,
 							 GCancellable		*cancellable,
 							 GError			**error);
+GPtrArray	*up_device_get_history_downsampled_sync	(UpDevice		*device,
+							 const gchar		*type,
+							 guint			 timespec,
+							 guint			 resolution,
+							 const gchar		*method,
+							 GCancellable		*cancellable,
+							 GError			**error);
+GPtrArray	*up_device_get_history_multi_sync	(UpDevice		*device,
+							 const gchar *const	*types,
+							 guint			 timespec,
+							 guint			 resolution,
+							 GCancellable		*cancellable,
+							 GError			**error);
+GPtrArray	*up_device_get_history_cached_sync	(UpDevice		*device,
+							 const gchar		*type,
+							 GCancellable		*cancellable,
+							 GError			**error);
+gint		 up_device_get_history_fd_sync		(UpDevice		*device,
+							 const gchar		*type,
+							 guint			 timespec,
+							 guint			 resolution,
+							 GCancellable		*cancellable,
+							 GError			**error);
+gboolean	 up_device_import_history_sync		(UpDevice		*device,
+							 const gchar		*type,
+							 gint			 fd,
+							 GCancellable		*cancellable,
+							 GError			**error);
 GPtrArray	*up_device_get_statistics_sync		(UpDevice		*device,
 							 const gchar		*type,
 							 GCancellable		*cancellable,
 							 GError			**error);
 
+/* async versions */
+void		 up_device_get_history_multi_async	(UpDevice		*device,
+							 const gchar *const	*types,
+							 guint			 timespec,
+							 guint			 resolution,
+							 GCancellable		*cancellable,
+							 GAsyncReadyCallback	 callback,
+							 gpointer		 user_data);
+GPtrArray	*up_device_get_history_multi_finish	(UpDevice		*device,
+							 GAsyncResult		*res,
+							 GError			**error);
+
 /* accessors */
 const gchar	*up_device_get_object_path		(UpDevice		*device);
 
@@ -32,6 +32,7 @@
 
 #include <glib.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "up-history-item.h"
 
@@ -190,6 +191,63 @@ up_history_item_to_string (UpHistoryItem *history_item)
 				up_device_state_to_string (history_item->priv->state));
 }
 
+/* powers of ten that are exact as doubles */
+static const gdouble up_history_item_powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/**
+ * up_history_item_parse_time:
+ *
+ * Parses the digits up to @end in place, anything unusual goes
+ * through atoi() as before.
+ **/
+static guint
+up_history_item_parse_time (const gchar *text, const gchar *end)
+{
+	const gchar *p;
+	guint64 time = 0;
+
+	for (p = text; p < end && g_ascii_isdigit (*p); p++)
+		time = time * 10 + (*p - '0');
+	if (p != end || end - text > 10)
+		return atoi (text);
+	return time;
+}
+
+/**
+ * up_history_item_parse_value:
+ *
+ * Parses the plain decimals written by up_history_item_to_string()
+ * in place. With at most 15 digits the mantissa and the power of ten
+ * are exact, so the single division rounds exactly like strtod().
+ **/
+static gdouble
+up_history_item_parse_value (const gchar *text, const gchar *end)
+{
+	const gchar *p = text;
+	gboolean negative = FALSE;
+	guint64 mantissa = 0;
+	guint digits = 0;
+	guint decimals = 0;
+	gdouble value;
+
+	if (p < end && *p == '-') {
+		negative = TRUE;
+		p++;
+	}
+	for (; p < end && g_ascii_isdigit (*p); p++, digits++)
+		mantissa = mantissa * 10 + (*p - '0');
+	if (p < end && *p == '.') {
+		for (p++; p < end && g_ascii_isdigit (*p); p++, digits++, decimals++)
+			mantissa = mantissa * 10 + (*p - '0');
+	}
+	if (p != end || digits == 0 || digits >= G_N_ELEMENTS (up_history_item_powers))
+		return atof (text);
+	value = (gdouble) mantissa / up_history_item_powers[decimals];
+	return negative ? -value : value;
+}
+
 /**
  * up_history_item_set_from_string:
  * @history_item: #UpHistoryItem
@@ -201,31 +259,25 @@ up_history_item_to_string (UpHistoryItem *history_item)
 gboolean
 up_history_item_set_from_string (UpHistoryItem *history_item, const gchar *text)
 {
-	gchar **parts = NULL;
-	guint length;
-	gboolean ret = FALSE;
+	const gchar *value;
+	const gchar *state;
 
 	g_return_val_if_fail (UP_IS_HISTORY_ITEM (history_item), FALSE);
 	g_return_val_if_fail (text != NULL, FALSE);
 
-	/* split by tab */
-	parts = g_strsplit (text, "\t", 0);
-	length = g_strv_length (parts);
-	if (length != 3) {
+	/* split by tab, in place */
+	value = strchr (text, '\t');
+	state = value != NULL ? strchr (value + 1, '\t') : NULL;
+	if (state == NULL || strchr (state + 1, '\t') != NULL) {
 		g_warning ("invalid string: '%s'", text);
-		goto out;
+		return FALSE;
 	}
 
 	/* parse */
-	up_history_item_set_time (history_item, atoi (parts[0]));
-	up_history_item_set_value (history_item, atof (parts[1]));
-	up_history_item_set_state (history_item, up_device_state_from_string (parts[2]));
-
-	/* success */
-	ret = TRUE;
-out:
-	g_strfreev (parts);
-	return ret;
+	up_history_item_set_time (history_item, up_history_item_parse_time (text, value));
+	up_history_item_set_value (history_item, up_history_item_parse_value (value + 1, state));
+	up_history_item_set_state (history_item, up_device_state_from_string (state + 1));
+	return TRUE;
 }
 
 /**
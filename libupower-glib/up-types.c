@@ -30,6 +30,7 @@
 
 #include "config.h"
 
+#include <string.h>
 #include <glib.h>
 
 #include "up-types.h"
@@ -225,19 +226,56 @@ up_device_state_from_string (const gchar *state)
 {
 	if (state == NULL)
 		return UP_DEVICE_STATE_UNKNOWN;
-	if (g_str_equal (state, "charging"))
-		return UP_DEVICE_STATE_CHARGING;
-	if (g_str_equal (state, "discharging"))
-		return UP_DEVICE_STATE_DISCHARGING;
-	if (g_str_equal (state, "empty"))
-		return UP_DEVICE_STATE_EMPTY;
-	if (g_str_equal (state, "fully-charged"))
-		return UP_DEVICE_STATE_FULLY_CHARGED;
-	if (g_str_equal (state, "pending-charge"))
-		return UP_DEVICE_STATE_PENDING_CHARGE;
-	if (g_str_equal (state, "pending-discharge"))
-		return UP_DEVICE_STATE_PENDING_DISCHARGE;
-	return UP_DEVICE_STATE_UNKNOWN;
+	return up_device_state_from_string_len (state, -1);
+}
+
+/**
+ * up_device_state_from_string_len:
+ * @state: a state name, not necessarily nul-terminated
+ * @len: the length of @state, or -1 if it is nul-terminated
+ *
+ * Converts a string to a #UpDeviceState without copying it.
+ *
+ * Return value: enumerated value
+ *
+ * Since: 1.90.7
+ **/
+UpDeviceState
+up_device_state_from_string_len (const gchar *state, gssize len)
+{
+	UpDeviceState state_enum;
+
+	g_return_val_if_fail (state != NULL, UP_DEVICE_STATE_UNKNOWN);
+
+	if (len < 0)
+		len = strlen (state);
+
+	/* every name has a different length, so that is a perfect hash */
+	switch (len) {
+	case 5:
+		state_enum = UP_DEVICE_STATE_EMPTY;
+		break;
+	case 8:
+		state_enum = UP_DEVICE_STATE_CHARGING;
+		break;
+	case 11:
+		state_enum = UP_DEVICE_STATE_DISCHARGING;
+		break;
+	case 13:
+		state_enum = UP_DEVICE_STATE_FULLY_CHARGED;
+		break;
+	case 14:
+		state_enum = UP_DEVICE_STATE_PENDING_CHARGE;
+		break;
+	case 17:
+		state_enum = UP_DEVICE_STATE_PENDING_DISCHARGE;
+		break;
+	default:
+		return UP_DEVICE_STATE_UNKNOWN;
+	}
+	if (memcmp (state, up_device_state_to_string (state_enum), len) != 0)
+		return UP_DEVICE_STATE_UNKNOWN;
+	return state_enum;
 }
 
 /**
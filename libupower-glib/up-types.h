@@ -133,6 +133,8 @@ const gchar	*up_device_technology_to_string		(UpDeviceTechnology	 technology_enu
 const gchar	*up_device_level_to_string		(UpDeviceLevel		 level_enum);
 UpDeviceKind	 up_device_kind_from_string		(const gchar		*type);
 UpDeviceState	 up_device_state_from_string		(const gchar		*state);
+UpDeviceState	 up_device_state_from_string_len	(const gchar		*state,
+							 gssize			 len);
 UpDeviceTechnology up_device_technology_from_string	(const gchar		*technology);
 UpDeviceLevel	 up_device_level_from_string		(const gchar		*level);
 
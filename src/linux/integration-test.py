@@ -26,6 +26,7 @@ import subprocess
 import unittest
 import time
 import re
+import struct
 from output_checker import OutputChecker
 from packaging.version import parse as parse_version
 
@@ -177,7 +178,7 @@ class Tests(dbusmock.DBusTestCase):
     # Daemon control and D-BUS I/O
     #
 
-    def start_daemon(self, cfgfile=None, warns=False, history_dir_override=None):
+    def start_daemon(self, cfgfile=None, warns=False, history_dir_override=None, debug=False):
         '''Start daemon and create DBus proxy.
 
         Do this after adding the devices you want to test with. At the moment
@@ -211,6 +212,8 @@ class Tests(dbusmock.DBusTestCase):
             daemon_path = ['valgrind', self.daemon_path, '-v', '-r']
         else:
             daemon_path = [self.daemon_path, '-v', '-r']
+        if debug:
+            daemon_path.append('-d')
         self.daemon = subprocess.Popen(daemon_path,
                                        env=env, stdout=self.daemon_log.fd,
                                        stderr=subprocess.STDOUT)
@@ -880,6 +883,52 @@ class Tests(dbusmock.DBusTestCase):
         self.assertEqual(self.get_dbus_dev_property(bat0_up, 'Temperature'), 0.0)
         self.stop_daemon()
 
+    def test_battery_refresh_properties_changed(self):
+        '''a refresh sends a single PropertiesChanged signal'''
+
+        bat0 = self.testbed.add_device('power_supply', 'BAT0', None,
+                                       ['type', 'Battery',
+                                        'present', '1',
+                                        'status', 'Discharging',
+                                        'energy_full', '60000000',
+                                        'energy_full_design', '80000000',
+                                        'energy_now', '48000000',
+                                        'power_now', '10000000',
+                                        'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        signals = []
+
+        def properties_changed(connection, sender, path, iface, signal, params):
+            signals.append(params.unpack()[1])
+
+        sub = self.dbus.signal_subscribe(None,
+                                         'org.freedesktop.DBus.Properties',
+                                         'PropertiesChanged',
+                                         bat0_up,
+                                         None,
+                                         Gio.DBusSignalFlags.NONE,
+                                         properties_changed)
+        self.addCleanup(self.dbus.signal_unsubscribe, sub)
+        self.wait_for_mainloop()
+        signals.clear()
+
+        # a low battery changes the level, the icon and the warning
+        self.testbed.set_attribute(bat0, 'energy_now', '3000000')
+        self.testbed.uevent(bat0, 'change')
+        self.assertEventually(lambda: len(signals) > 0)
+        self.wait_for_mainloop()
+        self.assertEqual(len(signals), 1)
+        self.assertEqual(signals[0]['Percentage'], 5.0)
+        self.assertIn('Energy', signals[0])
+        self.assertIn('IconName', signals[0])
+        self.assertIn('WarningLevel', signals[0])
+        self.stop_daemon()
+
     def test_battery_energy_charge_mixed(self):
         '''battery which reports both current charge and energy'''
 
@@ -1798,6 +1847,328 @@ class Tests(dbusmock.DBusTestCase):
 
         self.stop_daemon()
 
+    def test_history_fd(self):
+        '''check that GetHistoryFd returns the same data as GetHistory'''
+
+        self.testbed.add_device('power_supply', 'BAT0', None,
+                                ['type', 'Battery',
+                                 'present', '1',
+                                 'status', 'Discharging',
+                                 'energy_full', '60000000',
+                                 'energy_full_design', '80000000',
+                                 'energy_now', '50000000',
+                                 'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        history = self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                      'GetHistory',
+                                      GLib.Variant('(suu)', ('charge', 0, 100)),
+                                      None,
+                                      Gio.DBusCallFlags.NO_AUTO_START,
+                                      -1, None).unpack()[0]
+        self.assertGreater(len(history), 0)
+
+        out, fds = self.dbus.call_with_unix_fd_list_sync(UP, bat0_up, UP_DEVICE,
+                                                         'GetHistoryFd',
+                                                         GLib.Variant('(suu)', ('charge', 0, 100)),
+                                                         None,
+                                                         Gio.DBusCallFlags.NO_AUTO_START,
+                                                         -1, None, None)
+        fd = fds.get(out.unpack()[0])
+        with os.fdopen(fd, 'rb') as f:
+            data = f.read()
+        self.assertEqual(len(data), 16 * len(history))
+        records = [(t, v, s) for (t, s, v) in struct.iter_unpack('=IId', data)]
+        self.assertEqual(records, history)
+
+        self.stop_daemon()
+
+    def test_history_downsampled(self):
+        '''check the downsampling methods of GetHistoryDownsampled'''
+
+        self.testbed.add_device('power_supply', 'BAT0', None,
+                                ['type', 'Battery',
+                                 'present', '1',
+                                 'status', 'Discharging',
+                                 'energy_full', '60000000',
+                                 'energy_full_design', '80000000',
+                                 'energy_now', '50000000',
+                                 'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        def get_history(method):
+            return self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                       'GetHistoryDownsampled',
+                                       GLib.Variant('(suus)', ('charge', 0, 100, method)),
+                                       None,
+                                       Gio.DBusCallFlags.NO_AUTO_START,
+                                       -1, None).unpack()[0]
+
+        history = self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                      'GetHistory',
+                                      GLib.Variant('(suu)', ('charge', 0, 100)),
+                                      None,
+                                      Gio.DBusCallFlags.NO_AUTO_START,
+                                      -1, None).unpack()[0]
+        self.assertGreater(len(history), 0)
+
+        # with few points, all of them are returned
+        self.assertEqual(get_history('average'), history)
+        self.assertEqual(get_history('lttb'), history)
+        self.assertEqual(get_history('minmax'), history)
+
+        with self.assertRaises(GLib.GError) as cm:
+            get_history('spline')
+        self.assertIn('invalid downsampling method', cm.exception.message)
+
+        self.stop_daemon()
+
+    def test_history_multi(self):
+        '''check getting several types of history with GetHistoryMulti'''
+
+        self.testbed.add_device('power_supply', 'BAT0', None,
+                                ['type', 'Battery',
+                                 'present', '1',
+                                 'status', 'Discharging',
+                                 'energy_full', '60000000',
+                                 'energy_full_design', '80000000',
+                                 'energy_now', '50000000',
+                                 'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        def get_history_multi(types):
+            return self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                       'GetHistoryMulti',
+                                       GLib.Variant('(asuu)', (types, 0, 10)),
+                                       None,
+                                       Gio.DBusCallFlags.NO_AUTO_START,
+                                       -1, None).unpack()
+
+        (times, states, values) = get_history_multi(['charge', 'rate'])
+        self.assertGreater(len(times), 0)
+        self.assertLessEqual(len(times), 10)
+        self.assertEqual(times, sorted(times))
+        self.assertEqual(len(states), len(times))
+        self.assertEqual(len(values), 2)
+        self.assertEqual(len(values[0]), len(times))
+        self.assertEqual(len(values[1]), len(times))
+
+        with self.assertRaises(GLib.GError) as cm:
+            get_history_multi(['charge', 'voltage'])
+        self.assertIn('device has no history', cm.exception.message)
+
+        with self.assertRaises(GLib.GError) as cm:
+            get_history_multi([])
+        self.assertIn('no history types given', cm.exception.message)
+
+        self.stop_daemon()
+
+    def test_history_since(self):
+        '''check fetching new history with GetHistorySince'''
+
+        bat0 = self.testbed.add_device('power_supply', 'BAT0', None,
+                                       ['type', 'Battery',
+                                        'present', '1',
+                                        'status', 'Discharging',
+                                        'energy_full', '60000000',
+                                        'energy_full_design', '80000000',
+                                        'energy_now', '50000000',
+                                        'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        def get_history_since(since):
+            return self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                       'GetHistorySince',
+                                       GLib.Variant('(su)', ('charge', since)),
+                                       None,
+                                       Gio.DBusCallFlags.NO_AUTO_START,
+                                       -1, None).unpack()[0]
+
+        history = get_history_since(0)
+        self.assertGreater(len(history), 0)
+        self.assertEqual([p[0] for p in history], sorted(p[0] for p in history))
+        self.assertEqual(get_history_since(history[-1][0]), [])
+        generation = self.get_dbus_dev_property(bat0_up, 'HistoryGeneration')
+        self.assertGreater(generation, 0)
+        epoch = self.get_dbus_dev_property(bat0_up, 'HistoryEpoch')
+
+        # a new value is a new point, a second later
+        time.sleep(1)
+        self.testbed.set_attribute(bat0, 'energy_now', '40000000')
+        self.testbed.uevent(bat0, 'change')
+        self.assertEventually(lambda: self.get_dbus_dev_property(bat0_up, 'HistoryGeneration') > generation)
+        new = get_history_since(history[-1][0])
+        self.assertEqual(len(new), 1)
+        self.assertAlmostEqual(new[0][1], 66.666666, places=5)
+        # nothing was replaced, so the points from before are still valid
+        self.assertEqual(self.get_dbus_dev_property(bat0_up, 'HistoryEpoch'), epoch)
+
+        self.stop_daemon()
+
+    def test_history_reply_cache(self):
+        '''check that repeated history calls see new points'''
+
+        bat0 = self.testbed.add_device('power_supply', 'BAT0', None,
+                                       ['type', 'Battery',
+                                        'present', '1',
+                                        'status', 'Discharging',
+                                        'energy_full', '60000000',
+                                        'energy_full_design', '80000000',
+                                        'energy_now', '50000000',
+                                        'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        def call(method, args):
+            return self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                       method, args,
+                                       None,
+                                       Gio.DBusCallFlags.NO_AUTO_START,
+                                       -1, None).unpack()[0]
+
+        history = call('GetHistory', GLib.Variant('(suu)', ('charge', 0, 100)))
+        self.assertEqual(call('GetHistory', GLib.Variant('(suu)', ('charge', 0, 100))), history)
+        stats = call('GetStatistics', GLib.Variant('(s)', ('discharging',)))
+        self.assertEqual(call('GetStatistics', GLib.Variant('(s)', ('discharging',))), stats)
+
+        # a new point is not hidden by the earlier reply
+        generation = self.get_dbus_dev_property(bat0_up, 'HistoryGeneration')
+        time.sleep(1)
+        self.testbed.set_attribute(bat0, 'energy_now', '40000000')
+        self.testbed.uevent(bat0, 'change')
+        self.assertEventually(lambda: self.get_dbus_dev_property(bat0_up, 'HistoryGeneration') > generation)
+        new = call('GetHistory', GLib.Variant('(suu)', ('charge', 0, 100)))
+        self.assertEqual(len(new), len(history) + 1)
+
+        # nor are the replies from before the device lost its history
+        self.testbed.set_attribute(bat0, 'present', '0')
+        self.testbed.uevent(bat0, 'change')
+        self.assertEventually(lambda: self.get_dbus_dev_property(bat0_up, 'HasHistory'), value=False)
+        with self.assertRaises(GLib.GError) as cm:
+            call('GetHistory', GLib.Variant('(suu)', ('charge', 0, 100)))
+        self.assertIn('does not support getting history', cm.exception.message)
+        with self.assertRaises(GLib.GError) as cm:
+            call('GetStatistics', GLib.Variant('(s)', ('discharging',)))
+        self.assertIn('does not support getting stats', cm.exception.message)
+
+        self.stop_daemon()
+
+    def test_history_aggregate(self):
+        '''check the buckets of GetHistoryAggregate'''
+
+        self.testbed.add_device('power_supply', 'BAT0', None,
+                                ['type', 'Battery',
+                                 'present', '1',
+                                 'status', 'Discharging',
+                                 'energy_full', '60000000',
+                                 'energy_full_design', '80000000',
+                                 'energy_now', '50000000',
+                                 'voltage_now', '12000000'], [])
+
+        self.start_daemon()
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        def get_aggregate(kind, buckets):
+            return self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                       'GetHistoryAggregate',
+                                       GLib.Variant('(suu)', (kind, 0, buckets)),
+                                       None,
+                                       Gio.DBusCallFlags.NO_AUTO_START,
+                                       -1, None).unpack()[0]
+
+        data = get_aggregate('charge', 10)
+        self.assertGreater(len(data), 0)
+        self.assertLessEqual(len(data), 10)
+        for (time, min_value, max_value, mean, count, state) in data:
+            self.assertGreater(count, 0)
+            self.assertLessEqual(min_value, mean)
+            self.assertLessEqual(mean, max_value)
+
+        self.assertEqual(get_aggregate('charge', 0), [])
+
+        with self.assertRaises(GLib.GError) as cm:
+            get_aggregate('voltage', 10)
+        self.assertIn('device has no history', cm.exception.message)
+
+        self.stop_daemon()
+
+    def test_history_export_import(self):
+        '''check exporting and importing history with the upower tool'''
+
+        self.testbed.add_device('power_supply', 'BAT0', None,
+                                ['type', 'Battery',
+                                 'present', '1',
+                                 'status', 'Discharging',
+                                 'energy_full', '60000000',
+                                 'energy_full_design', '80000000',
+                                 'energy_now', '50000000',
+                                 'voltage_now', '12000000'], [])
+
+        self.start_daemon(debug=True)
+
+        devs = self.proxy.EnumerateDevices()
+        self.assertEqual(len(devs), 1)
+        bat0_up = devs[0]
+
+        out = subprocess.check_output([self.upower_path, '--export-history', bat0_up],
+                                      universal_newlines=True)
+        lines = out.splitlines()
+        self.assertEqual(lines[0], 'time,value,state')
+        self.assertGreater(len(lines), 1)
+
+        # points can be in any order
+        now = int(time.time())
+        csv = 'time,value,state\n%i,15.5,discharging\n%i,10,discharging\n%i,20,charging\n' % (
+            now - 2000, now - 3000, now - 1000)
+        subprocess.run([self.upower_path, '--import-history', bat0_up, '--type', 'rate'],
+                       input=csv, universal_newlines=True, check=True)
+
+        history = self.dbus.call_sync(UP, bat0_up, UP_DEVICE,
+                                      'GetHistory',
+                                      GLib.Variant('(suu)', ('rate', 0, 100)),
+                                      None,
+                                      Gio.DBusCallFlags.NO_AUTO_START,
+                                      -1, None).unpack()[0]
+        expected = [(now - 3000, 10.0, UP_DEVICE_STATE_DISCHARGING),
+                    (now - 2000, 15.5, UP_DEVICE_STATE_DISCHARGING),
+                    (now - 1000, 20.0, UP_DEVICE_STATE_CHARGING)]
+        self.assertEqual(history[:3], expected)
+
+        data = subprocess.check_output([self.upower_path, '--export-history', bat0_up,
+                                        '--type', 'rate', '--format', 'binary',
+                                        '--since', str(now - 2500), '--until', str(now - 1500)])
+        records = [(t, v, s) for (t, s, v) in struct.iter_unpack('=IId', data)]
+        self.assertEqual(records, expected[1:2])
+
+        self.stop_daemon()
+
     def test_battery_id_change(self):
         '''check that we save/load the history correctly when the ID changes'''
 
@@ -1816,6 +2187,8 @@ class Tests(dbusmock.DBusTestCase):
         self.start_daemon()
 
         self.daemon_log.check_line("using id: Fake_Battery-80-001", timeout=1)
+        bat0_up = self.proxy.EnumerateDevices()[0]
+        epoch = self.get_dbus_dev_property(bat0_up, 'HistoryEpoch')
 
         # Change the serial of the battery
         self.testbed.set_attribute(bat0, 'energy_full_design', '90000000')
@@ -1823,18 +2196,21 @@ class Tests(dbusmock.DBusTestCase):
         self.testbed.uevent(bat0, 'change')
 
         # This saves the old history, and then opens a new one
-        self.daemon_log.check_line_re("saved .*/history-time-empty-Fake_Battery-80-001.dat", timeout=1)
+        self.daemon_log.check_line_re("saved Fake_Battery-80-001/time-empty to .*/history.db", timeout=1)
         self.daemon_log.check_line("using id: Fake_Battery-90-002", timeout=1)
 
         # Only happens once
         self.daemon_log.check_no_line("using id:", wait=1.0)
 
+        # the history of the old id is of no use to clients anymore
+        self.assertGreater(self.get_dbus_dev_property(bat0_up, 'HistoryEpoch'), epoch)
+
         # Remove the battery
         self.testbed.set_attribute(bat0, 'present', '0')
         self.testbed.uevent(bat0, 'change')
 
         # This saves the old history, and does *not* open a new one
-        self.daemon_log.check_line_re("saved .*/history-time-empty-Fake_Battery-90-002.dat", timeout=1)
+        self.daemon_log.check_line_re("saved Fake_Battery-90-002/time-empty to .*/history.db", timeout=1)
         self.daemon_log.check_no_line("using id:", wait=1.0)
 
         self.stop_daemon()
@@ -42,6 +42,7 @@
 #include "up-device-bluez.h"
 #include "up-input.h"
 #include "up-config.h"
+#include "up-history-writer.h"
 #ifdef HAVE_IDEVICE
 #include "up-device-idevice.h"
 #endif /* HAVE_IDEVICE */
@@ -120,32 +121,12 @@ static UpDevice *
 find_duplicate_device (UpBackend *backend,
 		       UpDevice  *device)
 {
-	GPtrArray *array;
-	g_autofree char *serial = NULL;
-	UpDevice *ret = NULL;
-	guint i;
+	GObject *ret;
 
-	g_object_get (G_OBJECT (device), "serial", &serial, NULL);
-	if (!serial)
-		return NULL;
-
-	array = up_device_list_get_array (backend->priv->device_list);
-	for (i = 0; i < array->len; i++) {
-		g_autofree char *s = NULL;
-		UpDevice *d;
-
-		d = UP_DEVICE (g_ptr_array_index (array, i));
-		if (d == device)
-			continue;
-		g_object_get (G_OBJECT (d), "serial", &s, NULL);
-		if (s && g_ascii_strcasecmp (s, serial) == 0) {
-			ret = g_object_ref (d);
-			break;
-		}
-	}
-	g_ptr_array_unref (array);
-
-	return ret;
+	ret = up_device_list_lookup_serial (backend->priv->device_list,
+					    up_exported_device_get_serial (UP_EXPORTED_DEVICE (device)),
+					    device);
+	return ret != NULL ? UP_DEVICE (ret) : NULL;
 }
 
 /* Returns TRUE if the added_device should be visible */
@@ -738,7 +719,11 @@ up_backend_prepare_for_sleep (GDBusConnection *connection,
 	g_variant_get (parameters, "(b)", &will_sleep);
 
 	if (will_sleep) {
+		g_autoptr(UpHistoryWriter) writer = up_history_writer_new ();
+
 		up_daemon_pause_poll (backend->priv->daemon);
+		/* the history is on disk before the delay lock is released */
+		up_history_writer_flush (writer, TRUE);
 		if (backend->priv->logind_delay_inhibitor_fd >= 0) {
 			close (backend->priv->logind_delay_inhibitor_fd);
 			backend->priv->logind_delay_inhibitor_fd = -1;
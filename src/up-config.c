@@ -74,7 +74,7 @@ up_config_get_uint (UpConfig *config, const gchar *key)
 gdouble
 up_config_get_double (UpConfig *config, const gchar *key)
 {
-	int val;
+	gdouble val;
 
 	val = g_key_file_get_double (config->priv->keyfile,
 				     "UPower", key, NULL);
@@ -84,6 +84,19 @@ up_config_get_double (UpConfig *config, const gchar *key)
 	return val;
 }
 
+/**
+ * up_config_has_key:
+ *
+ * Return value: %TRUE if @key is set, so that a built-in default can be
+ * used otherwise
+ **/
+gboolean
+up_config_has_key (UpConfig *config, const gchar *key)
+{
+	return g_key_file_has_key (config->priv->keyfile,
+				   "UPower", key, NULL);
+}
+
 /**
  * up_config_get_string:
  **/
@@ -56,6 +56,8 @@ gdouble		 up_config_get_double		(UpConfig	*config,
 						 const gchar	*key);
 gchar		*up_config_get_string           (UpConfig	*config,
 						 const gchar	*key);
+gboolean	 up_config_has_key		(UpConfig	*config,
+						 const gchar	*key);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC(UpConfig, g_object_unref)
 
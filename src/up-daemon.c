@@ -35,6 +35,7 @@
 #include "up-device.h"
 #include "up-backend.h"
 #include "up-daemon.h"
+#include "up-tick.h"
 
 struct UpDaemonPrivate
 {
@@ -47,11 +48,17 @@ struct UpDaemonPrivate
 	guint			 refresh_batteries_id;
 	guint			 warning_level_id;
 	gboolean                 poll_paused;
-	GSource                 *poll_source;
+	UpTick			*tick;
+	guint			 poll_tick_id;
+	GHashTable		*poll_entries;	/* UpDevice → UpDaemonPollEntry */
+	GPtrArray		*poll_queue;	/* binary heap by poll time */
+	guint			 poll_slack;
 	int			 critical_action_lock_fd;
 
 	/* Display battery properties */
 	UpDevice		*display_device;
+	GHashTable		*contributions;	/* UpDevice → UpDaemonContribution */
+	GPtrArray		*display_sources; /* the contributions that count */
 	UpDeviceKind		 kind;
 	UpDeviceState		 state;
 	gdouble			 percentage;
@@ -74,6 +81,31 @@ struct UpDaemonPrivate
 	const char		*state_dir_override;
 };
 
+/* What a device adds to the display device, kept so that the display
+ * device can be updated without reading every device again. */
+typedef struct {
+	UpDeviceKind		 kind;
+	UpDeviceState		 state;
+	gboolean		 power_supply;
+	gdouble			 percentage;
+	gdouble			 energy;
+	gdouble			 energy_full;
+	gdouble			 energy_rate;
+	gint64			 time_to_empty;
+	gint64			 time_to_full;
+} UpDaemonContribution;
+
+/* When a polled device is due next, kept in a binary heap so that the
+ * poll source does not have to look at every device. */
+typedef struct {
+	UpDevice		*device;
+	gint64			 poll_time;
+	gint			 timeout;
+	guint			 pos;		/* in the heap */
+} UpDaemonPollEntry;
+
+#define UP_DAEMON_POLL_NOT_QUEUED	G_MAXUINT
+
 static void	up_daemon_finalize		(GObject	*object);
 static gboolean	up_daemon_get_on_battery_local	(UpDaemon	*daemon);
 static UpDeviceLevel up_daemon_get_warning_level_local(UpDaemon	*daemon);
@@ -106,28 +138,111 @@ up_daemon_get_number_devices_of_type (UpDaemon *daemon, UpDeviceKind type)
 	guint i;
 	UpDevice *device;
 	GPtrArray *array;
-	UpDeviceKind type_tmp;
 	guint count = 0;
 
-	/* ask each device */
-	array = up_device_list_get_array (daemon->priv->power_devices);
+	/* only the registered ones count */
+	array = up_device_list_get_kind (daemon->priv->power_devices, type);
 	for (i=0; i<array->len; i++) {
 		device = (UpDevice *) g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "type", &type_tmp,
-			      NULL);
-		if (type == type_tmp &&
-		    up_device_get_object_path (device) != NULL)
+		if (up_device_get_object_path (device) != NULL)
 			count++;
 	}
 	g_ptr_array_unref (array);
 	return count;
 }
 
+static gboolean
+up_daemon_contribution_counts (const UpDaemonContribution *contribution)
+{
+	return contribution->kind == UP_DEVICE_KIND_UPS ||
+	       (contribution->kind == UP_DEVICE_KIND_BATTERY && contribution->power_supply);
+}
+
+/**
+ * up_daemon_update_contribution:
+ * @prop: the property that changed, or %NULL to read the device
+ *
+ * Updates what @device adds to the display device if @prop is one it
+ * depends on. Only the exported values of @device are read.
+ *
+ * Returns: %TRUE if the display device may have changed.
+ **/
+static gboolean
+up_daemon_update_contribution (UpDaemon *daemon, UpDevice *device, const gchar *prop)
+{
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (device);
+	UpDaemonContribution *contribution;
+	UpDaemonContribution old;
+	gboolean counted;
+
+	if (prop != NULL &&
+	    g_strcmp0 (prop, "type") != 0 &&
+	    g_strcmp0 (prop, "state") != 0 &&
+	    g_strcmp0 (prop, "percentage") != 0 &&
+	    g_strcmp0 (prop, "energy") != 0 &&
+	    g_strcmp0 (prop, "energy-full") != 0 &&
+	    g_strcmp0 (prop, "energy-rate") != 0 &&
+	    g_strcmp0 (prop, "time-to-empty") != 0 &&
+	    g_strcmp0 (prop, "time-to-full") != 0 &&
+	    g_strcmp0 (prop, "power-supply") != 0 &&
+	    g_strcmp0 (prop, "update-time") != 0)
+		return FALSE;
+
+	contribution = g_hash_table_lookup (daemon->priv->contributions, device);
+	if (contribution == NULL) {
+		contribution = g_new0 (UpDaemonContribution, 1);
+		g_hash_table_insert (daemon->priv->contributions, device, contribution);
+	}
+	memcpy (&old, contribution, sizeof (UpDaemonContribution));
+	counted = up_daemon_contribution_counts (contribution);
+
+	contribution->kind = up_exported_device_get_type_ (skeleton);
+	contribution->state = up_exported_device_get_state (skeleton);
+	contribution->power_supply = up_exported_device_get_power_supply (skeleton);
+	contribution->percentage = up_exported_device_get_percentage (skeleton);
+	contribution->energy = up_exported_device_get_energy (skeleton);
+	contribution->energy_full = up_exported_device_get_energy_full (skeleton);
+	contribution->energy_rate = up_exported_device_get_energy_rate (skeleton);
+	contribution->time_to_empty = up_exported_device_get_time_to_empty (skeleton);
+	contribution->time_to_full = up_exported_device_get_time_to_full (skeleton);
+
+	/* peripherals never count, so their updates cost nothing more */
+	if (counted && !up_daemon_contribution_counts (contribution))
+		g_ptr_array_remove (daemon->priv->display_sources, contribution);
+	else if (!counted && up_daemon_contribution_counts (contribution))
+		g_ptr_array_add (daemon->priv->display_sources, contribution);
+	else if (!counted)
+		return FALSE;
+
+	/* a refresh of a battery that counts is always looked at */
+	return g_strcmp0 (prop, "update-time") == 0 ||
+	       memcmp (&old, contribution, sizeof (UpDaemonContribution)) != 0;
+}
+
+/**
+ * up_daemon_remove_contribution:
+ *
+ * Returns: %TRUE if the display device may have changed.
+ **/
+static gboolean
+up_daemon_remove_contribution (UpDaemon *daemon, UpDevice *device)
+{
+	UpDaemonContribution *contribution;
+	gboolean counted;
+
+	contribution = g_hash_table_lookup (daemon->priv->contributions, device);
+	if (contribution == NULL)
+		return FALSE;
+	counted = g_ptr_array_remove (daemon->priv->display_sources, contribution);
+	g_hash_table_remove (daemon->priv->contributions, device);
+	return counted;
+}
+
 /**
  * up_daemon_update_display_battery:
  *
- * Update our internal state.
+ * Update our internal state from what the batteries contribute, see
+ * up_daemon_update_contribution().
  *
  * Returns: %TRUE if the state changed.
  **/
@@ -135,7 +250,6 @@ static gboolean
 up_daemon_update_display_battery (UpDaemon *daemon)
 {
 	guint i;
-	GPtrArray *array;
 
 	UpDeviceKind kind_total = UP_DEVICE_KIND_UNKNOWN;
 	/* Abuse LAST to know if any battery had a state. */
@@ -149,33 +263,18 @@ up_daemon_update_display_battery (UpDaemon *daemon)
 	gboolean is_present_total = FALSE;
 	guint num_batteries = 0;
 
-	/* Gather state from each device */
-	array = up_device_list_get_array (daemon->priv->power_devices);
-	for (i = 0; i < array->len; i++) {
-		UpDevice *device;
-
-		UpDeviceState state = UP_DEVICE_STATE_UNKNOWN;
-		UpDeviceKind kind = UP_DEVICE_KIND_UNKNOWN;
-		gdouble percentage = 0.0;
-		gdouble energy = 0.0;
-		gdouble energy_full = 0.0;
-		gdouble energy_rate = 0.0;
-		gint64 time_to_empty = 0;
-		gint64 time_to_full = 0;
-		gboolean power_supply = FALSE;
-
-		device = g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "type", &kind,
-			      "state", &state,
-			      "percentage", &percentage,
-			      "energy", &energy,
-			      "energy-full", &energy_full,
-			      "energy-rate", &energy_rate,
-			      "time-to-empty", &time_to_empty,
-			      "time-to-full", &time_to_full,
-			      "power-supply", &power_supply,
-			      NULL);
+	/* Gather state from each device that counts */
+	for (i = 0; i < daemon->priv->display_sources->len; i++) {
+		const UpDaemonContribution *contribution = g_ptr_array_index (daemon->priv->display_sources, i);
+		UpDeviceState state = contribution->state;
+		UpDeviceKind kind = contribution->kind;
+		gdouble percentage = contribution->percentage;
+		gdouble energy = contribution->energy;
+		gdouble energy_full = contribution->energy_full;
+		gdouble energy_rate = contribution->energy_rate;
+		gint64 time_to_empty = contribution->time_to_empty;
+		gint64 time_to_full = contribution->time_to_full;
+		gboolean power_supply = contribution->power_supply;
 
 		/* When we have a UPS, it's either a desktop, and
 		 * has no batteries, or a laptop, in which case we
@@ -255,8 +354,6 @@ up_daemon_update_display_battery (UpDaemon *daemon)
 		percentage_total = percentage_total / num_batteries;
 
 out:
-	g_ptr_array_unref (array);
-
 	/* No battery means LAST state. If we have an UNKNOWN state (with
 	 * a battery) then try to infer one. */
 	if (state_total == UP_DEVICE_STATE_LAST) {
@@ -373,8 +470,8 @@ up_daemon_get_on_ac_local (UpDaemon *daemon, gboolean *has_ac)
 	if (has_ac)
 		*has_ac = FALSE;
 
-	/* ask each device */
-	array = up_device_list_get_array (daemon->priv->power_devices);
+	/* ask each line power device, nothing else can be online */
+	array = up_device_list_get_kind (daemon->priv->power_devices, UP_DEVICE_KIND_LINE_POWER);
 	for (i=0; i<array->len; i++) {
 		device = (UpDevice *) g_ptr_array_index (array, i);
 		ret = up_device_get_online (device, &online);
@@ -396,20 +493,11 @@ up_daemon_refresh_battery_devices_idle (UpDaemon *daemon)
 	GPtrArray *array;
 	UpDevice *device;
 
-	/* refresh all devices in array */
-	array = up_device_list_get_array (daemon->priv->power_devices);
+	/* refresh all battery devices powering the system */
+	array = up_device_list_get_power_supplies (daemon->priv->power_devices);
 	for (i=0; i<array->len; i++) {
-		UpDeviceKind type;
-		gboolean power_supply;
-
 		device = (UpDevice *) g_ptr_array_index (array, i);
-		/* only refresh battery devices */
-		g_object_get (device,
-			      "type", &type,
-			      "power-supply", &power_supply,
-			      NULL);
-		if (type == UP_DEVICE_KIND_BATTERY &&
-		    power_supply)
+		if (up_exported_device_get_type_ (UP_EXPORTED_DEVICE (device)) == UP_DEVICE_KIND_BATTERY)
 			up_device_refresh_internal (device, UP_REFRESH_LINE_POWER);
 	}
 	g_ptr_array_unref (array);
@@ -566,6 +654,10 @@ up_daemon_shutdown (UpDaemon *daemon)
 
 	/* forget about discovered devices */
 	up_device_list_clear (daemon->priv->power_devices);
+	g_ptr_array_set_size (daemon->priv->display_sources, 0);
+	g_hash_table_remove_all (daemon->priv->contributions);
+	g_ptr_array_set_size (daemon->priv->poll_queue, 0);
+	g_hash_table_remove_all (daemon->priv->poll_entries);
 
 	/* release UpDaemon reference */
 	g_object_run_dispose (G_OBJECT (daemon->priv->display_device));
@@ -834,6 +926,167 @@ up_daemon_polkit_is_allowed (UpDaemon *daemon, const gchar *action_id, GDBusMeth
 	return TRUE;
 }
 
+/**
+ * up_daemon_poll_swap:
+ **/
+static void
+up_daemon_poll_swap (GPtrArray *queue, guint a, guint b)
+{
+	UpDaemonPollEntry *entry_a = g_ptr_array_index (queue, a);
+	UpDaemonPollEntry *entry_b = g_ptr_array_index (queue, b);
+
+	queue->pdata[a] = entry_b;
+	queue->pdata[b] = entry_a;
+	entry_a->pos = b;
+	entry_b->pos = a;
+}
+
+/**
+ * up_daemon_poll_sift:
+ *
+ * Moves the entry at @pos up or down the poll queue until the queue is
+ * ordered by poll time again.
+ **/
+static void
+up_daemon_poll_sift (GPtrArray *queue, guint pos)
+{
+	UpDaemonPollEntry *entry = g_ptr_array_index (queue, pos);
+
+	while (pos > 0) {
+		guint parent = (pos - 1) / 2;
+		UpDaemonPollEntry *tmp = g_ptr_array_index (queue, parent);
+		if (tmp->poll_time <= entry->poll_time)
+			break;
+		up_daemon_poll_swap (queue, pos, parent);
+		pos = parent;
+	}
+
+	for (;;) {
+		guint child = pos * 2 + 1;
+		UpDaemonPollEntry *tmp;
+
+		if (child >= queue->len)
+			break;
+		if (child + 1 < queue->len &&
+		    ((UpDaemonPollEntry *) g_ptr_array_index (queue, child + 1))->poll_time <
+		    ((UpDaemonPollEntry *) g_ptr_array_index (queue, child))->poll_time)
+			child++;
+		tmp = g_ptr_array_index (queue, child);
+		if (entry->poll_time <= tmp->poll_time)
+			break;
+		up_daemon_poll_swap (queue, pos, child);
+		pos = child;
+	}
+}
+
+/**
+ * up_daemon_poll_unqueue:
+ **/
+static void
+up_daemon_poll_unqueue (GPtrArray *queue, UpDaemonPollEntry *entry)
+{
+	guint pos = entry->pos;
+
+	if (pos == UP_DAEMON_POLL_NOT_QUEUED)
+		return;
+
+	up_daemon_poll_swap (queue, pos, queue->len - 1);
+	g_ptr_array_set_size (queue, queue->len - 1);
+	entry->pos = UP_DAEMON_POLL_NOT_QUEUED;
+	if (pos < queue->len)
+		up_daemon_poll_sift (queue, pos);
+}
+
+/**
+ * up_daemon_poll_reschedule:
+ *
+ * Wakes up the poll source when the first device in the queue is due.
+ **/
+static void
+up_daemon_poll_reschedule (UpDaemon *daemon)
+{
+	UpDaemonPrivate *priv = daemon->priv;
+	UpDaemonPollEntry *first;
+
+	if (priv->poll_tick_id == 0)
+		return;
+	if (priv->poll_paused || priv->poll_queue->len == 0) {
+		up_tick_schedule (priv->tick, priv->poll_tick_id, -1, 0);
+		return;
+	}
+	first = g_ptr_array_index (priv->poll_queue, 0);
+	up_tick_schedule (priv->tick, priv->poll_tick_id, first->poll_time, 0);
+}
+
+/**
+ * up_daemon_poll_update:
+ *
+ * Queues @device for its next poll, or takes it off the queue if it is
+ * not polled, after its timeout or last refresh changed.
+ **/
+static void
+up_daemon_poll_update (UpDaemon *daemon, UpDevice *device)
+{
+	GPtrArray *queue = daemon->priv->poll_queue;
+	UpDaemonPollEntry *entry;
+	gint timeout;
+	gint64 last_refresh;
+
+	entry = g_hash_table_lookup (daemon->priv->poll_entries, device);
+	if (entry == NULL)
+		return;
+
+	g_object_get (device,
+		      "poll-timeout", &timeout,
+		      "last-refresh", &last_refresh,
+		      NULL);
+	entry->timeout = timeout;
+	if (timeout <= 0) {
+		up_daemon_poll_unqueue (queue, entry);
+	} else {
+		entry->poll_time = last_refresh + (gint64) timeout * G_USEC_PER_SEC;
+		if (entry->pos == UP_DAEMON_POLL_NOT_QUEUED) {
+			entry->pos = queue->len;
+			g_ptr_array_add (queue, entry);
+		}
+		up_daemon_poll_sift (queue, entry->pos);
+	}
+	up_daemon_poll_reschedule (daemon);
+}
+
+/**
+ * up_daemon_poll_add:
+ **/
+static void
+up_daemon_poll_add (UpDaemon *daemon, UpDevice *device)
+{
+	UpDaemonPollEntry *entry;
+
+	if (!g_hash_table_contains (daemon->priv->poll_entries, device)) {
+		entry = g_new0 (UpDaemonPollEntry, 1);
+		entry->device = device;
+		entry->pos = UP_DAEMON_POLL_NOT_QUEUED;
+		g_hash_table_insert (daemon->priv->poll_entries, device, entry);
+	}
+	up_daemon_poll_update (daemon, device);
+}
+
+/**
+ * up_daemon_poll_remove:
+ **/
+static void
+up_daemon_poll_remove (UpDaemon *daemon, UpDevice *device)
+{
+	UpDaemonPollEntry *entry;
+
+	entry = g_hash_table_lookup (daemon->priv->poll_entries, device);
+	if (entry == NULL)
+		return;
+	up_daemon_poll_unqueue (daemon->priv->poll_queue, entry);
+	g_hash_table_remove (daemon->priv->poll_entries, device);
+	up_daemon_poll_reschedule (daemon);
+}
+
 /**
  * up_daemon_device_changed_cb:
  **/
@@ -847,10 +1100,9 @@ up_daemon_device_changed_cb (UpDevice *device, GParamSpec *pspec, UpDaemon *daem
 	g_return_if_fail (UP_IS_DEVICE (device));
 
 	prop = g_param_spec_get_name (pspec);
-	if (!daemon->priv->poll_paused &&
-	    ((g_strcmp0 (prop, "poll-timeout") == 0) ||
-	     (g_strcmp0 (prop, "last-refresh") == 0))) {
-		g_source_set_ready_time (daemon->priv->poll_source, 0);
+	if ((g_strcmp0 (prop, "poll-timeout") == 0) ||
+	    (g_strcmp0 (prop, "last-refresh") == 0)) {
+		up_daemon_poll_update (daemon, device);
 		return;
 	}
 
@@ -861,81 +1113,65 @@ up_daemon_device_changed_cb (UpDevice *device, GParamSpec *pspec, UpDaemon *daem
 	if (type == UP_DEVICE_KIND_LINE_POWER && g_strcmp0 (prop, "online") == 0) {
 		/* refresh now */
 		up_daemon_refresh_battery_devices (daemon);
+		up_daemon_update_warning_level (daemon);
+		return;
 	}
 
-	up_daemon_update_warning_level (daemon);
+	if (up_daemon_update_contribution (daemon, device, prop))
+		up_daemon_update_warning_level (daemon);
 }
 
-static gboolean
-up_daemon_poll_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+/**
+ * up_daemon_poll_cb:
+ **/
+static void
+up_daemon_poll_cb (gpointer user_data)
 {
 	UpDaemon *daemon = UP_DAEMON (user_data);
 	UpDaemonPrivate *priv = daemon->priv;
-	g_autoptr(GPtrArray) array = NULL;
+	g_autoptr(GPtrArray) batch = NULL;
 	guint i;
 	UpDevice *device;
-	gint64 ready_time = G_MAXINT64;
-	gint64 now = g_source_get_time (priv->poll_source);
-	gint max_dispatch_timeout = 0;
-
-	g_source_set_ready_time (priv->poll_source, -1);
-	g_assert (callback == NULL);
+	UpDaemonPollEntry *entry;
+	gint64 now = g_get_monotonic_time ();
+	gint64 slack = (gint64) priv->poll_slack * G_USEC_PER_SEC;
 
 	if (daemon->priv->poll_paused)
-		return G_SOURCE_CONTINUE;
-
-	/* Find the earliest device that needs a refresh. */
-	array = up_device_list_get_array (priv->power_devices);
-	for (i = 0; i < array->len; i += 1) {
-		gint timeout;
-		gint64 last_refresh;
-		gint64 poll_time;
-		gint64 dispatch_time;
-		device = (UpDevice *) g_ptr_array_index (array, i);
-		g_object_get (device,
-			      "poll-timeout", &timeout,
-			      "last-refresh", &last_refresh,
-			      NULL);
-
-		if (timeout <= 0)
-			continue;
+		return;
 
-		poll_time = last_refresh + timeout * G_USEC_PER_SEC;
+	/* Take the devices that are due, or will be soon enough to be
+	 * polled in the same wakeup, off the queue. */
+	batch = g_ptr_array_new_with_free_func (g_object_unref);
+	while (priv->poll_queue->len > 0) {
+		entry = g_ptr_array_index (priv->poll_queue, 0);
+		if (entry->poll_time > now + slack)
+			break;
+		up_daemon_poll_unqueue (priv->poll_queue, entry);
+		g_ptr_array_add (batch, g_object_ref (entry->device));
+	}
 
-		/* Allow dispatching early if another device got dispatched.
-		 * i.e. device polling will synchronize eventually.
-		 */
-		dispatch_time = poll_time - MIN(timeout, max_dispatch_timeout) * G_USEC_PER_SEC / 2;
+	for (i = 0; i < batch->len; i += 1) {
+		device = (UpDevice *) g_ptr_array_index (batch, i);
 
-		if (now >= dispatch_time) {
-			g_debug ("up_daemon_poll_dispatch: refreshing %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
+		/* Allow dispatching early by up to half the timeout, so
+		 * that device polling will synchronize eventually. */
+		entry = g_hash_table_lookup (priv->poll_entries, device);
+		if (entry != NULL &&
+		    now >= entry->poll_time - MIN(slack, (gint64) entry->timeout * G_USEC_PER_SEC / 2)) {
+			g_debug ("up_daemon_poll_cb: refreshing %s", up_exported_device_get_native_path (UP_EXPORTED_DEVICE (device)));
 			up_device_refresh_internal (device, UP_REFRESH_POLL);
-			max_dispatch_timeout = MAX(max_dispatch_timeout, timeout);
-
-			/* We'll wake up again immediately and then
-			 * calculate the correct time to re-poll. */
 		}
 
-		ready_time = MIN(ready_time, poll_time);
+		/* Queue it again if the refresh did not, or if it was
+		 * not due yet. */
+		entry = g_hash_table_lookup (priv->poll_entries, device);
+		if (entry != NULL && entry->pos == UP_DAEMON_POLL_NOT_QUEUED)
+			up_daemon_poll_update (daemon, device);
 	}
 
-	if (ready_time == G_MAXINT64)
-		ready_time = -1;
-
-	/* Set the ready time (if it was not modified externally) */
-	if (g_source_get_ready_time (priv->poll_source) == -1)
-		g_source_set_ready_time (priv->poll_source, ready_time);
-
-	return G_SOURCE_CONTINUE;
+	up_daemon_poll_reschedule (daemon);
 }
 
-GSourceFuncs poll_source_funcs = {
-	.prepare = NULL,
-	.check = NULL,
-	.dispatch = up_daemon_poll_dispatch,
-	.finalize = NULL,
-};
-
 /**
  * up_daemon_pause_poll:
  *
@@ -962,7 +1198,7 @@ up_daemon_resume_poll (UpDaemon *daemon)
 
 	daemon->priv->poll_paused = FALSE;
 
-	g_source_set_ready_time (daemon->priv->poll_source, 0);
+	up_daemon_poll_reschedule (daemon);
 }
 
 void
@@ -1013,6 +1249,10 @@ up_daemon_device_added_cb (UpBackend *backend, UpDevice *device, UpDaemon *daemo
 	/* connect, so we get changes */
 	g_signal_connect (device, "notify",
 			  G_CALLBACK (up_daemon_device_changed_cb), daemon);
+	up_daemon_update_contribution (daemon, device, NULL);
+
+	/* Ensure we poll the new device if needed */
+	up_daemon_poll_add (daemon, device);
 
 	/* emit */
 	object_path = up_device_get_object_path (device);
@@ -1022,8 +1262,6 @@ up_daemon_device_added_cb (UpBackend *backend, UpDevice *device, UpDaemon *daemo
 		return;
 	}
 
-	/* Ensure we poll the new device if needed */
-	g_source_set_ready_time (daemon->priv->poll_source, 0);
 
 	g_debug ("emitting added: %s", object_path);
 	up_daemon_update_warning_level (daemon);
@@ -1046,6 +1284,8 @@ up_daemon_device_removed_cb (UpBackend *backend, UpDevice *device, UpDaemon *dae
 
 	/* remove from list (device remains valid during the function call) */
 	up_device_list_remove (priv->power_devices, device);
+	up_daemon_remove_contribution (daemon, device);
+	up_daemon_poll_remove (daemon, device);
 
 	/* emit */
 	object_path = up_device_get_object_path (device);
@@ -1120,15 +1360,16 @@ up_daemon_init (UpDaemon *daemon)
 	daemon->priv->config = up_config_new ();
 	daemon->priv->power_devices = up_device_list_new ();
 	daemon->priv->display_device = up_device_new (daemon, NULL);
-	daemon->priv->poll_source = g_source_new (&poll_source_funcs, sizeof (GSource));
-
-	g_source_set_callback (daemon->priv->poll_source, NULL, daemon, NULL);
-	g_source_set_name (daemon->priv->poll_source, "up-device-poll");
-	g_source_attach (daemon->priv->poll_source, NULL);
-	/* g_source_destroy removes the last reference */
-	g_source_unref (daemon->priv->poll_source);
+	daemon->priv->contributions = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	daemon->priv->display_sources = g_ptr_array_new ();
+	daemon->priv->poll_entries = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+	daemon->priv->poll_queue = g_ptr_array_new ();
+	daemon->priv->tick = up_tick_new ();
+	daemon->priv->poll_tick_id = up_tick_add (daemon->priv->tick, "poll",
+						  up_daemon_poll_cb, daemon);
 
 	daemon->priv->use_percentage_for_policy = up_config_get_boolean (daemon->priv->config, "UsePercentageForPolicy");
+	daemon->priv->poll_slack = up_config_get_uint (daemon->priv->config, "PollSlack");
 	load_percentage_policy (daemon, FALSE);
 	load_time_policy (daemon, FALSE);
 	policy_config_validate (daemon);
@@ -1200,10 +1441,16 @@ up_daemon_finalize (GObject *object)
 		priv->critical_action_lock_fd = -1;
 	}
 
-	g_clear_pointer (&daemon->priv->poll_source, g_source_destroy);
+	up_tick_remove (priv->tick, priv->poll_tick_id);
+	priv->poll_tick_id = 0;
+	g_object_unref (priv->tick);
 
 	g_object_unref (priv->power_devices);
 	g_object_unref (priv->display_device);
+	g_ptr_array_unref (priv->display_sources);
+	g_hash_table_unref (priv->contributions);
+	g_ptr_array_unref (priv->poll_queue);
+	g_hash_table_unref (priv->poll_entries);
 	g_object_unref (priv->polkit);
 	g_object_unref (priv->config);
 	g_object_unref (priv->backend);
@@ -31,10 +31,30 @@
 
 static void	up_device_list_finalize	(GObject		*object);
 
+/* each device is linked into every index it belongs to, so removal
+ * never has to search */
+typedef struct {
+	UpDevice		*device;
+	gchar			*native_path;
+	gulong			 notify_id;
+	UpDeviceKind		 kind;
+	gboolean		 power_supply;
+	gchar			*serial;	/* lower case, or %NULL */
+	GList			 link;
+	GList			 kind_link;
+	GList			 power_supply_link;
+	GList			 serial_link;
+} UpDeviceListEntry;
+
 struct UpDeviceListPrivate
 {
-	GPtrArray		*array;
+	GQueue			 devices;
+	GPtrArray		*array;		/* snapshot of devices, or %NULL */
+	GHashTable		*entries;	/* device -> UpDeviceListEntry */
 	GHashTable		*map_native_path_to_device;
+	GQueue			 by_kind[UP_DEVICE_KIND_LAST];
+	GQueue			 power_supplies;
+	GHashTable		*by_serial;	/* serial -> GQueue */
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (UpDeviceList, up_device_list, G_TYPE_OBJECT)
@@ -65,6 +85,98 @@ up_device_list_lookup (UpDeviceList *list, GObject *native)
 	return g_object_ref (device);
 }
 
+/**
+ * up_device_list_index:
+ *
+ * Links @entry into the indexes for the current values of its device.
+ **/
+static void
+up_device_list_index (UpDeviceList *list, UpDeviceListEntry *entry)
+{
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (entry->device);
+	const gchar *serial;
+	GQueue *bucket;
+
+	entry->kind = up_exported_device_get_type_ (skeleton);
+	if (entry->kind >= UP_DEVICE_KIND_LAST)
+		entry->kind = UP_DEVICE_KIND_UNKNOWN;
+	g_queue_push_tail_link (&list->priv->by_kind[entry->kind], &entry->kind_link);
+
+	entry->power_supply = up_exported_device_get_power_supply (skeleton);
+	if (entry->power_supply)
+		g_queue_push_tail_link (&list->priv->power_supplies, &entry->power_supply_link);
+
+	serial = up_exported_device_get_serial (skeleton);
+	if (serial == NULL)
+		return;
+	entry->serial = g_ascii_strdown (serial, -1);
+	bucket = g_hash_table_lookup (list->priv->by_serial, entry->serial);
+	if (bucket == NULL) {
+		bucket = g_queue_new ();
+		g_hash_table_insert (list->priv->by_serial, g_strdup (entry->serial), bucket);
+	}
+	g_queue_push_tail_link (bucket, &entry->serial_link);
+}
+
+/**
+ * up_device_list_unindex:
+ **/
+static void
+up_device_list_unindex (UpDeviceList *list, UpDeviceListEntry *entry)
+{
+	GQueue *bucket;
+
+	g_queue_unlink (&list->priv->by_kind[entry->kind], &entry->kind_link);
+	if (entry->power_supply)
+		g_queue_unlink (&list->priv->power_supplies, &entry->power_supply_link);
+	entry->power_supply = FALSE;
+
+	if (entry->serial == NULL)
+		return;
+	bucket = g_hash_table_lookup (list->priv->by_serial, entry->serial);
+	g_queue_unlink (bucket, &entry->serial_link);
+	if (g_queue_is_empty (bucket))
+		g_hash_table_remove (list->priv->by_serial, entry->serial);
+	g_clear_pointer (&entry->serial, g_free);
+}
+
+/**
+ * up_device_list_notify_cb:
+ **/
+static void
+up_device_list_notify_cb (GObject *object, GParamSpec *pspec, UpDeviceList *list)
+{
+	UpDeviceListEntry *entry;
+
+	if (g_strcmp0 (pspec->name, "type") != 0 &&
+	    g_strcmp0 (pspec->name, "power-supply") != 0 &&
+	    g_strcmp0 (pspec->name, "serial") != 0)
+		return;
+
+	entry = g_hash_table_lookup (list->priv->entries, object);
+	if (entry == NULL)
+		return;
+	up_device_list_unindex (list, entry);
+	up_device_list_index (list, entry);
+}
+
+/**
+ * up_device_list_queue_to_array:
+ *
+ * Return value: the devices in @queue, free with g_ptr_array_unref()
+ **/
+static GPtrArray *
+up_device_list_queue_to_array (GQueue *queue)
+{
+	GPtrArray *array;
+	GList *l;
+
+	array = g_ptr_array_new_full (queue->length, g_object_unref);
+	for (l = queue->head; l != NULL; l = l->next)
+		g_ptr_array_add (array, g_object_ref (l->data));
+	return array;
+}
+
 /**
  * up_device_list_insert:
  *
@@ -76,6 +188,7 @@ up_device_list_insert (UpDeviceList *list, gpointer device)
 {
 	GObject *native;
 	const gchar *native_path;
+	UpDeviceListEntry *entry;
 
 	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), FALSE);
 	g_return_val_if_fail (device != NULL, FALSE);
@@ -90,22 +203,48 @@ up_device_list_insert (UpDeviceList *list, gpointer device)
 	}
 	g_hash_table_insert (list->priv->map_native_path_to_device,
 			     g_strdup (native_path), g_object_ref (device));
-	g_ptr_array_add (list->priv->array, g_object_ref (device));
+
+	/* already in the list, only the mapping may have changed */
+	entry = g_hash_table_lookup (list->priv->entries, device);
+	if (entry != NULL) {
+		if (g_strcmp0 (entry->native_path, native_path) != 0 &&
+		    g_hash_table_lookup (list->priv->map_native_path_to_device, entry->native_path) == device)
+			g_hash_table_remove (list->priv->map_native_path_to_device, entry->native_path);
+		g_free (entry->native_path);
+		entry->native_path = g_strdup (native_path);
+		return TRUE;
+	}
+
+	entry = g_new0 (UpDeviceListEntry, 1);
+	entry->device = g_object_ref (device);
+	entry->native_path = g_strdup (native_path);
+	entry->link.data = device;
+	entry->kind_link.data = device;
+	entry->power_supply_link.data = device;
+	entry->serial_link.data = device;
+	g_queue_push_tail_link (&list->priv->devices, &entry->link);
+	up_device_list_index (list, entry);
+	entry->notify_id = g_signal_connect (device, "notify",
+					     G_CALLBACK (up_device_list_notify_cb), list);
+	g_hash_table_insert (list->priv->entries, device, entry);
+	g_clear_pointer (&list->priv->array, g_ptr_array_unref);
 	g_debug ("added %s", native_path);
 	return TRUE;
 }
 
 /**
- * up_device_list_remove_cb:
+ * up_device_list_entry_free:
+ *
+ * Drops the reference @entry holds; it must already be unlinked.
  **/
-static gboolean
-up_device_list_remove_cb (gpointer key, gpointer value, gpointer user_data)
+static void
+up_device_list_entry_free (UpDeviceListEntry *entry)
 {
-	if (value == user_data) {
-		g_debug ("removed %s", (char *) key);
-		return TRUE;
-	}
-	return FALSE;
+	g_signal_handler_disconnect (entry->device, entry->notify_id);
+	g_object_unref (entry->device);
+	g_free (entry->native_path);
+	g_free (entry->serial);
+	g_free (entry);
 }
 
 /**
@@ -114,13 +253,25 @@ up_device_list_remove_cb (gpointer key, gpointer value, gpointer user_data)
 gboolean
 up_device_list_remove (UpDeviceList *list, gpointer device)
 {
+	UpDeviceListEntry *entry;
+
 	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), FALSE);
 	g_return_val_if_fail (device != NULL, FALSE);
 
-	/* remove the device from the db */
-	g_hash_table_foreach_remove (list->priv->map_native_path_to_device,
-				     up_device_list_remove_cb, device);
-	g_ptr_array_remove (list->priv->array, device);
+	entry = g_hash_table_lookup (list->priv->entries, device);
+	if (entry == NULL)
+		return FALSE;
+
+	/* remove the device from the db, unless the path was reused */
+	if (g_hash_table_lookup (list->priv->map_native_path_to_device, entry->native_path) == device)
+		g_hash_table_remove (list->priv->map_native_path_to_device, entry->native_path);
+	g_debug ("removed %s", entry->native_path);
+
+	g_hash_table_steal (list->priv->entries, device);
+	g_queue_unlink (&list->priv->devices, &entry->link);
+	up_device_list_unindex (list, entry);
+	g_clear_pointer (&list->priv->array, g_ptr_array_unref);
+	up_device_list_entry_free (entry);
 
 	/* we're removed the last instance? */
 	if (!G_IS_OBJECT (device)) {
@@ -140,16 +291,26 @@ up_device_list_remove (UpDeviceList *list, gpointer device)
 void
 up_device_list_clear (UpDeviceList *list)
 {
+	UpDeviceListEntry *entry;
+	GList *link;
+
 	g_return_if_fail (UP_IS_DEVICE_LIST (list));
 
+	while ((link = g_queue_pop_head_link (&list->priv->devices)) != NULL) {
+		entry = g_hash_table_lookup (list->priv->entries, link->data);
+		g_hash_table_steal (list->priv->entries, link->data);
+		up_device_list_unindex (list, entry);
+		up_device_list_entry_free (entry);
+	}
 	g_hash_table_remove_all (list->priv->map_native_path_to_device);
-	g_ptr_array_set_size (list->priv->array, 0);
+	g_clear_pointer (&list->priv->array, g_ptr_array_unref);
 }
 
 /**
  * up_device_list_get_array:
  *
- * This is quick to iterate when we don't have GObject's to resolve
+ * This is quick to iterate when we don't have GObject's to resolve.
+ * The array is not changed when devices are added or removed later.
  *
  * Return value: the array, free with g_ptr_array_unref()
  **/
@@ -157,9 +318,71 @@ GPtrArray	*
 up_device_list_get_array (UpDeviceList *list)
 {
 	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+	if (list->priv->array == NULL)
+		list->priv->array = up_device_list_queue_to_array (&list->priv->devices);
 	return g_ptr_array_ref (list->priv->array);
 }
 
+/**
+ * up_device_list_get_kind:
+ *
+ * Gets the devices whose type is @kind, in the order they were added.
+ *
+ * Return value: the array, free with g_ptr_array_unref()
+ **/
+GPtrArray *
+up_device_list_get_kind (UpDeviceList *list, UpDeviceKind kind)
+{
+	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+	g_return_val_if_fail (kind < UP_DEVICE_KIND_LAST, NULL);
+	return up_device_list_queue_to_array (&list->priv->by_kind[kind]);
+}
+
+/**
+ * up_device_list_get_power_supplies:
+ *
+ * Gets the devices that power the system, in the order they were added.
+ *
+ * Return value: the array, free with g_ptr_array_unref()
+ **/
+GPtrArray *
+up_device_list_get_power_supplies (UpDeviceList *list)
+{
+	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+	return up_device_list_queue_to_array (&list->priv->power_supplies);
+}
+
+/**
+ * up_device_list_lookup_serial:
+ * @exclude: (nullable): a device to skip
+ *
+ * Finds the first device added whose serial matches @serial, ignoring
+ * ASCII case.
+ *
+ * Return value: the object, or %NULL if not found. Free with g_object_unref()
+ **/
+GObject *
+up_device_list_lookup_serial (UpDeviceList *list, const gchar *serial, gpointer exclude)
+{
+	g_autofree gchar *key = NULL;
+	GQueue *bucket;
+	GList *l;
+
+	g_return_val_if_fail (UP_IS_DEVICE_LIST (list), NULL);
+
+	if (serial == NULL)
+		return NULL;
+	key = g_ascii_strdown (serial, -1);
+	bucket = g_hash_table_lookup (list->priv->by_serial, key);
+	if (bucket == NULL)
+		return NULL;
+	for (l = bucket->head; l != NULL; l = l->next) {
+		if (l->data != exclude)
+			return g_object_ref (l->data);
+	}
+	return NULL;
+}
+
 /**
  * up_device_list_class_init:
  * @klass: The UpDeviceListClass
@@ -179,8 +402,9 @@ static void
 up_device_list_init (UpDeviceList *list)
 {
 	list->priv = up_device_list_get_instance_private (list);
-	list->priv->array = g_ptr_array_new_with_free_func (g_object_unref);
+	list->priv->entries = g_hash_table_new (g_direct_hash, g_direct_equal);
 	list->priv->map_native_path_to_device = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+	list->priv->by_serial = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_queue_free);
 }
 
 /**
@@ -196,8 +420,10 @@ up_device_list_finalize (GObject *object)
 
 	list = UP_DEVICE_LIST (object);
 
-	g_ptr_array_unref (list->priv->array);
+	up_device_list_clear (list);
+	g_hash_table_unref (list->priv->entries);
 	g_hash_table_unref (list->priv->map_native_path_to_device);
+	g_hash_table_unref (list->priv->by_serial);
 
 	G_OBJECT_CLASS (up_device_list_parent_class)->finalize (object);
 }
@@ -61,6 +61,12 @@ gboolean	 up_device_list_remove			(UpDeviceList		*list,
 							 gpointer		 device);
 void		 up_device_list_clear			(UpDeviceList		*list);
 GPtrArray	*up_device_list_get_array		(UpDeviceList		*list);
+GPtrArray	*up_device_list_get_kind		(UpDeviceList		*list,
+							 UpDeviceKind		 kind);
+GPtrArray	*up_device_list_get_power_supplies	(UpDeviceList		*list);
+GObject		*up_device_list_lookup_serial		(UpDeviceList		*list,
+							 const gchar		*serial,
+							 gpointer		 exclude);
 
 G_END_DECLS
 
@@ -19,14 +19,22 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "config.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <glib/gi18n-lib.h>
 #include <glib-object.h>
+#include <gio/gunixfdlist.h>
 
 #include "up-native.h"
 #include "up-device.h"
@@ -41,6 +49,11 @@ typedef struct
 	GObject			*native;
 
 	UpHistory		*history;
+	GPtrArray		*history_calls;	/* waiting for the history to load */
+	guint64			 history_generation;
+	guint64			 history_epoch;
+	GHashTable		*replies;	/* request → UpDeviceReply */
+	guint64			 replies_generation;
 	gboolean		 has_ever_refresh;
 
 	gint64			last_refresh;
@@ -52,7 +65,39 @@ typedef struct
 	gboolean		disconnected;
 } UpDevicePrivate;
 
+/* a finished reply to a history call, reused until the history changes */
+typedef struct {
+	GVariant		*reply;
+	gint64			 expires;	/* monotonic, or 0 for never */
+} UpDeviceReply;
+
+#define UP_DEVICE_REPLIES_MAX		16
+
+/* The serialized forms of (udu) and (dd), so that replies can be built
+ * from one buffer rather than point by point. */
+typedef struct {
+	guint32			 time;
+	guint32			 padding1;
+	gdouble			 value;
+	guint32			 state;
+	guint32			 padding2;
+} UpDeviceHistoryTuple;
+
+typedef struct {
+	gdouble			 value;
+	gdouble			 accuracy;
+} UpDeviceStatsTuple;
+
+G_STATIC_ASSERT (sizeof (UpDeviceHistoryTuple) == 24);
+G_STATIC_ASSERT (sizeof (UpDeviceStatsTuple) == 16);
+
 static void up_device_initable_iface_init (GInitableIface *iface);
+static gboolean up_device_import_history (UpExportedDevice *skeleton,
+					  GDBusMethodInvocation *invocation,
+					  GUnixFDList *fd_list,
+					  const gchar *type_string,
+					  gint handle,
+					  UpDevice *device);
 
 G_DEFINE_TYPE_EXTENDED (UpDevice, up_device, UP_TYPE_EXPORTED_DEVICE_SKELETON, 0,
                         G_IMPLEMENT_INTERFACE (G_TYPE_INITABLE,
@@ -74,6 +119,7 @@ static GParamSpec *properties[N_PROPS];
 #define UP_DEVICES_DBUS_PATH "/org/freedesktop/UPower/devices"
 
 static gchar * up_device_get_id (UpDevice *device);
+static void up_device_history_loaded_cb (GObject *source_object, GAsyncResult *res, gpointer user_data);
 
 /* This needs to be called when one of those properties changes:
  * state
@@ -177,10 +223,31 @@ ensure_history (UpDevice *device)
 	if (priv->history)
 		return;
 
+	/* loaded in a thread, calls needing the data wait for it */
 	priv->history = up_history_new ();
 	id = up_device_get_id (device);
 	if (id)
-		up_history_set_id (priv->history, id);
+		up_history_load_async (priv->history, id, NULL,
+				       up_device_history_loaded_cb, g_object_ref (device));
+}
+
+/**
+ * up_device_defer_history_call:
+ *
+ * Keeps the call to answer it once the history has been loaded, when it
+ * is dispatched again to the handler of its method.
+ **/
+static gboolean
+up_device_defer_history_call (UpDevice *device, GDBusMethodInvocation *invocation)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+
+	if (!up_history_is_loading (priv->history))
+		return FALSE;
+	if (priv->history_calls == NULL)
+		priv->history_calls = g_ptr_array_new ();
+	g_ptr_array_add (priv->history_calls, invocation);
+	return TRUE;
 }
 
 static gboolean
@@ -196,6 +263,164 @@ up_device_history_filter (UpDevice *device, UpHistory *history)
 	return TRUE;
 }
 
+static guint64
+up_device_get_history_generation (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	guint64 generation = 0;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		generation += up_history_get_generation (priv->history, i);
+	return generation;
+}
+
+static guint64
+up_device_get_history_epoch (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	guint64 epoch = 0;
+	guint i;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		epoch += up_history_get_epoch (priv->history, i);
+	return epoch;
+}
+
+static void
+up_device_reply_free (UpDeviceReply *reply)
+{
+	g_variant_unref (reply->reply);
+	g_free (reply);
+}
+
+/**
+ * up_device_lookup_reply:
+ *
+ * Return value: (transfer none): the reply to an earlier call with the
+ * same @key, or %NULL if the history has changed since
+ **/
+static GVariant *
+up_device_lookup_reply (UpDevice *device, const gchar *key)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpDeviceReply *reply;
+	guint64 generation;
+
+	if (priv->replies == NULL || priv->history == NULL ||
+	    up_history_is_loading (priv->history))
+		return NULL;
+
+	generation = up_device_get_history_generation (device);
+	if (generation != priv->replies_generation) {
+		g_hash_table_remove_all (priv->replies);
+		priv->replies_generation = generation;
+		return NULL;
+	}
+
+	reply = g_hash_table_lookup (priv->replies, key);
+	if (reply == NULL)
+		return NULL;
+	if (reply->expires != 0 && g_get_monotonic_time () > reply->expires) {
+		g_hash_table_remove (priv->replies, key);
+		return NULL;
+	}
+	return reply->reply;
+}
+
+/**
+ * up_device_cache_reply:
+ * @key: (transfer full): what the call asked for
+ * @lifetime: how long the reply stays right without new points, in
+ *            microseconds, or 0 for as long as there are none
+ *
+ * Keeps a reply to answer the same call with until the history changes.
+ **/
+static void
+up_device_cache_reply (UpDevice *device, gchar *key, GVariant *value, gint64 lifetime)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpDeviceReply *reply;
+
+	if (priv->replies == NULL) {
+		priv->replies = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+						       (GDestroyNotify) up_device_reply_free);
+		priv->replies_generation = up_device_get_history_generation (device);
+	}
+
+	/* the same few calls are made over and over, so just start again */
+	if (g_hash_table_size (priv->replies) >= UP_DEVICE_REPLIES_MAX)
+		g_hash_table_remove_all (priv->replies);
+
+	reply = g_new0 (UpDeviceReply, 1);
+	reply->reply = g_variant_ref_sink (value);
+	if (lifetime > 0)
+		reply->expires = g_get_monotonic_time () + lifetime;
+	g_hash_table_replace (priv->replies, key, reply);
+}
+
+/**
+ * up_device_update_history_generation:
+ *
+ * Bumps the HistoryGeneration property if any series of the history
+ * changed, and the HistoryEpoch property if any was replaced rather
+ * than added to. The history object is replaced when the device id
+ * changes, so its own counters cannot be exported as they are.
+ **/
+static void
+up_device_update_history_generation (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (device);
+	guint64 generation;
+	guint64 epoch;
+
+	if (priv->history == NULL)
+		return;
+
+	/* set the epoch first, so clients see it with the new generation */
+	epoch = up_device_get_history_epoch (device);
+	if (epoch != priv->history_epoch) {
+		priv->history_epoch = epoch;
+		up_exported_device_set_history_epoch (skeleton,
+						      up_exported_device_get_history_epoch (skeleton) + 1);
+	}
+
+	generation = up_device_get_history_generation (device);
+	if (generation == priv->history_generation)
+		return;
+	priv->history_generation = generation;
+	up_exported_device_set_history_generation (skeleton,
+						   up_exported_device_get_history_generation (skeleton) + 1);
+}
+
+/**
+ * up_device_clear_history:
+ *
+ * Drops the history object when the device id has changed, so that the
+ * one for the new id gets loaded lazily.
+ **/
+static void
+up_device_clear_history (UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	UpExportedDevice *skeleton = UP_EXPORTED_DEVICE (device);
+
+	if (priv->history == NULL ||
+	    up_history_is_device_id_equal (priv->history, up_device_get_id (device)))
+		return;
+
+	g_clear_object (&priv->history);
+	/* none of the points are the same, and whatever the new one has
+	 * is a change */
+	priv->history_generation = G_MAXUINT64;
+	priv->history_epoch = 0;
+	up_exported_device_set_history_epoch (skeleton,
+					      up_exported_device_get_history_epoch (skeleton) + 1);
+	if (priv->replies != NULL)
+		g_hash_table_remove_all (priv->replies);
+}
+
 static void
 update_history (UpDevice *device)
 {
@@ -213,6 +438,7 @@ update_history (UpDevice *device)
 	up_history_set_rate_data (priv->history, up_exported_device_get_energy_rate (skeleton));
 	up_history_set_time_full_data (priv->history, up_exported_device_get_time_to_full (skeleton));
 	up_history_set_time_empty_data (priv->history, up_exported_device_get_time_to_empty (skeleton));
+	up_device_update_history_generation (device);
 }
 
 static void
@@ -230,16 +456,11 @@ up_device_notify (GObject *object, GParamSpec *pspec)
 	if (g_strcmp0 (pspec->name, "type") == 0 ||
 	    g_strcmp0 (pspec->name, "is-present") == 0) {
 		update_icon_name (device);
-		/* Clearing the history object for lazily loading when device id was changed. */
-		if (priv->history != NULL &&
-		    !up_history_is_device_id_equal (priv->history, up_device_get_id(device)))
-			g_clear_object (&priv->history);
+		up_device_clear_history (device);
 	} else if (g_strcmp0 (pspec->name, "vendor") == 0 ||
 		   g_strcmp0 (pspec->name, "model") == 0 ||
 		   g_strcmp0 (pspec->name, "serial") == 0) {
-		if (priv->history != NULL &&
-		    !up_history_is_device_id_equal (priv->history, up_device_get_id(device)))
-			g_clear_object (&priv->history);
+		up_device_clear_history (device);
 	} else if (g_strcmp0 (pspec->name, "power-supply") == 0 ||
 		   g_strcmp0 (pspec->name, "time-to-empty") == 0) {
 		update_warning_level (device);
@@ -524,9 +745,12 @@ up_device_initable_init (GInitable     *initable,
 
 	g_return_val_if_fail (UP_IS_DEVICE (device), FALSE);
 
-	if (up_daemon_get_debug (priv->daemon))
+	if (up_daemon_get_debug (priv->daemon)) {
 		g_signal_connect (device, "handle-refresh",
 				  G_CALLBACK (up_device_refresh), device);
+		g_signal_connect (device, "handle-import-history",
+				  G_CALLBACK (up_device_import_history), device);
+	}
 	if (priv->native) {
 		native_path = up_native_get_native_path (priv->native);
 		up_exported_device_set_native_path (UP_EXPORTED_DEVICE (device), native_path);
@@ -574,10 +798,12 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 			  UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autofree gchar *key = NULL;
 	GPtrArray *array = NULL;
 	UpStatsItem *item;
+	UpDeviceStatsTuple *tuples;
+	GVariant *reply;
 	guint i;
-	GVariantBuilder builder;
 
 	if (!up_exported_device_get_has_statistics (skeleton)) {
 		g_dbus_method_invocation_return_error_literal (invocation,
@@ -586,7 +812,16 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 		goto out;
 	}
 
+	key = g_strdup_printf ("GetStatistics %s", type);
+	reply = up_device_lookup_reply (device, key);
+	if (reply != NULL) {
+		up_exported_device_complete_get_statistics (skeleton, invocation, reply);
+		return TRUE;
+	}
+
 	ensure_history (device);
+	if (up_device_defer_history_call (device, invocation))
+		goto out;
 
 	/* get the correct data */
 	if (g_strcmp0 (type, "charging") == 0)
@@ -611,22 +846,132 @@ up_device_get_statistics (UpExportedDevice *skeleton,
 	}
 
 	/* copy data to dbus struct */
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(dd)"));
+	tuples = g_new (UpDeviceStatsTuple, array->len);
 	for (i = 0; i < array->len; i++) {
 		item = (UpStatsItem *) g_ptr_array_index (array, i);
-		g_variant_builder_add (&builder, "(dd)",
-				       up_stats_item_get_value (item),
-				       up_stats_item_get_accuracy (item));
+		tuples[i].value = up_stats_item_get_value (item);
+		tuples[i].accuracy = up_stats_item_get_accuracy (item);
 	}
 
-	up_exported_device_complete_get_statistics (skeleton, invocation,
-						    g_variant_builder_end (&builder));
+	reply = g_variant_new_from_data (G_VARIANT_TYPE ("a(dd)"), tuples,
+					 array->len * sizeof (UpDeviceStatsTuple),
+					 TRUE, g_free, tuples);
+	up_device_cache_reply (device, g_steal_pointer (&key), reply, 0);
+	up_exported_device_complete_get_statistics (skeleton, invocation, reply);
 out:
 	if (array != NULL)
 		g_ptr_array_unref (array);
 	return TRUE;
 }
 
+/**
+ * up_device_history_type_from_string:
+ **/
+static UpHistoryType
+up_device_history_type_from_string (const gchar *type_string)
+{
+	if (g_strcmp0 (type_string, "rate") == 0)
+		return UP_HISTORY_TYPE_RATE;
+	if (g_strcmp0 (type_string, "charge") == 0)
+		return UP_HISTORY_TYPE_CHARGE;
+	if (g_strcmp0 (type_string, "time-full") == 0)
+		return UP_HISTORY_TYPE_TIME_FULL;
+	if (g_strcmp0 (type_string, "time-empty") == 0)
+		return UP_HISTORY_TYPE_TIME_EMPTY;
+	return UP_HISTORY_TYPE_UNKNOWN;
+}
+
+/**
+ * up_device_prepare_history:
+ *
+ * Checks that the history asked for can be returned.
+ *
+ * Return value: %FALSE if the call has been answered with an error or
+ * deferred until the history has been loaded
+ **/
+static gboolean
+up_device_prepare_history (UpDevice *device,
+			   GDBusMethodInvocation *invocation,
+			   const gchar *type_string,
+			   UpHistoryType *type)
+{
+	/* doesn't even try to support this */
+	if (!up_exported_device_get_has_history (UP_EXPORTED_DEVICE (device))) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		return FALSE;
+	}
+
+	/* something recognised */
+	*type = up_device_history_type_from_string (type_string);
+	if (*type == UP_HISTORY_TYPE_UNKNOWN) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		return FALSE;
+	}
+
+	ensure_history (device);
+	return !up_device_defer_history_call (device, invocation);
+}
+
+/**
+ * up_device_lookup_history:
+ *
+ * Returns the history asked for, or %NULL if the call has been answered
+ * with an error or deferred until the history has been loaded.
+ **/
+static GPtrArray *
+up_device_lookup_history (UpDevice *device,
+			  GDBusMethodInvocation *invocation,
+			  const gchar *type_string,
+			  guint timespan,
+			  guint resolution,
+			  UpHistoryDownsample method)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	GPtrArray *array;
+	UpHistoryType type;
+
+	if (!up_device_prepare_history (device, invocation, type_string, &type))
+		return NULL;
+	array = up_history_get_data_downsampled (priv->history, type, timespan, resolution, method);
+
+	/* maybe the device doesn't have any history */
+	if (array == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+	}
+	return array;
+}
+
+/**
+ * up_device_history_to_variant:
+ *
+ * Return value: (transfer floating): the a(udu) of the points
+ **/
+static GVariant *
+up_device_history_to_variant (GPtrArray *array)
+{
+	UpDeviceHistoryTuple *tuples;
+	UpHistoryItem *item;
+	guint i;
+
+	/* zeroed, as the padding is part of the serialized data */
+	tuples = g_new0 (UpDeviceHistoryTuple, array->len);
+	for (i = 0; i < array->len; i++) {
+		item = (UpHistoryItem *) g_ptr_array_index (array, i);
+		tuples[i].time = up_history_item_get_time (item);
+		tuples[i].value = up_history_item_get_value (item);
+		tuples[i].state = up_history_item_get_state (item);
+	}
+	return g_variant_new_from_data (G_VARIANT_TYPE ("a(udu)"), tuples,
+					array->len * sizeof (UpDeviceHistoryTuple),
+					TRUE, g_free, tuples);
+}
+
 static gboolean
 up_device_get_history (UpExportedDevice *skeleton,
 		       GDBusMethodInvocation *invocation,
@@ -636,63 +981,446 @@ up_device_get_history (UpExportedDevice *skeleton,
 		       UpDevice *device)
 {
 	UpDevicePrivate *priv = up_device_get_instance_private (device);
-	GPtrArray *array = NULL;
-	UpHistoryItem *item;
+	g_autofree gchar *key = NULL;
+	GPtrArray *array;
+	GVariant *reply;
+	UpHistoryType type;
+
+	/* a reply from when the device had history is no answer now */
+	if (!up_device_prepare_history (device, invocation, type_string, &type))
+		return TRUE;
+
+	key = g_strdup_printf ("GetHistory %s %u %u", type_string, timespan, resolution);
+	reply = up_device_lookup_reply (device, key);
+	if (reply != NULL) {
+		up_exported_device_complete_get_history (skeleton, invocation, reply);
+		return TRUE;
+	}
+
+	array = up_history_get_data_downsampled (priv->history, type, timespan, resolution,
+						 UP_HISTORY_DOWNSAMPLE_AVERAGE);
+	if (array == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		return TRUE;
+	}
+
+	/* the window moves with time, by a hundredth of it is close enough */
+	reply = up_device_history_to_variant (array);
+	up_device_cache_reply (device, g_steal_pointer (&key), reply,
+			       (gint64) timespan * G_USEC_PER_SEC / 100);
+	up_exported_device_complete_get_history (skeleton, invocation, reply);
+	g_ptr_array_unref (array);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_downsampled (UpExportedDevice *skeleton,
+				   GDBusMethodInvocation *invocation,
+				   const gchar *type_string,
+				   guint timespan,
+				   guint resolution,
+				   const gchar *method_string,
+				   UpDevice *device)
+{
+	GPtrArray *array;
+	UpHistoryDownsample method;
+
+	method = up_history_downsample_from_string (method_string);
+	if (method == UP_HISTORY_DOWNSAMPLE_UNKNOWN) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "invalid downsampling method %s", method_string);
+		return TRUE;
+	}
+
+	array = up_device_lookup_history (device, invocation, type_string, timespan, resolution, method);
+	if (array == NULL)
+		return TRUE;
+
+	up_exported_device_complete_get_history_downsampled (skeleton, invocation,
+							     up_device_history_to_variant (array));
+	g_ptr_array_unref (array);
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_aggregate (UpExportedDevice *skeleton,
+				 GDBusMethodInvocation *invocation,
+				 const gchar *type_string,
+				 guint timespan,
+				 guint buckets,
+				 UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autoptr(GArray) array = NULL;
+	GVariantBuilder builder;
+	UpHistoryType type;
 	guint i;
-	UpHistoryType type = UP_HISTORY_TYPE_UNKNOWN;
+
+	if (!up_device_prepare_history (device, invocation, type_string, &type))
+		return TRUE;
+	array = up_history_get_aggregate (priv->history, type, timespan, buckets);
+	if (array == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		return TRUE;
+	}
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uddduu)"));
+	for (i = 0; i < array->len; i++) {
+		const UpHistoryAggregate *bucket = &g_array_index (array, UpHistoryAggregate, i);
+
+		g_variant_builder_add (&builder, "(uddduu)",
+				       bucket->time, bucket->min, bucket->max, bucket->mean,
+				       bucket->count, bucket->state);
+	}
+	up_exported_device_complete_get_history_aggregate (skeleton, invocation,
+							   g_variant_builder_end (&builder));
+	return TRUE;
+}
+
+static gboolean
+up_device_get_history_multi (UpExportedDevice *skeleton,
+			     GDBusMethodInvocation *invocation,
+			     const gchar *const *type_strings,
+			     guint timespan,
+			     guint resolution,
+			     UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autoptr(UpHistoryColumns) columns = NULL;
+	g_autofree UpHistoryType *types = NULL;
 	GVariantBuilder builder;
+	GVariant *times;
+	GVariant *states;
+	guint n_types;
+	guint i;
 
-	/* doesn't even try to support this */
-	if (!up_exported_device_get_has_history (skeleton)) {
+	n_types = g_strv_length ((gchar **) type_strings);
+	if (n_types == 0) {
 		g_dbus_method_invocation_return_error_literal (invocation,
 							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
-							       "device does not support getting history");
-		goto out;
+							       "no history types given");
+		return TRUE;
 	}
 
-	/* get the correct data */
-	if (g_strcmp0 (type_string, "rate") == 0)
-		type = UP_HISTORY_TYPE_RATE;
-	else if (g_strcmp0 (type_string, "charge") == 0)
-		type = UP_HISTORY_TYPE_CHARGE;
-	else if (g_strcmp0 (type_string, "time-full") == 0)
-		type = UP_HISTORY_TYPE_TIME_FULL;
-	else if (g_strcmp0 (type_string, "time-empty") == 0)
-		type = UP_HISTORY_TYPE_TIME_EMPTY;
+	/* the first one defers the call if the history is still loading */
+	types = g_new (UpHistoryType, n_types);
+	for (i = 0; i < n_types; i++) {
+		if (!up_device_prepare_history (device, invocation, type_strings[i], &types[i]))
+			return TRUE;
+	}
+	columns = up_history_get_columns (priv->history, types, n_types, timespan, resolution);
+	if (columns == NULL) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		return TRUE;
+	}
 
-	/* something recognised */
-	if (type != UP_HISTORY_TYPE_UNKNOWN) {
-		ensure_history (device);
-		array = up_history_get_data (priv->history, type, timespan, resolution);
+	times = g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, columns->time,
+					   columns->len, sizeof (guint32));
+	states = g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32, columns->state,
+					    columns->len, sizeof (guint32));
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("aad"));
+	for (i = 0; i < n_types; i++) {
+		g_variant_builder_add_value (&builder,
+					     g_variant_new_fixed_array (G_VARIANT_TYPE_DOUBLE,
+									columns->value + i * columns->len,
+									columns->len, sizeof (gdouble)));
 	}
+	up_exported_device_complete_get_history_multi (skeleton, invocation, times, states,
+						       g_variant_builder_end (&builder));
+	return TRUE;
+}
 
-	/* maybe the device doesn't have any history */
+static gboolean
+up_device_get_history_since (UpExportedDevice *skeleton,
+			     GDBusMethodInvocation *invocation,
+			     const gchar *type_string,
+			     guint since,
+			     UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autoptr(GPtrArray) array = NULL;
+	UpHistoryType type;
+
+	if (!up_device_prepare_history (device, invocation, type_string, &type))
+		return TRUE;
+	array = up_history_get_data_since (priv->history, type, since);
 	if (array == NULL) {
 		g_dbus_method_invocation_return_error_literal (invocation,
 							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
 							       "device has no history");
-		goto out;
+		return TRUE;
 	}
 
-	/* copy data to dbus struct */
-	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(udu)"));
+	up_exported_device_complete_get_history_since (skeleton, invocation,
+						       up_device_history_to_variant (array));
+	return TRUE;
+}
+
+/**
+ * up_device_history_to_fd:
+ *
+ * Writes the history into an anonymous file, sealed where possible so
+ * the client can map it, and rewinds it for the client to read.
+ **/
+static gint
+up_device_history_to_fd (GPtrArray *array, GError **error)
+{
+	g_autofree UpHistoryPoint *records = NULL;
+	const guint8 *data;
+	gsize len;
+	gint fd = -1;
+	guint i;
+
+	records = g_new (UpHistoryPoint, MAX (array->len, 1));
 	for (i = 0; i < array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		g_variant_builder_add (&builder, "(udu)",
-				       up_history_item_get_time (item),
-				       up_history_item_get_value (item),
-				       up_history_item_get_state (item));
+		UpHistoryItem *item = g_ptr_array_index (array, i);
+
+		records[i].time = up_history_item_get_time (item);
+		records[i].state = up_history_item_get_state (item);
+		records[i].value = up_history_item_get_value (item);
 	}
 
-	up_exported_device_complete_get_history (skeleton, invocation,
-						 g_variant_builder_end (&builder));
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create ("upower-history", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+	if (fd < 0) {
+		g_autofree gchar *filename = NULL;
 
-out:
-	if (array != NULL)
-		g_ptr_array_unref (array);
+		fd = g_file_open_tmp ("upower-history-XXXXXX", &filename, error);
+		if (fd < 0)
+			return -1;
+		g_unlink (filename);
+	}
+
+	data = (const guint8 *) records;
+	len = array->len * sizeof (UpHistoryPoint);
+	while (len > 0) {
+		gssize written = write (fd, data, len);
+
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0) {
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+				     "failed to write history: %s", g_strerror (errno));
+			close (fd);
+			return -1;
+		}
+		data += written;
+		len -= written;
+	}
+
+#ifdef HAVE_MEMFD_CREATE
+	/* fails harmlessly for the temporary file */
+	fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+	if (lseek (fd, 0, SEEK_SET) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to rewind history: %s", g_strerror (errno));
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+static gboolean
+up_device_get_history_fd (UpExportedDevice *skeleton,
+			  GDBusMethodInvocation *invocation,
+			  GUnixFDList *fd_list,
+			  const gchar *type_string,
+			  guint timespan,
+			  guint resolution,
+			  UpDevice *device)
+{
+	g_autoptr(GPtrArray) array = NULL;
+	g_autoptr(GUnixFDList) out_fd_list = NULL;
+	g_autoptr(GError) error = NULL;
+	gint fd;
+
+	array = up_device_lookup_history (device, invocation, type_string, timespan, resolution,
+					  UP_HISTORY_DOWNSAMPLE_AVERAGE);
+	if (array == NULL)
+		return TRUE;
+
+	fd = up_device_history_to_fd (array, &error);
+	if (fd < 0) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "%s", error->message);
+		return TRUE;
+	}
+
+	/* the list takes ownership of the fd */
+	out_fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+	g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+								 g_variant_new ("(h)", 0),
+								 out_fd_list);
+	return TRUE;
+}
+
+/**
+ * up_device_history_from_fd:
+ *
+ * Reads the points passed to ImportHistory. Only regular files are
+ * accepted, so that reading cannot block the daemon.
+ **/
+static UpHistoryPoint *
+up_device_history_from_fd (gint fd, guint *len, GError **error)
+{
+	g_autofree UpHistoryPoint *points = NULL;
+	GStatBuf buf;
+	guint8 *data;
+	gsize size;
+	gsize done = 0;
+	guint i;
+
+	if (fstat (fd, &buf) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to get history size: %s", g_strerror (errno));
+		return NULL;
+	}
+	if (!S_ISREG (buf.st_mode) || buf.st_size % sizeof (UpHistoryPoint) != 0 ||
+	    buf.st_size / sizeof (UpHistoryPoint) > G_MAXUINT) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "history is not a file of 16 byte records");
+		return NULL;
+	}
+
+	size = buf.st_size;
+	points = g_new (UpHistoryPoint, MAX (size / sizeof (UpHistoryPoint), 1));
+	data = (guint8 *) points;
+	while (done < size) {
+		gssize got = pread (fd, data + done, size - done, done);
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0) {
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+				     "failed to read history: %s", g_strerror (errno));
+			return NULL;
+		}
+		if (got == 0) {
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+					     "history was truncated while reading it");
+			return NULL;
+		}
+		done += got;
+	}
+
+	*len = size / sizeof (UpHistoryPoint);
+	for (i = 0; i < *len; i++) {
+		if (points[i].state >= UP_DEVICE_STATE_LAST) {
+			g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				     "invalid state %u at record %u", points[i].state, i);
+			return NULL;
+		}
+	}
+	return g_steal_pointer (&points);
+}
+
+static gboolean
+up_device_import_history (UpExportedDevice *skeleton,
+			  GDBusMethodInvocation *invocation,
+			  GUnixFDList *fd_list,
+			  const gchar *type_string,
+			  gint handle,
+			  UpDevice *device)
+{
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	g_autofree UpHistoryPoint *points = NULL;
+	g_autoptr(GError) error = NULL;
+	UpHistoryType type;
+	guint len = 0;
+	gint fd;
+
+	if (!up_exported_device_get_has_history (skeleton)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device does not support getting history");
+		return TRUE;
+	}
+
+	type = up_device_history_type_from_string (type_string);
+	if (type == UP_HISTORY_TYPE_UNKNOWN) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "invalid history type %s", type_string);
+		return TRUE;
+	}
+
+	ensure_history (device);
+	if (up_device_defer_history_call (device, invocation))
+		return TRUE;
+
+	if (fd_list == NULL || handle < 0 || handle >= g_unix_fd_list_get_length (fd_list)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "no file descriptor passed");
+		return TRUE;
+	}
+	fd = g_unix_fd_list_get (fd_list, handle, &error);
+	if (fd >= 0) {
+		points = up_device_history_from_fd (fd, &len, &error);
+		close (fd);
+	}
+	if (points == NULL) {
+		g_dbus_method_invocation_return_error (invocation,
+						       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+						       "%s", error->message);
+		return TRUE;
+	}
+
+	if (!up_history_import_data (priv->history, type, points, len)) {
+		g_dbus_method_invocation_return_error_literal (invocation,
+							       UP_DAEMON_ERROR, UP_DAEMON_ERROR_GENERAL,
+							       "device has no history");
+		return TRUE;
+	}
+	up_device_update_history_generation (device);
+	g_dbus_method_invocation_return_value (invocation, NULL);
 	return TRUE;
 }
 
+static void
+up_device_history_loaded_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	UpDevice *device = UP_DEVICE (user_data);
+	UpDevicePrivate *priv = up_device_get_instance_private (device);
+	GDBusInterfaceVTable *vtable;
+	g_autoptr(GPtrArray) calls = NULL;
+	g_autoptr(GError) error = NULL;
+	guint i;
+
+	if (!up_history_load_finish (UP_HISTORY (source_object), res, &error))
+		g_warning ("failed to load history: %s", error->message);
+	if (priv->history == UP_HISTORY (source_object))
+		up_device_update_history_generation (device);
+
+	/* answer the calls that were waiting for the data, through the same
+	 * dispatch as when they came in so they reach the same handlers */
+	vtable = g_dbus_interface_skeleton_get_vtable (G_DBUS_INTERFACE_SKELETON (device));
+	calls = g_steal_pointer (&priv->history_calls);
+	for (i = 0; calls != NULL && i < calls->len; i++) {
+		GDBusMethodInvocation *invocation = g_ptr_array_index (calls, i);
+
+		vtable->method_call (g_dbus_method_invocation_get_connection (invocation),
+				     g_dbus_method_invocation_get_sender (invocation),
+				     g_dbus_method_invocation_get_object_path (invocation),
+				     g_dbus_method_invocation_get_interface_name (invocation),
+				     g_dbus_method_invocation_get_method_name (invocation),
+				     g_dbus_method_invocation_get_parameters (invocation),
+				     invocation,
+				     device);
+	}
+	g_object_unref (device);
+}
+
 void
 up_device_sibling_discovered (UpDevice *device, GObject *sibling)
 {
@@ -716,10 +1444,14 @@ up_device_refresh_internal (UpDevice *device, UpRefreshReason reason)
 	if (klass->refresh == NULL)
 		goto out;
 
-	/* do the refresh, and change the property */
+	/* do the refresh, and change the property; everything that changes
+	 * is sent in a single PropertiesChanged signal */
+	g_object_freeze_notify (G_OBJECT (device));
 	ret = klass->refresh (device, reason);
 	priv->last_refresh = g_get_monotonic_time ();
 	g_object_notify_by_pspec (G_OBJECT (device), properties[PROP_LAST_REFRESH]);
+	g_object_thaw_notify (G_OBJECT (device));
+	g_dbus_interface_skeleton_flush (G_DBUS_INTERFACE_SKELETON (device));
 
 	if (!ret) {
 		g_debug ("no changes");
@@ -772,6 +1504,16 @@ up_device_init (UpDevice *device)
 
 	g_signal_connect (device, "handle-get-history",
 			  G_CALLBACK (up_device_get_history), device);
+	g_signal_connect (device, "handle-get-history-downsampled",
+			  G_CALLBACK (up_device_get_history_downsampled), device);
+	g_signal_connect (device, "handle-get-history-multi",
+			  G_CALLBACK (up_device_get_history_multi), device);
+	g_signal_connect (device, "handle-get-history-since",
+			  G_CALLBACK (up_device_get_history_since), device);
+	g_signal_connect (device, "handle-get-history-aggregate",
+			  G_CALLBACK (up_device_get_history_aggregate), device);
+	g_signal_connect (device, "handle-get-history-fd",
+			  G_CALLBACK (up_device_get_history_fd), device);
 	g_signal_connect (device, "handle-get-statistics",
 			  G_CALLBACK (up_device_get_statistics), device);
 }
@@ -784,6 +1526,8 @@ up_device_finalize (GObject *object)
 	g_clear_object (&priv->native);
 	g_clear_object (&priv->daemon);
 	g_clear_object (&priv->history);
+	g_clear_pointer (&priv->history_calls, g_ptr_array_unref);
+	g_clear_pointer (&priv->replies, g_hash_table_unref);
 
 	G_OBJECT_CLASS (up_device_parent_class)->finalize (object);
 }
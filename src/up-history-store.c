@@ -0,0 +1,819 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#include "up-history-store.h"
+
+/* The history of every device is kept in a single file, as a log of
+ * chunks that either replace or append to the data saved under a key.
+ * A save is then one write and at most one sync, however many devices
+ * and series it covers. Where the data of each key is gets indexed
+ * when the file is opened, and the file is rewritten with one chunk
+ * per key once most of it has been superseded. */
+
+#define UP_HISTORY_STORE_FILENAME	"history.db"
+#define UP_HISTORY_STORE_MAGIC		"UPSTOR"
+#define UP_HISTORY_STORE_VERSION	1
+#define UP_HISTORY_STORE_COMPACT_MIN	(256*1024)	/* bytes */
+#define UP_HISTORY_STORE_CHECKSUM_INIT	2166136261u
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define UP_HISTORY_STORE_BYTE_ORDER	'l'
+#else
+#define UP_HISTORY_STORE_BYTE_ORDER	'B'
+#endif
+
+typedef struct {
+	gchar			 magic[6];
+	guint8			 byte_order;
+	guint8			 version;
+	guint32			 reserved[2];
+} UpHistoryStoreHeader;
+
+/* followed by the key, without a terminator, and the data */
+typedef struct {
+	guint32			 checksum;	/* of everything after it */
+	guint16			 kind;
+	guint16			 key_len;
+	guint32			 data_len;
+	guint32			 reserved;
+} UpHistoryStoreChunk;
+
+G_STATIC_ASSERT (sizeof (UpHistoryStoreHeader) == 16);
+G_STATIC_ASSERT (sizeof (UpHistoryStoreChunk) == 16);
+
+/* the data of one chunk */
+typedef struct {
+	goffset			 offset;
+	gsize			 length;
+} UpHistoryStoreExtent;
+
+/* the chunks making up the current data of a key */
+typedef struct {
+	GArray			*extents;
+	gsize			 length;	/* of the data */
+	gsize			 size;		/* of the chunks */
+} UpHistoryStoreEntry;
+
+struct _UpHistoryStore
+{
+	GObject			 parent_instance;
+
+	GMutex			 mutex;		/* used from the load and write threads */
+	gchar			*dir;
+	gchar			*filename;
+	gint			 fd;
+	goffset			 size;		/* of the valid chunks */
+	gsize			 live;		/* size of the chunks in the index */
+	GHashTable		*index;		/* key -> UpHistoryStoreEntry */
+};
+
+G_DEFINE_TYPE (UpHistoryStore, up_history_store, G_TYPE_OBJECT)
+
+/* one store per directory; entries are only cleared, there are
+ * hardly ever more than one */
+G_LOCK_DEFINE_STATIC (up_history_store_registry);
+static GHashTable *up_history_store_registry = NULL;	/* dir -> GWeakRef */
+
+/**
+ * up_history_store_change_new:
+ **/
+UpHistoryStoreChange *
+up_history_store_change_new (UpHistoryStoreChangeKind kind, const gchar *key, GBytes *data)
+{
+	UpHistoryStoreChange *change = g_new0 (UpHistoryStoreChange, 1);
+
+	change->kind = kind;
+	change->key = g_strdup (key);
+	change->data = g_bytes_ref (data);
+	return change;
+}
+
+/**
+ * up_history_store_change_free:
+ **/
+void
+up_history_store_change_free (UpHistoryStoreChange *change)
+{
+	g_free (change->key);
+	g_bytes_unref (change->data);
+	g_free (change);
+}
+
+/**
+ * up_history_store_entry_free:
+ **/
+static void
+up_history_store_entry_free (UpHistoryStoreEntry *entry)
+{
+	g_array_unref (entry->extents);
+	g_free (entry);
+}
+
+/**
+ * up_history_store_checksum:
+ *
+ * FNV-1a, enough to spot a chunk that was not completely written.
+ **/
+static guint32
+up_history_store_checksum (guint32 hash, const guint8 *data, gsize length)
+{
+	gsize i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= data[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/**
+ * up_history_store_chunk_checksum:
+ **/
+static guint32
+up_history_store_chunk_checksum (const UpHistoryStoreChunk *chunk, const guint8 *key, const guint8 *data)
+{
+	guint32 hash = UP_HISTORY_STORE_CHECKSUM_INIT;
+
+	hash = up_history_store_checksum (hash, (const guint8 *) chunk + sizeof (chunk->checksum),
+					  sizeof (UpHistoryStoreChunk) - sizeof (chunk->checksum));
+	hash = up_history_store_checksum (hash, key, chunk->key_len);
+	return up_history_store_checksum (hash, data, chunk->data_len);
+}
+
+/**
+ * up_history_store_header_append:
+ **/
+static void
+up_history_store_header_append (GByteArray *buffer)
+{
+	UpHistoryStoreHeader header;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, UP_HISTORY_STORE_MAGIC, sizeof (header.magic));
+	header.byte_order = UP_HISTORY_STORE_BYTE_ORDER;
+	header.version = UP_HISTORY_STORE_VERSION;
+	g_byte_array_append (buffer, (const guint8 *) &header, sizeof (header));
+}
+
+/**
+ * up_history_store_chunk_append:
+ **/
+static void
+up_history_store_chunk_append (GByteArray *buffer, UpHistoryStoreChangeKind kind,
+			       const gchar *key, const guint8 *data, gsize length)
+{
+	UpHistoryStoreChunk chunk;
+
+	memset (&chunk, 0, sizeof (chunk));
+	chunk.kind = kind;
+	chunk.key_len = strlen (key);
+	chunk.data_len = length;
+	chunk.checksum = up_history_store_chunk_checksum (&chunk, (const guint8 *) key, data);
+	g_byte_array_append (buffer, (const guint8 *) &chunk, sizeof (chunk));
+	g_byte_array_append (buffer, (const guint8 *) key, chunk.key_len);
+	g_byte_array_append (buffer, data, length);
+}
+
+/**
+ * up_history_store_index_add:
+ * @offset: where the data of the chunk starts
+ *
+ * Return value: %FALSE if there is nothing to append to
+ **/
+static gboolean
+up_history_store_index_add (UpHistoryStore *store, UpHistoryStoreChangeKind kind,
+			    const gchar *key, goffset offset, gsize length)
+{
+	UpHistoryStoreEntry *entry;
+	UpHistoryStoreExtent extent;
+	gsize size;
+
+	entry = g_hash_table_lookup (store->index, key);
+	if (kind == UP_HISTORY_STORE_REPLACE) {
+		if (entry == NULL) {
+			entry = g_new0 (UpHistoryStoreEntry, 1);
+			entry->extents = g_array_new (FALSE, FALSE, sizeof (UpHistoryStoreExtent));
+			g_hash_table_insert (store->index, g_strdup (key), entry);
+		}
+		/* the previous chunks are now unused */
+		store->live -= entry->size;
+		g_array_set_size (entry->extents, 0);
+		entry->length = 0;
+		entry->size = 0;
+	} else if (entry == NULL) {
+		return FALSE;
+	}
+
+	extent.offset = offset;
+	extent.length = length;
+	g_array_append_val (entry->extents, extent);
+	size = sizeof (UpHistoryStoreChunk) + strlen (key) + length;
+	entry->length += length;
+	entry->size += size;
+	store->live += size;
+	return TRUE;
+}
+
+/**
+ * up_history_store_scan:
+ *
+ * Indexes the chunks in the contents of the file.
+ *
+ * Return value: the size of the valid chunks, anything after them was
+ * left by a write that did not complete
+ **/
+static goffset
+up_history_store_scan (UpHistoryStore *store, const guint8 *data, gsize length)
+{
+	gsize offset = sizeof (UpHistoryStoreHeader);
+
+	while (length - offset >= sizeof (UpHistoryStoreChunk)) {
+		UpHistoryStoreChunk chunk;
+		g_autofree gchar *key = NULL;
+		const guint8 *key_data;
+
+		memcpy (&chunk, data + offset, sizeof (chunk));
+		if (chunk.key_len == 0 ||
+		    (chunk.kind != UP_HISTORY_STORE_REPLACE && chunk.kind != UP_HISTORY_STORE_APPEND))
+			break;
+		if (length - offset - sizeof (chunk) < (gsize) chunk.key_len + chunk.data_len)
+			break;
+		key_data = data + offset + sizeof (chunk);
+		if (up_history_store_chunk_checksum (&chunk, key_data, key_data + chunk.key_len) != chunk.checksum)
+			break;
+
+		key = g_strndup ((const gchar *) key_data, chunk.key_len);
+		if (!up_history_store_index_add (store, chunk.kind, key,
+						 offset + sizeof (chunk) + chunk.key_len,
+						 chunk.data_len))
+			g_debug ("ignoring data appended to missing %s", key);
+		offset += sizeof (chunk) + chunk.key_len + chunk.data_len;
+	}
+	return offset;
+}
+
+/**
+ * up_history_store_pwrite:
+ **/
+static gboolean
+up_history_store_pwrite (gint fd, const guint8 *data, gsize length, goffset offset)
+{
+	while (length > 0) {
+		gssize len = pwrite (fd, data, length, offset);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		data += len;
+		length -= len;
+		offset += len;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_store_pread:
+ **/
+static gboolean
+up_history_store_pread (gint fd, guint8 *data, gsize length, goffset offset)
+{
+	while (length > 0) {
+		gssize len = pread (fd, data, length, offset);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			return FALSE;
+		data += len;
+		length -= len;
+		offset += len;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_store_sync_dir:
+ *
+ * Makes a rename in the directory durable.
+ **/
+static void
+up_history_store_sync_dir (const gchar *dir)
+{
+	gint fd;
+
+	fd = g_open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+	if (fd < 0) {
+		g_warning ("failed to open %s: %s", dir, g_strerror (errno));
+		return;
+	}
+	if (fsync (fd) < 0)
+		g_warning ("failed to sync %s: %s", dir, g_strerror (errno));
+	g_close (fd, NULL);
+}
+
+/**
+ * up_history_store_replace_file:
+ *
+ * Puts @buffer in place of the store, on stable storage.
+ **/
+static gboolean
+up_history_store_replace_file (UpHistoryStore *store, GByteArray *buffer)
+{
+	g_autofree gchar *filename_tmp = NULL;
+	gboolean ret = FALSE;
+	gint fd;
+
+	filename_tmp = g_strconcat (store->filename, ".tmp", NULL);
+	fd = g_open (filename_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		g_warning ("failed to open %s: %s", filename_tmp, g_strerror (errno));
+		return FALSE;
+	}
+	if (!up_history_store_pwrite (fd, buffer->data, buffer->len, 0) || fdatasync (fd) < 0) {
+		g_warning ("failed to write %s: %s", filename_tmp, g_strerror (errno));
+		goto out;
+	}
+	if (g_rename (filename_tmp, store->filename) < 0) {
+		g_warning ("failed to rename %s: %s", filename_tmp, g_strerror (errno));
+		goto out;
+	}
+	up_history_store_sync_dir (store->dir);
+	ret = TRUE;
+out:
+	g_close (fd, NULL);
+	if (!ret)
+		g_unlink (filename_tmp);
+	return ret;
+}
+
+/**
+ * up_history_store_key_from_filename:
+ *
+ * Return value: the key for a file written by previous versions, or
+ * %NULL if it is something else
+ **/
+static gchar *
+up_history_store_key_from_filename (const gchar *name)
+{
+	const gchar *types[] = { "time-full", "time-empty", "charge", "rate", "profile", "tiers" };
+	gsize len;
+	guint i;
+
+	if (!g_str_has_prefix (name, "history-") || !g_str_has_suffix (name, ".bin"))
+		return NULL;
+	name += strlen ("history-");
+	len = strlen (name) - strlen (".bin");
+
+	for (i = 0; i < G_N_ELEMENTS (types); i++) {
+		gsize type_len = strlen (types[i]);
+
+		if (len <= type_len + 1 ||
+		    strncmp (name, types[i], type_len) != 0 || name[type_len] != '-')
+			continue;
+		return g_strdup_printf ("%.*s/%s", (gint) (len - type_len - 1),
+					name + type_len + 1, types[i]);
+	}
+	return NULL;
+}
+
+/**
+ * up_history_store_migrate:
+ *
+ * Moves the files that previous versions kept for each device and
+ * series into a new store, under the keys #UpHistory now uses.
+ **/
+static void
+up_history_store_migrate (UpHistoryStore *store)
+{
+	g_autoptr(GDir) dir = NULL;
+	g_autoptr(GByteArray) buffer = NULL;
+	g_autoptr(GPtrArray) filenames = NULL;
+	const gchar *name;
+	guint i;
+
+	dir = g_dir_open (store->dir, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	buffer = g_byte_array_new ();
+	up_history_store_header_append (buffer);
+	filenames = g_ptr_array_new_with_free_func (g_free);
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		g_autofree gchar *key = NULL;
+		g_autofree gchar *filename = NULL;
+		g_autofree gchar *data = NULL;
+		gsize length;
+
+		key = up_history_store_key_from_filename (name);
+		if (key == NULL)
+			continue;
+		filename = g_build_filename (store->dir, name, NULL);
+		if (!g_file_get_contents (filename, &data, &length, NULL))
+			continue;
+		up_history_store_chunk_append (buffer, UP_HISTORY_STORE_REPLACE, key,
+					       (const guint8 *) data, length);
+		g_ptr_array_add (filenames, g_steal_pointer (&filename));
+	}
+	if (filenames->len == 0)
+		return;
+
+	/* the old files go once the store is safely in place */
+	if (!up_history_store_replace_file (store, buffer))
+		return;
+	g_debug ("moved %u files into %s", filenames->len, store->filename);
+	for (i = 0; i < filenames->len; i++)
+		g_unlink (g_ptr_array_index (filenames, i));
+}
+
+/**
+ * up_history_store_open:
+ *
+ * Opens the file and indexes it the first time the store is used.
+ * Called with the mutex held.
+ **/
+static gboolean
+up_history_store_open (UpHistoryStore *store)
+{
+	GError *error = NULL;
+	GMappedFile *mapped;
+	const UpHistoryStoreHeader *header;
+	const guint8 *data;
+	struct stat st;
+	gsize length;
+	goffset size;
+
+	if (store->fd >= 0)
+		return TRUE;
+
+	if (!g_file_test (store->filename, G_FILE_TEST_EXISTS))
+		up_history_store_migrate (store);
+
+	store->fd = g_open (store->filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (store->fd < 0) {
+		g_warning ("failed to open %s: %s", store->filename, g_strerror (errno));
+		return FALSE;
+	}
+	g_hash_table_remove_all (store->index);
+	store->live = 0;
+
+	/* a new store */
+	if (fstat (store->fd, &st) == 0 && st.st_size == 0) {
+		g_autoptr(GByteArray) buffer = g_byte_array_new ();
+
+		up_history_store_header_append (buffer);
+		if (!up_history_store_pwrite (store->fd, buffer->data, buffer->len, 0)) {
+			g_warning ("failed to write %s: %s", store->filename, g_strerror (errno));
+			goto failed;
+		}
+		store->size = buffer->len;
+		return TRUE;
+	}
+
+	mapped = g_mapped_file_new_from_fd (store->fd, FALSE, &error);
+	if (mapped == NULL) {
+		g_warning ("failed to read %s: %s", store->filename, error->message);
+		g_error_free (error);
+		goto failed;
+	}
+	data = (const guint8 *) g_mapped_file_get_contents (mapped);
+	length = g_mapped_file_get_length (mapped);
+
+	/* never write to something we cannot read, start again instead */
+	header = (const UpHistoryStoreHeader *) data;
+	if (length < sizeof (UpHistoryStoreHeader) ||
+	    memcmp (header->magic, UP_HISTORY_STORE_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->byte_order != UP_HISTORY_STORE_BYTE_ORDER ||
+	    header->version != UP_HISTORY_STORE_VERSION) {
+		g_autofree gchar *filename_old = g_strconcat (store->filename, ".old", NULL);
+
+		g_warning ("history store %s has an unsupported format, moving it to %s",
+			   store->filename, filename_old);
+		g_mapped_file_unref (mapped);
+		g_close (store->fd, NULL);
+		store->fd = -1;
+		if (g_rename (store->filename, filename_old) < 0)
+			return FALSE;
+		return up_history_store_open (store);
+	}
+
+	size = up_history_store_scan (store, data, length);
+	g_mapped_file_unref (mapped);
+	if ((gsize) size < length) {
+		g_warning ("dropping %" G_GSIZE_FORMAT " bytes of incomplete history from %s",
+			   length - size, store->filename);
+		if (ftruncate (store->fd, size) < 0)
+			g_debug ("failed to truncate %s", store->filename);
+	}
+	store->size = size;
+	g_debug ("indexed %u keys in %s", g_hash_table_size (store->index), store->filename);
+	return TRUE;
+failed:
+	g_close (store->fd, NULL);
+	store->fd = -1;
+	return FALSE;
+}
+
+/**
+ * up_history_store_read_entry:
+ **/
+static gboolean
+up_history_store_read_entry (UpHistoryStore *store, const UpHistoryStoreEntry *entry, guint8 *data)
+{
+	guint i;
+
+	for (i = 0; i < entry->extents->len; i++) {
+		const UpHistoryStoreExtent *extent = &g_array_index (entry->extents, UpHistoryStoreExtent, i);
+
+		if (!up_history_store_pread (store->fd, data, extent->length, extent->offset)) {
+			g_warning ("failed to read %s: %s", store->filename, g_strerror (errno));
+			return FALSE;
+		}
+		data += extent->length;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_store_lookup:
+ *
+ * Return value: everything saved under @key, or %NULL if there is
+ * nothing
+ **/
+GBytes *
+up_history_store_lookup (UpHistoryStore *store, const gchar *key)
+{
+	UpHistoryStoreEntry *entry;
+	GBytes *bytes = NULL;
+	guint8 *data;
+
+	g_return_val_if_fail (UP_IS_HISTORY_STORE (store), NULL);
+
+	g_mutex_lock (&store->mutex);
+	if (!up_history_store_open (store))
+		goto out;
+	entry = g_hash_table_lookup (store->index, key);
+	if (entry == NULL)
+		goto out;
+	data = g_malloc (entry->length);
+	if (!up_history_store_read_entry (store, entry, data)) {
+		g_free (data);
+		goto out;
+	}
+	bytes = g_bytes_new_take (data, entry->length);
+out:
+	g_mutex_unlock (&store->mutex);
+	return bytes;
+}
+
+/**
+ * up_history_store_compact_locked:
+ *
+ * Rewrites the file with a single chunk per key.
+ **/
+static gboolean
+up_history_store_compact_locked (UpHistoryStore *store)
+{
+	g_autoptr(GByteArray) buffer = NULL;
+	GHashTableIter iter;
+	gpointer key, value;
+	goffset size = store->size;
+
+	buffer = g_byte_array_sized_new (sizeof (UpHistoryStoreHeader) + store->live);
+	up_history_store_header_append (buffer);
+	g_hash_table_iter_init (&iter, store->index);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		UpHistoryStoreEntry *entry = value;
+		g_autofree guint8 *data = g_malloc (entry->length);
+
+		if (!up_history_store_read_entry (store, entry, data))
+			return FALSE;
+		up_history_store_chunk_append (buffer, UP_HISTORY_STORE_REPLACE, key, data, entry->length);
+	}
+	if (!up_history_store_replace_file (store, buffer))
+		return FALSE;
+	g_debug ("compacted %s from %" G_GOFFSET_FORMAT " to %u bytes", store->filename, size, buffer->len);
+
+	/* index the new file */
+	g_close (store->fd, NULL);
+	store->fd = -1;
+	return up_history_store_open (store);
+}
+
+/**
+ * up_history_store_compact:
+ *
+ * Drops the data that has been superseded.
+ **/
+gboolean
+up_history_store_compact (UpHistoryStore *store)
+{
+	gboolean ret = FALSE;
+
+	g_return_val_if_fail (UP_IS_HISTORY_STORE (store), FALSE);
+
+	g_mutex_lock (&store->mutex);
+	if (up_history_store_open (store))
+		ret = up_history_store_compact_locked (store);
+	g_mutex_unlock (&store->mutex);
+	return ret;
+}
+
+/**
+ * up_history_store_commit:
+ * @changes: (element-type UpHistoryStoreChange): what to write, in order
+ * @sync: whether to flush the data to stable storage
+ *
+ * Writes all of @changes at once; none of them are made if any fails.
+ *
+ * Return value: %TRUE if everything was written
+ **/
+gboolean
+up_history_store_commit (UpHistoryStore *store, GPtrArray *changes, gboolean sync)
+{
+	g_autoptr(GByteArray) buffer = NULL;
+	g_autoptr(GHashTable) replaced = NULL;
+	gboolean ret = FALSE;
+	struct stat st;
+	goffset offset;
+	goffset end;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY_STORE (store), FALSE);
+
+	if (changes->len == 0)
+		return TRUE;
+
+	g_mutex_lock (&store->mutex);
+	if (!up_history_store_open (store))
+		goto out;
+
+	replaced = g_hash_table_new (g_str_hash, g_str_equal);
+	buffer = g_byte_array_new ();
+	for (i = 0; i < changes->len; i++) {
+		UpHistoryStoreChange *change = g_ptr_array_index (changes, i);
+		const guint8 *data;
+		gsize length;
+
+		if (strlen (change->key) == 0 || strlen (change->key) > G_MAXUINT16) {
+			g_warning ("invalid history key %s", change->key);
+			goto out;
+		}
+
+		/* appending to data that is gone would lose the start of it */
+		if (change->kind == UP_HISTORY_STORE_REPLACE) {
+			g_hash_table_add (replaced, change->key);
+		} else if (!g_hash_table_contains (replaced, change->key) &&
+			   !g_hash_table_contains (store->index, change->key)) {
+			g_warning ("cannot append to %s, it is not in %s", change->key, store->filename);
+			goto out;
+		}
+
+		data = g_bytes_get_data (change->data, &length);
+		up_history_store_chunk_append (buffer, change->kind, change->key, data, length);
+	}
+
+	/* a single write, over anything left by one that did not complete */
+	end = store->size + buffer->len;
+	if (!up_history_store_pwrite (store->fd, buffer->data, buffer->len, store->size)) {
+		g_warning ("failed to write %s: %s", store->filename, g_strerror (errno));
+		if (ftruncate (store->fd, store->size) < 0)
+			g_debug ("failed to truncate %s", store->filename);
+		goto out;
+	}
+	if (fstat (store->fd, &st) == 0 && st.st_size > end && ftruncate (store->fd, end) < 0)
+		g_debug ("failed to truncate %s", store->filename);
+	if (sync && fdatasync (store->fd) < 0)
+		g_warning ("failed to sync %s: %s", store->filename, g_strerror (errno));
+
+	/* the data is only indexed once written */
+	offset = store->size;
+	for (i = 0; i < changes->len; i++) {
+		UpHistoryStoreChange *change = g_ptr_array_index (changes, i);
+		gsize key_len = strlen (change->key);
+		gsize length = g_bytes_get_size (change->data);
+
+		up_history_store_index_add (store, change->kind, change->key,
+					    offset + sizeof (UpHistoryStoreChunk) + key_len, length);
+		offset += sizeof (UpHistoryStoreChunk) + key_len + length;
+		g_debug ("saved %s to %s", change->key, store->filename);
+	}
+	store->size = end;
+	ret = TRUE;
+
+	/* rewrite the file once most of it is no longer used */
+	if (store->size - sizeof (UpHistoryStoreHeader) - store->live >
+	    MAX (store->live, UP_HISTORY_STORE_COMPACT_MIN))
+		up_history_store_compact_locked (store);
+out:
+	g_mutex_unlock (&store->mutex);
+	return ret;
+}
+
+/**
+ * up_history_store_get_dir:
+ **/
+const gchar *
+up_history_store_get_dir (UpHistoryStore *store)
+{
+	g_return_val_if_fail (UP_IS_HISTORY_STORE (store), NULL);
+	return store->dir;
+}
+
+/**
+ * up_history_store_finalize:
+ **/
+static void
+up_history_store_finalize (GObject *object)
+{
+	UpHistoryStore *store = UP_HISTORY_STORE (object);
+
+	if (store->fd >= 0)
+		g_close (store->fd, NULL);
+	g_hash_table_unref (store->index);
+	g_free (store->dir);
+	g_free (store->filename);
+	g_mutex_clear (&store->mutex);
+
+	G_OBJECT_CLASS (up_history_store_parent_class)->finalize (object);
+}
+
+/**
+ * up_history_store_class_init:
+ **/
+static void
+up_history_store_class_init (UpHistoryStoreClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_history_store_finalize;
+}
+
+/**
+ * up_history_store_init:
+ **/
+static void
+up_history_store_init (UpHistoryStore *store)
+{
+	g_mutex_init (&store->mutex);
+	store->fd = -1;
+	store->index = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					      (GDestroyNotify) up_history_store_entry_free);
+}
+
+/**
+ * up_history_store_new:
+ * @dir: the directory the history is kept in
+ *
+ * The file is only opened when first used.
+ *
+ * Return value: the store shared by everything using @dir
+ **/
+UpHistoryStore *
+up_history_store_new (const gchar *dir)
+{
+	UpHistoryStore *store = NULL;
+	GWeakRef *ref;
+
+	G_LOCK (up_history_store_registry);
+	if (up_history_store_registry == NULL)
+		up_history_store_registry = g_hash_table_new (g_str_hash, g_str_equal);
+	ref = g_hash_table_lookup (up_history_store_registry, dir);
+	if (ref != NULL)
+		store = g_weak_ref_get (ref);
+	if (store == NULL) {
+		store = g_object_new (UP_TYPE_HISTORY_STORE, NULL);
+		store->dir = g_strdup (dir);
+		store->filename = g_build_filename (dir, UP_HISTORY_STORE_FILENAME, NULL);
+		if (ref == NULL) {
+			ref = g_new0 (GWeakRef, 1);
+			g_hash_table_insert (up_history_store_registry, g_strdup (dir), ref);
+		}
+		g_weak_ref_set (ref, store);
+	}
+	G_UNLOCK (up_history_store_registry);
+	return store;
+}
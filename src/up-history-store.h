@@ -0,0 +1,58 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UP_HISTORY_STORE_H
+#define __UP_HISTORY_STORE_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define UP_TYPE_HISTORY_STORE	(up_history_store_get_type ())
+G_DECLARE_FINAL_TYPE (UpHistoryStore, up_history_store, UP, HISTORY_STORE, GObject)
+
+typedef enum {
+	UP_HISTORY_STORE_REPLACE = 1,
+	UP_HISTORY_STORE_APPEND
+} UpHistoryStoreChangeKind;
+
+typedef struct {
+	UpHistoryStoreChangeKind kind;
+	gchar			*key;
+	GBytes			*data;
+} UpHistoryStoreChange;
+
+GType			 up_history_store_get_type	(void);
+UpHistoryStore		*up_history_store_new		(const gchar		*dir);
+const gchar		*up_history_store_get_dir	(UpHistoryStore		*store);
+GBytes			*up_history_store_lookup	(UpHistoryStore		*store,
+							 const gchar		*key);
+gboolean		 up_history_store_commit	(UpHistoryStore		*store,
+							 GPtrArray		*changes,
+							 gboolean		 sync);
+gboolean		 up_history_store_compact	(UpHistoryStore		*store);
+
+UpHistoryStoreChange	*up_history_store_change_new	(UpHistoryStoreChangeKind kind,
+							 const gchar		*key,
+							 GBytes			*data);
+void			 up_history_store_change_free	(UpHistoryStoreChange	*change);
+
+G_END_DECLS
+
+#endif /* __UP_HISTORY_STORE_H */
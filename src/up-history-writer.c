@@ -0,0 +1,491 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include <glib/gstdio.h>
+
+#include "up-history-writer.h"
+#include "up-tick.h"
+
+/* The history of every device is written by a single worker thread.
+ * Devices only mark themselves as dirty; all of them are written
+ * together when the earliest of their timeouts expires, in a single
+ * commit to the store, followed by one sync of the disk. */
+#define UP_HISTORY_WRITER_SLACK_DIVISOR	4		/* of the timeout */
+
+struct _UpHistoryWriterJob
+{
+	GWeakRef		 owner;
+	UpHistoryWriterFailedFunc failed_func;
+	UpHistoryStore		*store;
+	GPtrArray		*changes;	/* of UpHistoryStoreChange */
+	GPtrArray		*unlinks;	/* files removed once the changes are written */
+	gboolean		 failed;
+};
+
+typedef struct {
+	GPtrArray		*jobs;
+	gboolean		 sync;
+} UpHistoryWriterBatch;
+
+struct _UpHistoryWriter
+{
+	GObject			 parent_instance;
+
+	GThreadPool		*pool;
+	GMutex			 mutex;
+	GCond			 cond;
+	guint			 pending;	/* batches not written yet */
+	GHashTable		*dirty;		/* owner -> UpHistoryWriterPrepareFunc */
+	UpTick			*tick;
+	guint			 tick_id;
+};
+
+G_DEFINE_TYPE (UpHistoryWriter, up_history_writer, G_TYPE_OBJECT)
+
+static gpointer up_history_writer_object = NULL;
+
+/**
+ * up_history_writer_job_new:
+ * @owner: the object the data belongs to, only weakly referenced
+ * @store: where the data is saved
+ * @func: what to call if the writes fail
+ **/
+UpHistoryWriterJob *
+up_history_writer_job_new (GObject *owner, UpHistoryStore *store, UpHistoryWriterFailedFunc func)
+{
+	UpHistoryWriterJob *job = g_new0 (UpHistoryWriterJob, 1);
+
+	g_weak_ref_init (&job->owner, owner);
+	job->failed_func = func;
+	job->store = g_object_ref (store);
+	job->changes = g_ptr_array_new_with_free_func ((GDestroyNotify) up_history_store_change_free);
+	job->unlinks = g_ptr_array_new_with_free_func (g_free);
+	return job;
+}
+
+/**
+ * up_history_writer_job_free:
+ **/
+void
+up_history_writer_job_free (UpHistoryWriterJob *job)
+{
+	if (job == NULL)
+		return;
+	g_weak_ref_clear (&job->owner);
+	g_object_unref (job->store);
+	g_ptr_array_unref (job->changes);
+	g_ptr_array_unref (job->unlinks);
+	g_free (job);
+}
+
+/**
+ * up_history_writer_job_is_empty:
+ **/
+gboolean
+up_history_writer_job_is_empty (UpHistoryWriterJob *job)
+{
+	return job->changes->len == 0 && job->unlinks->len == 0;
+}
+
+/**
+ * up_history_writer_job_replace:
+ *
+ * Replaces what is saved under @key with @data.
+ **/
+void
+up_history_writer_job_replace (UpHistoryWriterJob *job, const gchar *key, GBytes *data)
+{
+	g_ptr_array_add (job->changes,
+			 up_history_store_change_new (UP_HISTORY_STORE_REPLACE, key, data));
+}
+
+/**
+ * up_history_writer_job_append:
+ *
+ * Adds @data to what is saved under @key. Fails if there is nothing
+ * saved under it.
+ **/
+void
+up_history_writer_job_append (UpHistoryWriterJob *job, const gchar *key, GBytes *data)
+{
+	g_ptr_array_add (job->changes,
+			 up_history_store_change_new (UP_HISTORY_STORE_APPEND, key, data));
+}
+
+/**
+ * up_history_writer_job_unlink:
+ *
+ * Removes the file once the changes have been written.
+ **/
+void
+up_history_writer_job_unlink (UpHistoryWriterJob *job, const gchar *filename)
+{
+	g_ptr_array_add (job->unlinks, g_strdup (filename));
+}
+
+/**
+ * up_history_writer_write:
+ *
+ * Writes the changes of all the jobs using the same store at once.
+ * The changes of a job are either all written or none are.
+ **/
+static void
+up_history_writer_write (GPtrArray *jobs, gboolean sync)
+{
+	g_autoptr(GHashTable) stores = NULL;
+	GHashTableIter iter;
+	gpointer value;
+	guint i, j;
+
+	stores = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					(GDestroyNotify) g_ptr_array_unref);
+	for (i = 0; i < jobs->len; i++) {
+		UpHistoryWriterJob *job = g_ptr_array_index (jobs, i);
+		GPtrArray *store_jobs = g_hash_table_lookup (stores, job->store);
+
+		if (store_jobs == NULL) {
+			store_jobs = g_ptr_array_new ();
+			g_hash_table_insert (stores, job->store, store_jobs);
+		}
+		g_ptr_array_add (store_jobs, job);
+	}
+
+	g_hash_table_iter_init (&iter, stores);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		GPtrArray *store_jobs = value;
+		UpHistoryWriterJob *job = g_ptr_array_index (store_jobs, 0);
+		g_autoptr(GPtrArray) changes = g_ptr_array_new ();
+
+		for (i = 0; i < store_jobs->len; i++) {
+			UpHistoryWriterJob *store_job = g_ptr_array_index (store_jobs, i);
+
+			for (j = 0; j < store_job->changes->len; j++)
+				g_ptr_array_add (changes, g_ptr_array_index (store_job->changes, j));
+		}
+		if (up_history_store_commit (job->store, changes, sync))
+			continue;
+		for (i = 0; i < store_jobs->len; i++) {
+			UpHistoryWriterJob *store_job = g_ptr_array_index (store_jobs, i);
+			store_job->failed = TRUE;
+		}
+	}
+
+	/* the files the data came from are no longer needed */
+	for (i = 0; i < jobs->len; i++) {
+		UpHistoryWriterJob *job = g_ptr_array_index (jobs, i);
+
+		if (job->failed)
+			continue;
+		for (j = 0; j < job->unlinks->len; j++) {
+			const gchar *filename = g_ptr_array_index (job->unlinks, j);
+
+			if (g_unlink (filename) == 0)
+				g_debug ("removed %s", filename);
+		}
+	}
+}
+
+/**
+ * up_history_writer_job_failed_cb:
+ **/
+static gboolean
+up_history_writer_job_failed_cb (gpointer user_data)
+{
+	UpHistoryWriterJob *job = user_data;
+	GObject *owner;
+
+	owner = g_weak_ref_get (&job->owner);
+	if (owner != NULL) {
+		job->failed_func (owner);
+		g_object_unref (owner);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/**
+ * up_history_writer_thread:
+ **/
+static void
+up_history_writer_thread (gpointer data, gpointer user_data)
+{
+	UpHistoryWriterBatch *batch = data;
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (user_data);
+	guint i;
+
+	up_history_writer_write (batch->jobs, batch->sync);
+
+	/* the owners have to write everything again */
+	for (i = 0; i < batch->jobs->len; i++) {
+		UpHistoryWriterJob *job = g_ptr_array_index (batch->jobs, i);
+		if (!job->failed)
+			continue;
+		g_idle_add_full (G_PRIORITY_DEFAULT, up_history_writer_job_failed_cb,
+				 g_steal_pointer (&batch->jobs->pdata[i]),
+				 (GDestroyNotify) up_history_writer_job_free);
+	}
+	g_ptr_array_unref (batch->jobs);
+	g_free (batch);
+
+	g_mutex_lock (&writer->mutex);
+	writer->pending--;
+	g_cond_broadcast (&writer->cond);
+	g_mutex_unlock (&writer->mutex);
+}
+
+/**
+ * up_history_writer_push:
+ **/
+static void
+up_history_writer_push (UpHistoryWriter *writer, GPtrArray *jobs, gboolean sync)
+{
+	UpHistoryWriterBatch *batch;
+
+	batch = g_new0 (UpHistoryWriterBatch, 1);
+	batch->jobs = jobs;
+	batch->sync = sync;
+
+	g_mutex_lock (&writer->mutex);
+	writer->pending++;
+	g_mutex_unlock (&writer->mutex);
+	g_thread_pool_push (writer->pool, batch, NULL);
+}
+
+/**
+ * up_history_writer_submit:
+ * @sync: whether to flush the data to stable storage
+ *
+ * Writes @job in the worker thread, after anything queued before it.
+ **/
+void
+up_history_writer_submit (UpHistoryWriter *writer, UpHistoryWriterJob *job, gboolean sync)
+{
+	GPtrArray *jobs;
+
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	if (up_history_writer_job_is_empty (job)) {
+		up_history_writer_job_free (job);
+		return;
+	}
+	jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) up_history_writer_job_free);
+	g_ptr_array_add (jobs, job);
+	up_history_writer_push (writer, jobs, sync);
+}
+
+/**
+ * up_history_writer_run:
+ *
+ * Writes @job in the calling thread once the queued writes are done.
+ * The failure function is not called.
+ *
+ * Return value: %TRUE if everything was written
+ **/
+gboolean
+up_history_writer_run (UpHistoryWriter *writer, UpHistoryWriterJob *job)
+{
+	g_autoptr(GPtrArray) jobs = NULL;
+
+	g_return_val_if_fail (UP_IS_HISTORY_WRITER (writer), FALSE);
+
+	up_history_writer_wait (writer);
+	jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) up_history_writer_job_free);
+	g_ptr_array_add (jobs, job);
+	up_history_writer_write (jobs, TRUE);
+	return !job->failed;
+}
+
+/**
+ * up_history_writer_wait:
+ *
+ * Blocks until everything queued has been written.
+ **/
+void
+up_history_writer_wait (UpHistoryWriter *writer)
+{
+	g_mutex_lock (&writer->mutex);
+	while (writer->pending > 0)
+		g_cond_wait (&writer->cond, &writer->mutex);
+	g_mutex_unlock (&writer->mutex);
+}
+
+/**
+ * up_history_writer_flush:
+ * @wait: block until the data is written
+ *
+ * Writes the data of every dirty owner now, in a single batch that is
+ * synced to stable storage.
+ **/
+void
+up_history_writer_flush (UpHistoryWriter *writer, gboolean wait)
+{
+	GHashTableIter iter;
+	gpointer owner, func;
+	GPtrArray *jobs;
+
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	up_tick_schedule (writer->tick, writer->tick_id, -1, 0);
+
+	jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) up_history_writer_job_free);
+	g_hash_table_iter_init (&iter, writer->dirty);
+	while (g_hash_table_iter_next (&iter, &owner, &func)) {
+		UpHistoryWriterJob *job = ((UpHistoryWriterPrepareFunc) func) (owner);
+
+		if (job == NULL)
+			continue;
+		if (up_history_writer_job_is_empty (job)) {
+			up_history_writer_job_free (job);
+			continue;
+		}
+		g_ptr_array_add (jobs, job);
+	}
+	g_hash_table_remove_all (writer->dirty);
+
+	if (jobs->len > 0) {
+		g_debug ("writing history of %u devices", jobs->len);
+		up_history_writer_push (writer, jobs, TRUE);
+	} else {
+		g_ptr_array_unref (jobs);
+	}
+	if (wait)
+		up_history_writer_wait (writer);
+}
+
+/**
+ * up_history_writer_tick_cb:
+ **/
+static void
+up_history_writer_tick_cb (gpointer user_data)
+{
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (user_data);
+
+	up_history_writer_flush (writer, FALSE);
+}
+
+/**
+ * up_history_writer_schedule:
+ * @owner: the object whose data changed, not referenced
+ * @func: gets the writes for @owner when it is time
+ * @timeout: the delay in seconds
+ *
+ * The write may happen up to a quarter of @timeout later, so that it
+ * can share a wakeup with the other periodic work of the daemon.
+ *
+ * Return value: %FALSE if an earlier write was already scheduled
+ **/
+gboolean
+up_history_writer_schedule (UpHistoryWriter *writer, GObject *owner,
+			    UpHistoryWriterPrepareFunc func, guint timeout)
+{
+	gint64 ready;
+	gint64 now = g_get_monotonic_time ();
+
+	g_return_val_if_fail (UP_IS_HISTORY_WRITER (writer), FALSE);
+
+	g_hash_table_insert (writer->dirty, owner, func);
+
+	/* we already have one queued, keep it if it will fire earlier */
+	ready = up_tick_get_ready_time (writer->tick, writer->tick_id);
+	if (ready >= 0 && ready <= now + (gint64) timeout * G_USEC_PER_SEC)
+		return FALSE;
+
+	up_tick_schedule (writer->tick, writer->tick_id,
+			  now + (gint64) timeout * G_USEC_PER_SEC,
+			  timeout / UP_HISTORY_WRITER_SLACK_DIVISOR);
+	return TRUE;
+}
+
+/**
+ * up_history_writer_unschedule:
+ *
+ * Forgets about @owner, which writes its data itself.
+ **/
+void
+up_history_writer_unschedule (UpHistoryWriter *writer, GObject *owner)
+{
+	g_return_if_fail (UP_IS_HISTORY_WRITER (writer));
+
+	g_hash_table_remove (writer->dirty, owner);
+	if (g_hash_table_size (writer->dirty) == 0)
+		up_tick_schedule (writer->tick, writer->tick_id, -1, 0);
+}
+
+/**
+ * up_history_writer_finalize:
+ **/
+static void
+up_history_writer_finalize (GObject *object)
+{
+	UpHistoryWriter *writer = UP_HISTORY_WRITER (object);
+
+	/* everything queued is written before exiting */
+	g_thread_pool_free (writer->pool, FALSE, TRUE);
+	up_tick_remove (writer->tick, writer->tick_id);
+	g_object_unref (writer->tick);
+	g_hash_table_unref (writer->dirty);
+	g_mutex_clear (&writer->mutex);
+	g_cond_clear (&writer->cond);
+
+	G_OBJECT_CLASS (up_history_writer_parent_class)->finalize (object);
+}
+
+/**
+ * up_history_writer_class_init:
+ **/
+static void
+up_history_writer_class_init (UpHistoryWriterClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_history_writer_finalize;
+}
+
+/**
+ * up_history_writer_init:
+ **/
+static void
+up_history_writer_init (UpHistoryWriter *writer)
+{
+	/* a single thread keeps the writes in order */
+	writer->pool = g_thread_pool_new (up_history_writer_thread, writer, 1, FALSE, NULL);
+	g_mutex_init (&writer->mutex);
+	g_cond_init (&writer->cond);
+	writer->dirty = g_hash_table_new (g_direct_hash, g_direct_equal);
+	writer->tick = up_tick_new ();
+	writer->tick_id = up_tick_add (writer->tick, "history",
+				       up_history_writer_tick_cb, writer);
+}
+
+/**
+ * up_history_writer_new:
+ *
+ * Return value: the writer shared by the whole daemon
+ **/
+UpHistoryWriter *
+up_history_writer_new (void)
+{
+	if (up_history_writer_object != NULL) {
+		g_object_ref (up_history_writer_object);
+	} else {
+		up_history_writer_object = g_object_new (UP_TYPE_HISTORY_WRITER, NULL);
+		g_object_add_weak_pointer (up_history_writer_object, &up_history_writer_object);
+	}
+	return UP_HISTORY_WRITER (up_history_writer_object);
+}
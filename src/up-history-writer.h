@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UP_HISTORY_WRITER_H
+#define __UP_HISTORY_WRITER_H
+
+#include <glib-object.h>
+
+#include "up-history-store.h"
+
+G_BEGIN_DECLS
+
+#define UP_TYPE_HISTORY_WRITER	(up_history_writer_get_type ())
+G_DECLARE_FINAL_TYPE (UpHistoryWriter, up_history_writer, UP, HISTORY_WRITER, GObject)
+
+typedef struct _UpHistoryWriterJob UpHistoryWriterJob;
+
+/* returns the writes @owner needs, or %NULL if there are none */
+typedef UpHistoryWriterJob *(*UpHistoryWriterPrepareFunc) (GObject *owner);
+/* called in the main thread if the writes of @owner did not complete */
+typedef void (*UpHistoryWriterFailedFunc) (GObject *owner);
+
+GType			 up_history_writer_get_type	(void);
+UpHistoryWriter		*up_history_writer_new		(void);
+gboolean		 up_history_writer_schedule	(UpHistoryWriter	*writer,
+							 GObject		*owner,
+							 UpHistoryWriterPrepareFunc func,
+							 guint			 timeout);
+void			 up_history_writer_unschedule	(UpHistoryWriter	*writer,
+							 GObject		*owner);
+void			 up_history_writer_submit	(UpHistoryWriter	*writer,
+							 UpHistoryWriterJob	*job,
+							 gboolean		 sync);
+gboolean		 up_history_writer_run		(UpHistoryWriter	*writer,
+							 UpHistoryWriterJob	*job);
+void			 up_history_writer_flush	(UpHistoryWriter	*writer,
+							 gboolean		 wait);
+void			 up_history_writer_wait		(UpHistoryWriter	*writer);
+
+UpHistoryWriterJob	*up_history_writer_job_new	(GObject		*owner,
+							 UpHistoryStore		*store,
+							 UpHistoryWriterFailedFunc func);
+void			 up_history_writer_job_free	(UpHistoryWriterJob	*job);
+gboolean		 up_history_writer_job_is_empty	(UpHistoryWriterJob	*job);
+void			 up_history_writer_job_replace	(UpHistoryWriterJob	*job,
+							 const gchar		*key,
+							 GBytes			*data);
+void			 up_history_writer_job_append	(UpHistoryWriterJob	*job,
+							 const gchar		*key,
+							 GBytes			*data);
+void			 up_history_writer_job_unlink	(UpHistoryWriterJob	*job,
+							 const gchar		*filename);
+
+G_END_DECLS
+
+#endif /* __UP_HISTORY_WRITER_H */
@@ -23,20 +23,208 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <glib/gi18n.h>
 #include <gio/gio.h>
 
+#include "up-config.h"
 #include "up-history.h"
+#include "up-history-store.h"
+#include "up-history-writer.h"
 #include "up-stats-item.h"
 #include "up-history-item.h"
 
 static void	up_history_finalize	(GObject		*object);
+static gboolean	up_history_schedule_save	(UpHistory		*history);
 
 #define UP_HISTORY_SAVE_INTERVAL	(10*60)		/* seconds */
 #define UP_HISTORY_SAVE_INTERVAL_LOW_POWER	5	/* seconds */
 #define UP_HISTORY_LOW_POWER_PERCENT	10
 #define UP_HISTORY_DEFAULT_MAX_DATA_AGE	(7*24*60*60)	/* seconds */
+#define UP_HISTORY_COMPACT_INTERVAL	(24*60*60)	/* seconds */
+#define UP_HISTORY_TIER_MIN_RATIO	4
+#define UP_HISTORY_MAX_POINTS		(7*24*60*30)	/* per series */
+#define UP_HISTORY_TIERS_MAGIC		"UPTIER"
+
+#define UP_HISTORY_FILE_MAGIC		"UPHIST"
+#define UP_HISTORY_FILE_VERSION		1
+#define UP_HISTORY_FILE_VERSION_COMPACT	2
+#define UP_HISTORY_QUANTUM		1000		/* steps per unit, as in the text files */
+#define UP_HISTORY_PROFILE_MAGIC	"UPPROF"
+#define UP_HISTORY_PROFILE_BINS		101
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define UP_HISTORY_FILE_BYTE_ORDER	'l'
+#else
+#define UP_HISTORY_FILE_BYTE_ORDER	'B'
+#endif
+
+/* Layout of the data of each series, saved in the #UpHistoryStore as
+ * <id>/<type>: one header followed by fixed-size records in host byte
+ * order, oldest first. Previous versions saved it in history-<type>-<id>.bin. */
+typedef struct {
+	gchar			 magic[6];
+	guint8			 byte_order;
+	guint8			 version;
+	guint32			 record_size;
+	guint32			 reserved;
+} UpHistoryFileHeader;
+
+typedef struct {
+	guint32			 time;
+	guint8			 state;
+	guint8			 reserved[3];
+	gdouble			 value;
+} UpHistoryRecord;
+
+typedef struct {
+	gdouble			 value;		/* total time spent */
+	gdouble			 count;		/* saturates like the accuracy */
+} UpHistoryProfileBin;
+
+/* Where the walk over the charge series that produces the statistics
+ * got to, so new points can be added without walking it again. Saved
+ * after an UpHistoryFileHeader as <id>/profile. */
+typedef struct {
+	guint32			 covered;	/* charge points included */
+	guint32			 last_time;
+	guint32			 old_time;
+	guint32			 oldbin;
+	guint8			 has_last;
+	guint8			 last_state;
+	guint8			 has_old;
+	guint8			 reserved[5];
+	gdouble			 last_value;
+	gdouble			 old_value;
+	UpHistoryProfileBin	 bins[2][UP_HISTORY_PROFILE_BINS];	/* charging, discharging */
+} UpHistoryProfile;
+
+/* With the compact encoding, the header has no record size and is
+ * followed by one block per save. Each record is a varint tag holding
+ * the change in the time step and two flags, the new state if it
+ * changed, then either the change in the value in quanta or the raw
+ * value if it cannot be quantized. */
+typedef struct {
+	guint32			 size;		/* of the records that follow */
+	guint32			 count;
+} UpHistoryBlockHeader;
+
+#define UP_HISTORY_CODEC_STATE		(1 << 0)
+#define UP_HISTORY_CODEC_RAW		(1 << 1)
+#define UP_HISTORY_ZIGZAG(v)		(((guint64) (v) << 1) ^ (guint64) ((gint64) (v) >> 63))
+#define UP_HISTORY_UNZIGZAG(u)		((gint64) ((u) >> 1) ^ -(gint64) ((u) & 1))
+
+/* what the next compact record is relative to */
+typedef struct {
+	gint64			 time;
+	gint64			 delta;
+	gint64			 quantum;	/* zero after a raw value */
+	guint8			 state;
+} UpHistoryCodec;
+
+G_STATIC_ASSERT (sizeof (UpHistoryFileHeader) == 16);
+G_STATIC_ASSERT (sizeof (UpHistoryRecord) == 16);
+G_STATIC_ASSERT (sizeof (UpHistoryBlockHeader) == 8);
+
+/* A series is kept as parallel columns rather than as one object per
+ * point; items are only created for what is returned to callers. */
+typedef struct {
+	guint32			*time;
+	gdouble			*value;
+	guint8			*state;
+	guint			 len;
+	guint			 size;
+	guint			 saved;		/* points already on disk */
+} UpHistorySeries;
+
+/* Consolidated copies of a series, one bucket per time slot and state.
+ * Each tier is a ring of bounded size, so it keeps a bounded amount of
+ * older history once the raw points have been culled. The ring grows
+ * as buckets are added, so that devices with little history only use
+ * a little memory. */
+typedef enum {
+	UP_HISTORY_TIER_MINUTE,
+	UP_HISTORY_TIER_TEN_MINUTES,
+	UP_HISTORY_TIER_HOUR,
+	UP_HISTORY_TIER_LAST
+} UpHistoryTierKind;
+
+static const struct {
+	guint			 width;		/* seconds */
+	guint			 capacity;	/* buckets */
+} up_history_tier_levels[UP_HISTORY_TIER_LAST] = {
+	{ 60,		24*60 },	/* a day */
+	{ 10*60,	14*24*6 },	/* two weeks */
+	{ 60*60,	180*24 },	/* six months */
+};
+
+/* also the on-disk layout, see up_history_tiers_to_job() */
+typedef struct {
+	guint32			 time;		/* mean */
+	guint32			 count;
+	guint8			 state;
+	guint8			 reserved[7];
+	gdouble			 min;
+	gdouble			 mean;
+	gdouble			 max;
+} UpHistoryTierRecord;
+
+typedef struct {
+	guint32			 width;
+	guint32			 capacity;
+	guint32			 len;
+	guint32			 slot;		/* of the last bucket */
+	guint32			 last_time;	/* of the last point added */
+	guint32			 reserved;
+	guint64			 time_sum;	/* of the last bucket */
+	gdouble			 value_sum;
+} UpHistoryTierHeader;
+
+typedef struct {
+	UpHistoryTierRecord	*buckets;
+	guint			 allocated;	/* buckets, up to the capacity */
+	guint			 start;
+	UpHistoryTierHeader	 header;
+} UpHistoryTier;
+
+#define UP_HISTORY_TIER_MIN_ALLOCATED	16
+
+G_STATIC_ASSERT (sizeof (UpHistoryTierRecord) == 40);
+G_STATIC_ASSERT (sizeof (UpHistoryTierHeader) == 40);
+
+/* The swinging door of a series: the newest point is replaced by the
+ * next one as long as every point since the anchor stays within the
+ * tolerance of the line from the anchor to the new one. The slopes of
+ * the lines that are still possible are kept between @lower and @upper.
+ * The tiers and statistics only see a point once it cannot be replaced. */
+typedef struct {
+	gdouble			 tolerance;	/* zero to keep every point */
+	gboolean		 pending;	/* the newest point can be replaced */
+	guint32			 anchor_time;
+	gdouble			 anchor_value;
+	gdouble			 lower;
+	gdouble			 upper;
+} UpHistoryDoor;
+
+/* in the order of UpHistoryType */
+static const gchar *up_history_tolerance_keys[] = {
+	"HistoryToleranceCharge",
+	"HistoryToleranceRate",
+	"HistoryToleranceTimeFull",
+	"HistoryToleranceTimeEmpty",
+};
+
+/* used when the key is missing, as documented in UPower.conf */
+static const gdouble up_history_tolerance_defaults[] = {
+	0.0,	/* percent */
+	0.05,	/* W */
+	60.0,	/* seconds */
+	60.0,	/* seconds */
+};
+
+G_STATIC_ASSERT (G_N_ELEMENTS (up_history_tolerance_keys) == UP_HISTORY_TYPE_UNKNOWN);
+G_STATIC_ASSERT (G_N_ELEMENTS (up_history_tolerance_defaults) == UP_HISTORY_TYPE_UNKNOWN);
 
 struct UpHistoryPrivate
 {
@@ -46,15 +234,40 @@ struct UpHistoryPrivate
 	gint64			 time_empty_last;
 	gdouble			 percentage_last;
 	UpDeviceState		 state;
-	GPtrArray		*data_rate;
-	GPtrArray		*data_charge;
-	GPtrArray		*data_time_full;
-	GPtrArray		*data_time_empty;
-	GSource			*save_source;
+	UpHistorySeries		 series[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistoryTier		 tiers[UP_HISTORY_TYPE_UNKNOWN][UP_HISTORY_TIER_LAST];
+	guint			 tiers_covered[UP_HISTORY_TYPE_UNKNOWN];	/* points added */
+	UpHistoryDoor		 doors[UP_HISTORY_TYPE_UNKNOWN];
+	guint64			 generation[UP_HISTORY_TYPE_UNKNOWN];
+	guint64			 epoch[UP_HISTORY_TYPE_UNKNOWN];
+	gboolean		 tiers_dirty;
+	UpHistoryProfile	 profile;
+	gboolean		 profile_dirty;
+	gint64			 last_compact;
+	gboolean		 needs_rewrite;
+	UpHistoryWriter		*writer;
+	UpHistoryStore		*store;
 	guint			 max_data_age;
-	gchar			*dir;
+	gboolean		 has_legacy_files;
+	gboolean		 loading;
+	gboolean		 compact_encoding;
 };
 
+/* What is read from disk for one device; filled without touching the
+ * UpHistory so that it can be done in a thread. */
+typedef struct {
+	gchar			*id;
+	UpHistoryStore		*store;
+	UpHistoryWriter		*writer;
+	gboolean		 compact_encoding;
+	UpHistorySeries		 series[UP_HISTORY_TYPE_UNKNOWN];
+	UpHistoryTier		 tiers[UP_HISTORY_TYPE_UNKNOWN][UP_HISTORY_TIER_LAST];
+	UpHistoryProfile	 profile;
+	gboolean		 has_profile;
+	gboolean		 has_legacy_files;
+	gboolean		 needs_rewrite;
+} UpHistoryLoad;
+
 enum {
 	UP_HISTORY_PROGRESS,
 	UP_HISTORY_LAST_SIGNAL
@@ -72,17 +285,550 @@ up_history_set_max_data_age (UpHistory *history, guint max_data_age)
 }
 
 /**
- * up_history_array_copy_cb:
+ * up_history_set_compact_encoding:
+ *
+ * Saves the data delta-encoded rather than in fixed-size records. The
+ * values are then rounded to thousandths when added, so that they are
+ * the same once loaded again. Files in the other encoding are
+ * converted on the next save.
+ **/
+void
+up_history_set_compact_encoding (UpHistory *history, gboolean compact_encoding)
+{
+	history->priv->compact_encoding = compact_encoding;
+}
+
+/**
+ * up_history_set_tolerance:
+ * @tolerance: how far a point can be from the line through the points
+ * that are kept, in the unit of the series, or 0 to keep every point
+ **/
+void
+up_history_set_tolerance (UpHistory *history, UpHistoryType type, gdouble tolerance)
+{
+	g_return_if_fail (type < UP_HISTORY_TYPE_UNKNOWN);
+
+	history->priv->doors[type].tolerance = MAX (tolerance, 0.0);
+	history->priv->doors[type].pending = FALSE;
+}
+
+/**
+ * up_history_type_to_string:
+ **/
+static const gchar *
+up_history_type_to_string (UpHistoryType type)
+{
+	if (type == UP_HISTORY_TYPE_CHARGE)
+		return "charge";
+	if (type == UP_HISTORY_TYPE_RATE)
+		return "rate";
+	if (type == UP_HISTORY_TYPE_TIME_FULL)
+		return "time-full";
+	if (type == UP_HISTORY_TYPE_TIME_EMPTY)
+		return "time-empty";
+	return NULL;
+}
+
+/**
+ * up_history_series_reserve:
+ **/
+static void
+up_history_series_reserve (UpHistorySeries *series, guint len)
+{
+	guint size;
+
+	if (len <= series->size)
+		return;
+	size = MAX (series->size, 8);
+	while (size < len)
+		size *= 2;
+	series->time = g_renew (guint32, series->time, size);
+	series->value = g_renew (gdouble, series->value, size);
+	series->state = g_renew (guint8, series->state, size);
+	series->size = size;
+}
+
+/**
+ * up_history_series_append:
+ **/
+static void
+up_history_series_append (UpHistorySeries *series, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	up_history_series_reserve (series, series->len + 1);
+	series->time[series->len] = time_s;
+	series->value[series->len] = value;
+	series->state[series->len] = state;
+	series->len++;
+}
+
+/**
+ * up_history_series_clear:
+ **/
+static void
+up_history_series_clear (UpHistorySeries *series)
+{
+	g_free (series->time);
+	g_free (series->value);
+	g_free (series->state);
+	memset (series, 0, sizeof (UpHistorySeries));
+}
+
+/**
+ * up_history_series_upper_bound:
+ *
+ * Return value: the index of the first point newer than @time_s, or
+ * the length of the series if there is none.
+ **/
+static guint
+up_history_series_upper_bound (const UpHistorySeries *series, gint64 time_s)
+{
+	guint lo = 0;
+	guint hi = series->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		if (series->time[mid] > time_s)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/**
+ * up_history_tier_get:
+ * @i: the index counted from the oldest bucket
+ **/
+static UpHistoryTierRecord *
+up_history_tier_get (const UpHistoryTier *tier, guint i)
+{
+	/* the ring only wraps around once it has all its buckets */
+	return &tier->buckets[(tier->start + i) % tier->allocated];
+}
+
+/**
+ * up_history_tier_upper_bound:
+ *
+ * Return value: the index of the first bucket newer than @time_s, or
+ * the number of buckets if there is none.
+ **/
+static guint
+up_history_tier_upper_bound (const UpHistoryTier *tier, gint64 time_s)
+{
+	guint lo = 0;
+	guint hi = tier->header.len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo) / 2;
+		if (up_history_tier_get (tier, mid)->time > time_s)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/**
+ * up_history_tier_copy:
+ * @from: the first bucket to copy
+ * @to: the bucket after the last one to copy
+ * @reverse: whether to add them newest first
+ *
+ * Adds the mean of each bucket to @dest.
+ **/
+static void
+up_history_tier_copy (const UpHistoryTier *tier, guint from, guint to, UpHistorySeries *dest, gboolean reverse)
+{
+	const UpHistoryTierRecord *record;
+	guint i;
+
+	if (from >= to)
+		return;
+	up_history_series_reserve (dest, dest->len + to - from);
+	for (i = 0; i < to - from; i++) {
+		record = up_history_tier_get (tier, reverse ? to - 1 - i : from + i);
+		up_history_series_append (dest, record->time, record->mean, record->state);
+	}
+}
+
+/**
+ * up_history_tier_reset:
+ **/
+static void
+up_history_tier_reset (UpHistoryTier *tier, guint level)
+{
+	g_free (tier->buckets);
+	memset (tier, 0, sizeof (UpHistoryTier));
+	tier->header.width = up_history_tier_levels[level].width;
+	tier->header.capacity = up_history_tier_levels[level].capacity;
+}
+
+/**
+ * up_history_tier_add:
+ **/
+static void
+up_history_tier_add (UpHistoryTier *tier, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	UpHistoryTierHeader *header = &tier->header;
+	UpHistoryTierRecord *record;
+	guint32 slot = time_s / header->width;
+
+	header->last_time = time_s;
+
+	/* the marker of a new session only separates it from the data
+	 * before it, so it needs no bucket if there is none */
+	if (header->len == 0 && state == UP_DEVICE_STATE_UNKNOWN)
+		return;
+
+	/* add to the last bucket if it is for the same slot and state */
+	if (header->len > 0) {
+		record = up_history_tier_get (tier, header->len - 1);
+		if (slot == header->slot && record->state == state) {
+			header->time_sum += time_s;
+			header->value_sum += value;
+			record->count++;
+			record->time = header->time_sum / record->count;
+			record->mean = header->value_sum / record->count;
+			record->min = MIN (record->min, value);
+			record->max = MAX (record->max, value);
+			return;
+		}
+	}
+
+	/* start a new bucket, growing the ring until it reaches its
+	 * capacity, and then reusing the oldest one */
+	if (header->len == tier->allocated && tier->allocated < header->capacity) {
+		g_assert (tier->start == 0);
+		tier->allocated = MIN (MAX (tier->allocated * 2, UP_HISTORY_TIER_MIN_ALLOCATED),
+				       header->capacity);
+		tier->buckets = g_renew (UpHistoryTierRecord, tier->buckets, tier->allocated);
+	}
+	if (header->len == header->capacity) {
+		tier->start = (tier->start + 1) % header->capacity;
+		header->len--;
+	}
+	record = up_history_tier_get (tier, header->len);
+	memset (record, 0, sizeof (UpHistoryTierRecord));
+	record->time = time_s;
+	record->count = 1;
+	record->state = state;
+	record->min = value;
+	record->mean = value;
+	record->max = value;
+	header->len++;
+	header->slot = slot;
+	header->time_sum = time_s;
+	header->value_sum = value;
+}
+
+/**
+ * up_history_series_kept:
+ *
+ * Return value: the number of points of a series that will not be
+ * replaced anymore, which is all of them unless the newest one may
+ * still be moved along a line by up_history_door_replace()
+ **/
+static guint
+up_history_series_kept (UpHistory *history, UpHistoryType type)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+
+	if (history->priv->doors[type].pending && series->len > series->saved)
+		return series->len - 1;
+	return series->len;
+}
+
+/**
+ * up_history_tiers_replay:
+ *
+ * Adds the points of a series the tiers have not seen yet.
+ **/
+static void
+up_history_tiers_replay (UpHistory *history, UpHistoryType type)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	guint i, j;
+
+	for (j = 0; j < UP_HISTORY_TIER_LAST; j++) {
+		UpHistoryTier *tier = &history->priv->tiers[type][j];
+
+		i = up_history_series_upper_bound (series, tier->header.last_time);
+		for (; i < series->len; i++)
+			up_history_tier_add (tier, series->time[i], series->value[i], series->state[i]);
+	}
+	history->priv->tiers_covered[type] = series->len;
+	history->priv->tiers_dirty = TRUE;
+}
+
+/**
+ * up_history_profile_reset:
+ **/
+static void
+up_history_profile_reset (UpHistoryProfile *profile)
+{
+	memset (profile, 0, sizeof (UpHistoryProfile));
+	profile->oldbin = 999;
+}
+
+/**
+ * up_history_profile_add:
+ *
+ * Adds the next charge point to the statistics. Points are only
+ * counted when the charge moved to a different whole percentage by a
+ * plausible amount since the last counted one, in the same state.
+ **/
+static void
+up_history_profile_add (UpHistoryProfile *profile, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	UpHistoryProfileBin *bin_item = NULL;
+	gdouble diff;
+	guint bin;
+
+	if (!profile->has_last || state != profile->last_state) {
+		profile->has_old = FALSE;
+		goto out;
+	}
+
+	/* round to the nearest int */
+	bin = rint (value);
+
+	/* ensure bin is in range */
+	if (bin >= UP_HISTORY_PROFILE_BINS)
+		bin = UP_HISTORY_PROFILE_BINS - 1;
+
+	/* different */
+	if (profile->oldbin != bin) {
+		profile->oldbin = bin;
+		if (profile->has_old) {
+			/* not enough or too much difference */
+			diff = fabs (value - profile->old_value);
+			if (diff < 0.01f) {
+				profile->has_old = FALSE;
+				goto out;
+			}
+			if (diff > 3.0f) {
+				profile->has_old = FALSE;
+				goto out;
+			}
+
+			if (state == UP_DEVICE_STATE_CHARGING)
+				bin_item = &profile->bins[0][bin];
+			else if (state == UP_DEVICE_STATE_DISCHARGING)
+				bin_item = &profile->bins[1][bin];
+			if (bin_item != NULL) {
+				bin_item->value += (guint) (time_s - profile->old_time);
+				bin_item->count = MIN (bin_item->count + 1, 100.0f);
+			}
+		}
+		profile->has_old = TRUE;
+		profile->old_time = time_s;
+		profile->old_value = value;
+	}
+out:
+	profile->has_last = TRUE;
+	profile->last_state = state;
+	profile->last_time = time_s;
+	profile->last_value = value;
+	profile->covered++;
+}
+
+/**
+ * up_history_profile_replay:
+ *
+ * Adds the charge points the statistics do not cover yet, leaving out
+ * one that may still be replaced.
+ **/
+static void
+up_history_profile_replay (UpHistory *history)
+{
+	const UpHistorySeries *series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
+	UpHistoryProfile *profile = &history->priv->profile;
+	guint kept = up_history_series_kept (history, UP_HISTORY_TYPE_CHARGE);
+	guint i;
+
+	for (i = profile->covered; i < kept; i++)
+		up_history_profile_add (profile, series->time[i], series->value[i], series->state[i]);
+	history->priv->profile_dirty = TRUE;
+}
+
+/**
+ * up_history_profile_rebuild:
+ **/
+static void
+up_history_profile_rebuild (UpHistory *history)
+{
+	up_history_profile_reset (&history->priv->profile);
+	up_history_profile_replay (history);
+}
+
+/**
+ * up_history_quantize:
+ *
+ * Return value: %TRUE if @value is a whole number of quanta
+ **/
+static gboolean
+up_history_quantize (gdouble value, gint64 *quantum)
+{
+	gdouble scaled = value * UP_HISTORY_QUANTUM;
+
+	if (!(fabs (scaled) < 1e15))
+		return FALSE;
+	*quantum = (gint64) round (scaled);
+	return (gdouble) *quantum / UP_HISTORY_QUANTUM == value;
+}
+
+/**
+ * up_history_quantize_value:
+ **/
+static gdouble
+up_history_quantize_value (gdouble value)
+{
+	gdouble scaled = value * UP_HISTORY_QUANTUM;
+
+	if (!(fabs (scaled) < 1e15))
+		return value;
+	return round (scaled) / UP_HISTORY_QUANTUM;
+}
+
+/**
+ * up_history_summarize:
+ *
+ * Adds the points that will not be replaced anymore to the tiers and
+ * the statistics. Replaced points are never added, so rebuilding them
+ * from the series gives the same result.
+ **/
+static void
+up_history_summarize (UpHistory *history, UpHistoryType type)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	guint kept = up_history_series_kept (history, type);
+	guint i, j;
+
+	for (i = history->priv->tiers_covered[type]; i < kept; i++) {
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++)
+			up_history_tier_add (&history->priv->tiers[type][j],
+					     series->time[i], series->value[i], series->state[i]);
+		history->priv->tiers_dirty = TRUE;
+	}
+	history->priv->tiers_covered[type] = MAX (history->priv->tiers_covered[type], kept);
+	if (type == UP_HISTORY_TYPE_CHARGE)
+		up_history_profile_replay (history);
+}
+
+/**
+ * up_history_append:
+ *
+ * Adds a new point at the end of a series; the tiers are updated by
+ * up_history_summarize().
+ **/
+static void
+up_history_append (UpHistory *history, UpHistoryType type, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	if (history->priv->compact_encoding)
+		value = up_history_quantize_value (value);
+	up_history_series_append (&history->priv->series[type], time_s, value, state);
+	history->priv->generation[type]++;
+}
+
+/**
+ * up_history_door_narrow:
+ *
+ * Only keeps the slopes that are within the tolerance of the new point.
+ **/
+static void
+up_history_door_narrow (UpHistoryDoor *door, guint32 time_s, gdouble value)
+{
+	gdouble elapsed = time_s - door->anchor_time;
+
+	door->lower = MAX (door->lower, (value - door->tolerance - door->anchor_value) / elapsed);
+	door->upper = MIN (door->upper, (value + door->tolerance - door->anchor_value) / elapsed);
+}
+
+/**
+ * up_history_door_open:
+ *
+ * Called after a point has been appended, which makes the point before
+ * it the anchor.
+ **/
+static void
+up_history_door_open (UpHistory *history, UpHistoryType type)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	UpHistoryDoor *door = &history->priv->doors[type];
+	guint last = series->len - 1;
+
+	door->pending = FALSE;
+	if (door->tolerance <= 0 || series->len < 2)
+		return;
+	if (series->state[last - 1] != series->state[last] ||
+	    series->time[last - 1] >= series->time[last])
+		return;
+
+	door->anchor_time = series->time[last - 1];
+	door->anchor_value = series->value[last - 1];
+	door->lower = -G_MAXDOUBLE;
+	door->upper = G_MAXDOUBLE;
+	up_history_door_narrow (door, series->time[last], series->value[last]);
+	door->pending = TRUE;
+}
+
+/**
+ * up_history_door_replace:
+ *
+ * Replaces the newest point with a new one if the points it stands for
+ * are all within the tolerance of the line to the new one.
+ *
+ * Return value: %TRUE if the newest point was replaced
+ **/
+static gboolean
+up_history_door_replace (UpHistory *history, UpHistoryType type, guint32 time_s, gdouble value, UpDeviceState state)
+{
+	UpHistorySeries *series = &history->priv->series[type];
+	UpHistoryDoor *door = &history->priv->doors[type];
+	guint last = series->len - 1;
+	gdouble slope;
+
+	if (!door->pending || series->len == 0)
+		return FALSE;
+
+	/* what is on disk is only ever appended to */
+	if (last < series->saved)
+		return FALSE;
+	if (series->state[last] != state || time_s <= door->anchor_time)
+		return FALSE;
+
+	if (history->priv->compact_encoding)
+		value = up_history_quantize_value (value);
+	slope = (value - door->anchor_value) / (time_s - door->anchor_time);
+	if (slope < door->lower || slope > door->upper)
+		return FALSE;
+	up_history_door_narrow (door, time_s, value);
+
+	/* the tiers and statistics only see it once it is kept */
+	series->time[last] = time_s;
+	series->value[last] = value;
+	history->priv->generation[type]++;
+	return TRUE;
+}
+
+/**
+ * up_history_series_add_item:
  **/
 static void
-up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
+up_history_series_add_item (GPtrArray *array, guint32 time_s, gdouble value, UpDeviceState state)
 {
-	g_ptr_array_add (dest, g_object_ref (item));
+	UpHistoryItem *item;
+
+	item = up_history_item_new ();
+	up_history_item_set_time (item, time_s);
+	up_history_item_set_value (item, value);
+	up_history_item_set_state (item, state);
+	g_ptr_array_add (array, item);
 }
 
 /**
  * up_history_array_limit_resolution:
- * @array: The data we have for a specific graph
+ * @series: The data we have for a specific graph
  * @max_num: The max desired points
  *
  * We need to reduce the number of data points else the graph will take a long
@@ -114,10 +860,8 @@ up_history_array_copy_cb (UpHistoryItem *item, GPtrArray *dest)
  * 3 = 85,30
  **/
 static GPtrArray *
-up_history_array_limit_resolution (GPtrArray *array, guint max_num)
+up_history_array_limit_resolution (const UpHistorySeries *series, guint max_num)
 {
-	UpHistoryItem *item;
-	UpHistoryItem *item_new;
 	guint length;
 	guint i;
 	guint64 last;
@@ -130,23 +874,22 @@ up_history_array_limit_resolution (GPtrArray *array, guint max_num)
 	guint step = 1;
 
 	new = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	g_debug ("length of array (before) %i", array->len);
+	g_debug ("length of array (before) %i", series->len);
 
 	/* check length */
-	length = array->len;
+	length = series->len;
 	if (length == 0)
 		goto out;
 	if (length < max_num) {
 		/* need to copy array */
-		g_ptr_array_foreach (array, (GFunc) up_history_array_copy_cb, new);
+		for (i = 0; i < length; i++)
+			up_history_series_add_item (new, series->time[i], series->value[i], series->state[i]);
 		goto out;
 	}
 
 	/* last element */
-	item = (UpHistoryItem *) g_ptr_array_index (array, length-1);
-	last = up_history_item_get_time (item);
-	item = (UpHistoryItem *) g_ptr_array_index (array, 0);
-	first = up_history_item_get_time (item);
+	last = series->time[length-1];
+	first = series->time[0];
 
 	/* Reduces the number of points to a pre-set level using a time
 	 * division algorithm so we don't keep diluting the previous
@@ -154,39 +897,29 @@ up_history_array_limit_resolution (GPtrArray *array, guint max_num)
 	for (i = 0; i < length; i++) {
 		guint64 preset;
 
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
 		preset = last + ((first - last) * (guint64) step) / max_num;
 
 		/* if state changed or we went over the preset do a new point */
 		if (count > 0 &&
-		    (up_history_item_get_time (item) > preset ||
-		     up_history_item_get_state (item) != state)) {
-			item_new = up_history_item_new ();
-			up_history_item_set_time (item_new, time_s / count);
-			up_history_item_set_value (item_new, value / count);
-			up_history_item_set_state (item_new, state);
-			g_ptr_array_add (new, item_new);
+		    (series->time[i] > preset ||
+		     series->state[i] != state)) {
+			up_history_series_add_item (new, time_s / count, value / count, state);
 
 			step++;
-			time_s = up_history_item_get_time (item);
-			value = up_history_item_get_value (item);
-			state = up_history_item_get_state (item);
+			time_s = series->time[i];
+			value = series->value[i];
+			state = series->state[i];
 			count = 1;
 		} else {
 			count++;
-			time_s += up_history_item_get_time (item);
-			value += up_history_item_get_value (item);
+			time_s += series->time[i];
+			value += series->value[i];
 		}
 	}
 
 	/* only add if nonzero */
-	if (count > 0) {
-		item_new = up_history_item_new ();
-		up_history_item_set_time (item_new, time_s / count);
-		up_history_item_set_value (item_new, value / count);
-		up_history_item_set_state (item_new, state);
-		g_ptr_array_add (new, item_new);
-	}
+	if (count > 0)
+		up_history_series_add_item (new, time_s / count, value / count, state);
 
 	/* check length */
 	g_debug ("length of array (after) %i", new->len);
@@ -195,82 +928,764 @@ out:
 }
 
 /**
- * up_history_copy_array_timespan:
+ * up_history_array_lttb:
+ * @series: the points, in time order either way
+ * @max_num: the number of points to return, at least 3
+ *
+ * Largest-Triangle-Three-Buckets: keeps the first and last points, and
+ * from each bucket in between the point that makes the largest triangle
+ * with the point kept before it and the average of the next bucket.
+ * Unlike averaging this keeps peaks, so the shape of the graph is
+ * preserved with far fewer points.
  **/
 static GPtrArray *
-up_history_copy_array_timespan (const GPtrArray *array, guint timespan)
+up_history_array_lttb (const UpHistorySeries *series, guint max_num)
 {
-	guint i;
-	UpHistoryItem *item;
-	GPtrArray *array_new;
-	gint64 time_now;
-
-	/* no data */
-	if (array->len == 0)
-		return NULL;
+	GPtrArray *new;
+	gdouble every;
+	gdouble origin;
+	guint kept = 0;
+	guint i, j;
+
+	new = g_ptr_array_new_full (max_num, (GDestroyNotify) g_object_unref);
+	up_history_series_add_item (new, series->time[0], series->value[0], series->state[0]);
+
+	/* relative times, so the areas are not dominated by rounding */
+	origin = series->time[0];
+	every = (gdouble) (series->len - 2) / (max_num - 2);
+	for (i = 0; i < max_num - 2; i++) {
+		guint start = (guint) (i * every) + 1;
+		guint end = (guint) ((i + 1) * every) + 1;
+		guint next_end = MIN ((guint) ((i + 2) * every) + 1, series->len);
+		gdouble avg_time = 0;
+		gdouble avg_value = 0;
+		gdouble kept_time = series->time[kept] - origin;
+		gdouble kept_value = series->value[kept];
+		gdouble max_area = -1;
+		guint chosen = start;
+
+		/* the average of the next bucket, or the last point */
+		for (j = end; j < next_end; j++) {
+			avg_time += series->time[j] - origin;
+			avg_value += series->value[j];
+		}
+		if (next_end > end) {
+			avg_time /= next_end - end;
+			avg_value /= next_end - end;
+		} else {
+			avg_time = series->time[series->len - 1] - origin;
+			avg_value = series->value[series->len - 1];
+		}
 
-	/* no limit on data */
-	if (timespan == 0) {
-		array_new = g_ptr_array_ref ((GPtrArray *) array);
-		goto out;
+		for (j = start; j < end; j++) {
+			gdouble area = fabs ((kept_time - avg_time) * (series->value[j] - kept_value) -
+					     (kept_time - (series->time[j] - origin)) * (avg_value - kept_value));
+			if (area > max_area) {
+				max_area = area;
+				chosen = j;
+			}
+		}
+		up_history_series_add_item (new, series->time[chosen], series->value[chosen], series->state[chosen]);
+		kept = chosen;
 	}
 
-	/* new data */
-	array_new = g_ptr_array_new ();
-	time_now = g_get_real_time ();
-	g_debug ("limiting data to last %i seconds", timespan);
+	i = series->len - 1;
+	up_history_series_add_item (new, series->time[i], series->value[i], series->state[i]);
+	return new;
+}
 
-	/* treat the timespan like a range, and search backwards */
-	timespan *= 0.95f;
-	for (i=array->len-1; i>0; i--) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if ((time_now / 1000000) - up_history_item_get_time (item) < timespan)
-			g_ptr_array_add (array_new, g_object_ref (item));
+/**
+ * up_history_array_minmax:
+ * @series: the points, in time order either way
+ * @max_num: the number of points to return, at least 2
+ *
+ * Keeps the lowest and highest point of each of @max_num / 2 buckets,
+ * in the order they were in, so no extreme is lost.
+ **/
+static GPtrArray *
+up_history_array_minmax (const UpHistorySeries *series, guint max_num)
+{
+	GPtrArray *new;
+	guint buckets = max_num / 2;
+	guint i, j;
+
+	new = g_ptr_array_new_full (max_num, (GDestroyNotify) g_object_unref);
+	for (i = 0; i < buckets; i++) {
+		guint start = (guint64) i * series->len / buckets;
+		guint end = (guint64) (i + 1) * series->len / buckets;
+		guint min = start;
+		guint max = start;
+
+		for (j = start + 1; j < end; j++) {
+			if (series->value[j] < series->value[min])
+				min = j;
+			if (series->value[j] > series->value[max])
+				max = j;
+		}
+		if (min > max) {
+			j = min;
+			min = max;
+			max = j;
+		}
+		up_history_series_add_item (new, series->time[min], series->value[min], series->state[min]);
+		if (max != min)
+			up_history_series_add_item (new, series->time[max], series->value[max], series->state[max]);
 	}
-out:
-	return array_new;
+	return new;
 }
 
 /**
- * up_history_get_data:
+ * up_history_array_downsample:
  **/
-GPtrArray *
-up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+static GPtrArray *
+up_history_array_downsample (const UpHistorySeries *series, guint max_num, UpHistoryDownsample method)
 {
-	GPtrArray *array;
-	GPtrArray *array_resolution;
-	const GPtrArray *array_data = NULL;
-
+	/* only the averaging works with so few points */
+	if (series->len <= max_num || max_num < 3)
+		method = UP_HISTORY_DOWNSAMPLE_AVERAGE;
+
+	switch (method) {
+	case UP_HISTORY_DOWNSAMPLE_LTTB:
+		return up_history_array_lttb (series, max_num);
+	case UP_HISTORY_DOWNSAMPLE_MINMAX:
+		return up_history_array_minmax (series, max_num);
+	default:
+		return up_history_array_limit_resolution (series, max_num);
+	}
+}
+
+/**
+ * up_history_downsample_from_string:
+ **/
+UpHistoryDownsample
+up_history_downsample_from_string (const gchar *method)
+{
+	if (g_strcmp0 (method, "average") == 0)
+		return UP_HISTORY_DOWNSAMPLE_AVERAGE;
+	if (g_strcmp0 (method, "lttb") == 0)
+		return UP_HISTORY_DOWNSAMPLE_LTTB;
+	if (g_strcmp0 (method, "minmax") == 0)
+		return UP_HISTORY_DOWNSAMPLE_MINMAX;
+	return UP_HISTORY_DOWNSAMPLE_UNKNOWN;
+}
+
+/**
+ * up_history_get_cutoff:
+ *
+ * Return value: the time points must be newer than to be returned for
+ * @timespan, or 0 for all of them.
+ **/
+static gint64
+up_history_get_cutoff (guint timespan)
+{
+	if (timespan == 0)
+		return 0;
+
+	/* treat the timespan like a range */
+	timespan *= 0.95f;
+	return (g_get_real_time () / 1000000) - timespan;
+}
+
+/**
+ * up_history_copy_array_timespan:
+ * @first: the oldest point that can be returned
+ *
+ * Copies the points newer than @cutoff, newest first.
+ **/
+static void
+up_history_copy_array_timespan (const UpHistorySeries *series, guint first, gint64 cutoff, UpHistorySeries *dest)
+{
+	guint i;
+	guint start;
+
+	/* the points are in time order */
+	start = up_history_series_upper_bound (series, cutoff);
+	start = MAX (start, first);
+	if (start >= series->len)
+		return;
+	up_history_series_reserve (dest, dest->len + series->len - start);
+	for (i=series->len; i>start; i--)
+		up_history_series_append (dest, series->time[i-1], series->value[i-1], series->state[i-1]);
+}
+
+/**
+ * up_history_find_archive:
+ * @from: (out): the first bucket to use
+ * @to: (out): the bucket after the last one to use
+ *
+ * Finds what the tiers still have from before the raw points were
+ * culled, using the finest one that goes back to @cutoff.
+ *
+ * Return value: the tier to use, or %NULL if there is nothing
+ **/
+static const UpHistoryTier *
+up_history_find_archive (UpHistory *history, UpHistoryType type, gint64 cutoff, guint *from, guint *to)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	const UpHistoryTier *tier = NULL;
+	gint64 end;
+	guint i;
+
+	/* only where the raw points have expired */
+	end = (g_get_real_time () / 1000000) - history->priv->max_data_age;
+	if (series->len > 0)
+		end = MIN (end, series->time[0]);
+	if (end <= cutoff)
+		return NULL;
+
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++) {
+		tier = &history->priv->tiers[type][i];
+		if (tier->header.len > 0 &&
+		    up_history_tier_get (tier, 0)->time <= cutoff + tier->header.width)
+			break;
+	}
+	*from = up_history_tier_upper_bound (tier, cutoff);
+	*to = up_history_tier_upper_bound (tier, end - 1);
+	if (*from >= *to)
+		return NULL;
+	return tier;
+}
+
+/**
+ * up_history_copy_archive:
+ *
+ * Copies what the tiers still have from before the raw points were
+ * culled.
+ **/
+static void
+up_history_copy_archive (UpHistory *history, UpHistoryType type, gint64 cutoff,
+			 UpHistorySeries *dest, gboolean reverse)
+{
+	const UpHistoryTier *tier;
+	guint from, to;
+
+	tier = up_history_find_archive (history, type, cutoff, &from, &to);
+	if (tier != NULL)
+		up_history_tier_copy (tier, from, to, dest, reverse);
+}
+
+/**
+ * up_history_get_tier:
+ *
+ * Finds the coarsest tier that still has at least @resolution buckets
+ * after @cutoff, if using it saves enough work over the raw points.
+ **/
+static const UpHistoryTier *
+up_history_get_tier (UpHistory *history, UpHistoryType type, gint64 cutoff, guint resolution)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	const UpHistoryTier *tier;
+	gint64 oldest;
+	guint timespan;
+	guint count;
+	gint i;
+
+	if (resolution == 0)
+		return NULL;
+
+	/* few enough points to use as-is */
+	oldest = MAX (cutoff, series->time[0]);
+	count = series->len - up_history_series_upper_bound (series, oldest);
+	if (count / UP_HISTORY_TIER_MIN_RATIO <= resolution)
+		return NULL;
+
+	timespan = series->time[series->len-1] - oldest;
+	for (i = UP_HISTORY_TIER_LAST - 1; i >= 0; i--) {
+		tier = &history->priv->tiers[type][i];
+		if (tier->header.width > timespan / resolution)
+			continue;
+
+		/* it has to go back as far as the raw points do */
+		if (tier->header.len == 0 ||
+		    up_history_tier_get (tier, 0)->time > oldest + tier->header.width)
+			return NULL;
+		return tier;
+	}
+	return NULL;
+}
+
+/**
+ * up_history_get_data_downsampled:
+ * @method: how to reduce the data to @resolution points
+ **/
+GPtrArray *
+up_history_get_data_downsampled (UpHistory *history, UpHistoryType type, guint timespan,
+				 guint resolution, UpHistoryDownsample method)
+{
+	GPtrArray *array_resolution;
+	const UpHistorySeries *series;
+	const UpHistoryTier *tier;
+	UpHistorySeries selection = { NULL, };
+	gint64 cutoff;
+
 	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
 
 	if (history->priv->id == NULL)
 		return NULL;
 
-	if (type == UP_HISTORY_TYPE_CHARGE)
-		array_data = history->priv->data_charge;
-	else if (type == UP_HISTORY_TYPE_RATE)
-		array_data = history->priv->data_rate;
-	else if (type == UP_HISTORY_TYPE_TIME_FULL)
-		array_data = history->priv->data_time_full;
-	else if (type == UP_HISTORY_TYPE_TIME_EMPTY)
-		array_data = history->priv->data_time_empty;
-
 	/* not recognised */
-	if (array_data == NULL)
+	if (up_history_type_to_string (type) == NULL)
 		return NULL;
 
-	/* only return a certain time */
-	array = up_history_copy_array_timespan (array_data, timespan);
-	if (array == NULL)
+	/* no data */
+	series = &history->priv->series[type];
+	if (series->len == 0)
 		return NULL;
 
+	/* only return a certain time */
+	if (timespan > 0)
+		g_debug ("limiting data to last %i seconds", timespan);
+	cutoff = up_history_get_cutoff (timespan);
+
+	/* use pre-averaged data when there are many more points than wanted,
+	 * unless the peaks the averages hide are wanted */
+	tier = NULL;
+	if (method == UP_HISTORY_DOWNSAMPLE_AVERAGE)
+		tier = up_history_get_tier (history, type, cutoff, resolution);
+	if (tier != NULL) {
+		g_debug ("using %i buckets rather than %i points", tier->header.len, series->len);
+		up_history_tier_copy (tier, up_history_tier_upper_bound (tier, cutoff),
+				      tier->header.len, &selection, timespan > 0);
+	} else if (timespan == 0) {
+		/* no limit on data */
+		up_history_copy_archive (history, type, cutoff, &selection, FALSE);
+		if (selection.len == 0)
+			return up_history_array_downsample (series, resolution, method);
+		up_history_series_reserve (&selection, selection.len + series->len);
+		memcpy (selection.time + selection.len, series->time, series->len * sizeof (guint32));
+		memcpy (selection.value + selection.len, series->value, series->len * sizeof (gdouble));
+		memcpy (selection.state + selection.len, series->state, series->len * sizeof (guint8));
+		selection.len += series->len;
+	} else {
+		/* newest first, the first raw point is never included */
+		up_history_copy_array_timespan (series, 1, cutoff, &selection);
+		up_history_copy_archive (history, type, cutoff, &selection, TRUE);
+	}
+
 	/* only add a certain number of points */
-	array_resolution = up_history_array_limit_resolution (array, resolution);
-	g_ptr_array_unref (array);
+	array_resolution = up_history_array_downsample (&selection, resolution, method);
+	up_history_series_clear (&selection);
 
 	return array_resolution;
 }
 
+/* what is known of a bucket of GetHistoryAggregate so far */
+typedef struct {
+	guint64			 time_sum;
+	gdouble			 sum;
+	gdouble			 min;
+	gdouble			 max;
+	guint32			 count;
+	guint32			 state;
+} UpHistoryAggregateSum;
+
+/**
+ * up_history_aggregate_values:
+ *
+ * Finds the extremes and the sum of the values of a run of points. The
+ * four independent lanes let the compiler vectorize the loop without
+ * having to reorder the additions itself, which it may not do.
+ **/
+static void
+up_history_aggregate_values (const gdouble *values, guint len,
+			     gdouble *min, gdouble *max, gdouble *sum)
+{
+	gdouble lo[4], hi[4], total[4];
+	guint i, j;
+
+	for (j = 0; j < 4; j++) {
+		lo[j] = values[0];
+		hi[j] = values[0];
+		total[j] = 0;
+	}
+	for (i = 0; i + 4 <= len; i += 4) {
+		for (j = 0; j < 4; j++) {
+			gdouble value = values[i + j];
+			lo[j] = value < lo[j] ? value : lo[j];
+			hi[j] = value > hi[j] ? value : hi[j];
+			total[j] += value;
+		}
+	}
+	for (; i < len; i++) {
+		lo[0] = values[i] < lo[0] ? values[i] : lo[0];
+		hi[0] = values[i] > hi[0] ? values[i] : hi[0];
+		total[0] += values[i];
+	}
+
+	*min = MIN (MIN (lo[0], lo[1]), MIN (lo[2], lo[3]));
+	*max = MAX (MAX (hi[0], hi[1]), MAX (hi[2], hi[3]));
+	*sum = (total[0] + total[1]) + (total[2] + total[3]);
+}
+
+/**
+ * up_history_aggregate_times:
+ **/
+static guint64
+up_history_aggregate_times (const guint32 *times, guint len)
+{
+	guint64 total = 0;
+	guint i;
+
+	for (i = 0; i < len; i++)
+		total += times[i];
+	return total;
+}
+
+/**
+ * up_history_aggregate_add:
+ **/
+static void
+up_history_aggregate_add (UpHistoryAggregateSum *acc, guint64 time_sum, guint32 count,
+			  gdouble min, gdouble max, gdouble sum, guint32 state)
+{
+	if (acc->count == 0) {
+		acc->min = min;
+		acc->max = max;
+	} else {
+		acc->min = MIN (acc->min, min);
+		acc->max = MAX (acc->max, max);
+	}
+	acc->time_sum += time_sum;
+	acc->sum += sum;
+	acc->count += count;
+	acc->state = state;
+}
+
+/**
+ * up_history_get_range:
+ * @first_time: (out): the time of the oldest point after @cutoff
+ * @last_time: (out): the time of the newest point
+ *
+ * Return value: the number of points after @cutoff, including what the
+ * tiers have from before the raw points were culled
+ **/
+static guint
+up_history_get_range (UpHistory *history, UpHistoryType type, gint64 cutoff,
+		      gint64 *first_time, gint64 *last_time)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	const UpHistoryTier *tier;
+	guint from = 0;
+	guint to = 0;
+	guint start;
+
+	start = up_history_series_upper_bound (series, cutoff);
+	tier = up_history_find_archive (history, type, cutoff, &from, &to);
+	if (tier == NULL && start >= series->len)
+		return 0;
+
+	if (tier != NULL)
+		*first_time = up_history_tier_get (tier, from)->time;
+	else
+		*first_time = series->time[start];
+	if (start < series->len)
+		*last_time = series->time[series->len - 1];
+	else
+		*last_time = up_history_tier_get (tier, to - 1)->time;
+	return (series->len - start) + (to - from);
+}
+
+/**
+ * up_history_aggregate_fill:
+ * @sums: one for each of the @buckets slots of @width seconds from @first_time
+ *
+ * Adds the points after @cutoff to the slot they are in.
+ **/
+static void
+up_history_aggregate_fill (UpHistory *history, UpHistoryType type, gint64 cutoff,
+			   gint64 first_time, guint64 width, guint buckets, UpHistoryAggregateSum *sums)
+{
+	const UpHistorySeries *series = &history->priv->series[type];
+	const UpHistoryTier *tier;
+	guint archive_from = 0;
+	guint archive_to = 0;
+	guint i;
+	guint k;
+
+	i = up_history_series_upper_bound (series, cutoff);
+	tier = up_history_find_archive (history, type, cutoff, &archive_from, &archive_to);
+	for (k = 0; k < buckets; k++) {
+		UpHistoryAggregateSum *acc = &sums[k];
+		gint64 slot_end = first_time + (k + 1) * width;
+		guint end;
+
+		/* the older part comes from the tiers */
+		for (; tier != NULL && archive_from < archive_to; archive_from++) {
+			const UpHistoryTierRecord *record = up_history_tier_get (tier, archive_from);
+
+			if (record->time >= slot_end)
+				break;
+			up_history_aggregate_add (acc, (guint64) record->time * record->count, record->count,
+						  record->min, record->max, record->mean * record->count,
+						  record->state);
+		}
+
+		/* and the rest from the raw points */
+		end = up_history_series_upper_bound (series, slot_end - 1);
+		if (end > i) {
+			gdouble min, max, sum;
+
+			up_history_aggregate_values (series->value + i, end - i, &min, &max, &sum);
+			up_history_aggregate_add (acc, up_history_aggregate_times (series->time + i, end - i),
+						  end - i, min, max, sum, series->state[end - 1]);
+			i = end;
+		}
+	}
+}
+
+/**
+ * up_history_get_aggregate:
+ * @buckets: the number of time slots to split the data into
+ *
+ * Summarizes the data in equal time slots, oldest first, including
+ * what the tiers have from before the raw points were culled. Slots
+ * without data are left out. Each bucket has the mean time of its
+ * points and the state of the newest one.
+ *
+ * Return value: (element-type UpHistoryAggregate): the buckets, or
+ * %NULL if there is no data
+ **/
+GArray *
+up_history_get_aggregate (UpHistory *history, UpHistoryType type, guint timespan, guint buckets)
+{
+	g_autofree UpHistoryAggregateSum *sums = NULL;
+	GArray *array;
+	gint64 cutoff;
+	gint64 first_time;
+	gint64 last_time;
+	guint64 width;
+	guint len;
+	guint k;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+	if (up_history_type_to_string (type) == NULL)
+		return NULL;
+	if (history->priv->series[type].len == 0)
+		return NULL;
+
+	array = g_array_new (FALSE, FALSE, sizeof (UpHistoryAggregate));
+	cutoff = up_history_get_cutoff (timespan);
+	len = up_history_get_range (history, type, cutoff, &first_time, &last_time);
+
+	/* there cannot be more buckets with data than points */
+	buckets = MIN (buckets, len);
+	if (buckets == 0)
+		return array;
+	width = (last_time - first_time) / buckets + 1;
+
+	sums = g_new0 (UpHistoryAggregateSum, buckets);
+	up_history_aggregate_fill (history, type, cutoff, first_time, width, buckets, sums);
+	for (k = 0; k < buckets; k++) {
+		UpHistoryAggregate bucket;
+
+		if (sums[k].count == 0)
+			continue;
+		bucket.time = sums[k].time_sum / sums[k].count;
+		bucket.count = sums[k].count;
+		bucket.state = sums[k].state;
+		bucket.reserved = 0;
+		bucket.min = sums[k].min;
+		bucket.max = sums[k].max;
+		bucket.mean = sums[k].sum / sums[k].count;
+		g_array_append_val (array, bucket);
+	}
+	return array;
+}
+
+/**
+ * up_history_get_columns:
+ * @types: the series to return
+ * @resolution: the maximum number of time slots
+ *
+ * Averages several series over the same equal time slots, oldest first,
+ * so they can be drawn against a single time axis. Each series is only
+ * walked once. Slots where none of them has data are left out, and a
+ * series has a NaN value in the slots it has no data for.
+ *
+ * Return value: the columns, or %NULL if a type is not recognised
+ **/
+UpHistoryColumns *
+up_history_get_columns (UpHistory *history, const UpHistoryType *types, guint n_types,
+			guint timespan, guint resolution)
+{
+	g_autofree UpHistoryAggregateSum *sums = NULL;
+	UpHistoryColumns *columns;
+	gint64 cutoff;
+	gint64 first_time = G_MAXINT64;
+	gint64 last_time = 0;
+	guint64 width;
+	guint len = 0;
+	guint i;
+	guint j;
+	guint k;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+	for (i = 0; i < n_types; i++) {
+		if (up_history_type_to_string (types[i]) == NULL)
+			return NULL;
+	}
+
+	columns = g_new0 (UpHistoryColumns, 1);
+	columns->n_types = n_types;
+
+	/* the slots cover all of the series */
+	cutoff = up_history_get_cutoff (timespan);
+	for (i = 0; i < n_types; i++) {
+		gint64 first;
+		gint64 last;
+		guint count;
+
+		count = up_history_get_range (history, types[i], cutoff, &first, &last);
+		if (count == 0)
+			continue;
+		first_time = MIN (first_time, first);
+		last_time = MAX (last_time, last);
+		len = MAX (len, count);
+	}
+	resolution = MIN (resolution, len);
+	if (resolution == 0)
+		return columns;
+	width = (last_time - first_time) / resolution + 1;
+
+	sums = g_new0 (UpHistoryAggregateSum, n_types * resolution);
+	for (i = 0; i < n_types; i++)
+		up_history_aggregate_fill (history, types[i], cutoff, first_time, width,
+					   resolution, sums + i * resolution);
+
+	columns->time = g_new (guint32, resolution);
+	columns->state = g_new (guint32, resolution);
+	columns->value = g_new (gdouble, n_types * resolution);
+	for (k = 0; k < resolution; k++) {
+		guint64 time_sum = 0;
+		guint64 count = 0;
+		guint32 state = UP_DEVICE_STATE_UNKNOWN;
+
+		for (i = 0; i < n_types; i++) {
+			const UpHistoryAggregateSum *acc = &sums[i * resolution + k];
+
+			if (acc->count == 0)
+				continue;
+			time_sum += acc->time_sum;
+			count += acc->count;
+			state = acc->state;
+		}
+		if (count == 0)
+			continue;
+
+		/* the values are filled in column by column below */
+		j = columns->len++;
+		columns->time[j] = time_sum / count;
+		columns->state[j] = state;
+		for (i = 0; i < n_types; i++) {
+			const UpHistoryAggregateSum *acc = &sums[i * resolution + k];
+
+			columns->value[i * resolution + j] = acc->count > 0 ? acc->sum / acc->count : NAN;
+		}
+	}
+
+	/* pack the columns now that the length is known */
+	for (i = 1; i < n_types; i++)
+		memmove (columns->value + i * columns->len, columns->value + i * resolution,
+			 columns->len * sizeof (gdouble));
+	return columns;
+}
+
+/**
+ * up_history_columns_free:
+ **/
+void
+up_history_columns_free (UpHistoryColumns *columns)
+{
+	if (columns == NULL)
+		return;
+	g_free (columns->time);
+	g_free (columns->state);
+	g_free (columns->value);
+	g_free (columns);
+}
+
+/**
+ * up_history_get_data:
+ **/
+GPtrArray *
+up_history_get_data (UpHistory *history, UpHistoryType type, guint timespan, guint resolution)
+{
+	return up_history_get_data_downsampled (history, type, timespan, resolution,
+						UP_HISTORY_DOWNSAMPLE_AVERAGE);
+}
+
+/**
+ * up_history_get_data_since:
+ * @since: the time of the newest point the caller already has
+ *
+ * Gets the points recorded after @since, oldest first, so that they
+ * can be added to what the caller has. The newest point of a series
+ * with a tolerance may still move forward in time, so callers should
+ * ask from the point before their newest one and replace that.
+ *
+ * Return value: the points, or %NULL if there is no data
+ **/
+GPtrArray *
+up_history_get_data_since (UpHistory *history, UpHistoryType type, guint since)
+{
+	const UpHistorySeries *series;
+	GPtrArray *array;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
+
+	if (history->priv->id == NULL)
+		return NULL;
+	if (up_history_type_to_string (type) == NULL)
+		return NULL;
+	series = &history->priv->series[type];
+	if (series->len == 0)
+		return NULL;
+
+	i = up_history_series_upper_bound (series, since);
+	array = g_ptr_array_new_full (series->len - i, (GDestroyNotify) g_object_unref);
+	for (; i < series->len; i++)
+		up_history_series_add_item (array, series->time[i], series->value[i], series->state[i]);
+	return array;
+}
+
+/**
+ * up_history_get_generation:
+ *
+ * Gets a counter that goes up every time the points of a series
+ * change, so callers can tell if there is anything new to fetch.
+ **/
+guint64
+up_history_get_generation (UpHistory *history, UpHistoryType type)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), 0);
+	g_return_val_if_fail (type < UP_HISTORY_TYPE_UNKNOWN, 0);
+
+	return history->priv->generation[type];
+}
+
+/**
+ * up_history_get_epoch:
+ *
+ * Gets a counter that goes up every time the points of a series are
+ * replaced or culled rather than added to, so callers keeping a copy
+ * can tell when it has to be fetched again in full.
+ **/
+guint64
+up_history_get_epoch (UpHistory *history, UpHistoryType type)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), 0);
+	g_return_val_if_fail (type < UP_HISTORY_TYPE_UNKNOWN, 0);
+
+	return history->priv->epoch[type];
+}
+
 /**
  * up_history_get_profile_data:
  **/
@@ -280,73 +1695,24 @@ up_history_get_profile_data (UpHistory *history, gboolean charging)
 	guint i;
 	guint non_zero_accuracy = 0;
 	gfloat average = 0.0f;
-	guint bin;
-	guint oldbin = 999;
-	UpHistoryItem *item_last = NULL;
-	UpHistoryItem *item;
-	UpHistoryItem *item_old = NULL;
+	const UpHistoryProfileBin *bins;
 	UpStatsItem *stats;
-	GPtrArray *array;
 	GPtrArray *data;
-	guint time_s;
-	gdouble value;
 	gdouble total_value = 0.0f;
 
 	g_return_val_if_fail (UP_IS_HISTORY (history), NULL);
 
-	/* create 100 item list and set to zero */
-	data = g_ptr_array_new_full (101, g_object_unref);
-	for (i=0; i<101; i++) {
+	/* the totals are kept up to date as charge points are added */
+	bins = history->priv->profile.bins[charging ? 0 : 1];
+	data = g_ptr_array_new_full (UP_HISTORY_PROFILE_BINS, g_object_unref);
+	for (i=0; i<UP_HISTORY_PROFILE_BINS; i++) {
 		stats = up_stats_item_new ();
+		up_stats_item_set_value (stats, bins[i].value);
+		/* use the accuracy field as a counter for now */
+		up_stats_item_set_accuracy (stats, bins[i].count);
 		g_ptr_array_add (data, stats);
 	}
 
-	array = history->priv->data_charge;
-	for (i=0; i<array->len; i++) {
-		item = (UpHistoryItem *) g_ptr_array_index (array, i);
-		if (item_last == NULL ||
-		    up_history_item_get_state (item) != up_history_item_get_state (item_last)) {
-			item_old = NULL;
-			goto cont;
-		}
-
-		/* round to the nearest int */
-		bin = rint (up_history_item_get_value (item));
-
-		/* ensure bin is in range */
-		if (bin >= data->len)
-			bin = data->len - 1;
-
-		/* different */
-		if (oldbin != bin) {
-			oldbin = bin;
-			if (item_old != NULL) {
-				/* not enough or too much difference */
-				value = fabs (up_history_item_get_value (item) - up_history_item_get_value (item_old));
-				if (value < 0.01f) {
-					item_old = NULL;
-					goto cont;
-				}
-				if (value > 3.0f) {
-					item_old = NULL;
-					goto cont;
-				}
-
-				time_s = up_history_item_get_time (item) - up_history_item_get_time (item_old);
-				/* use the accuracy field as a counter for now */
-				if ((charging && up_history_item_get_state (item) == UP_DEVICE_STATE_CHARGING) ||
-				    (!charging && up_history_item_get_state (item) == UP_DEVICE_STATE_DISCHARGING)) {
-					stats = (UpStatsItem *) g_ptr_array_index (data, bin);
-					up_stats_item_set_value (stats, up_stats_item_get_value (stats) + time_s);
-					up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) + 1);
-				}
-			}
-			item_old = item;
-		}
-cont:
-		item_last = item;
-	}
-
 	/* divide the value by the number of samples to make the average */
 	for (i=0; i<101; i++) {
 		stats = (UpStatsItem *) g_ptr_array_index (data, i);
@@ -384,241 +1750,1119 @@ cont:
 		up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) * 20.0f);
 	}
 
-	return data;
+	return data;
+}
+
+/**
+ * up_history_build_filename:
+ **/
+static gchar *
+up_history_build_filename (const gchar *dir, const gchar *id, const gchar *type, const gchar *extension)
+{
+	gchar *path;
+	gchar *filename;
+
+	filename = g_strdup_printf ("history-%s-%s.%s", type, id, extension);
+	path = g_build_filename (dir, filename, NULL);
+	g_free (filename);
+	return path;
+}
+
+/**
+ * up_history_build_key:
+ *
+ * Where the data of a series is saved in the store.
+ **/
+static gchar *
+up_history_build_key (const gchar *id, const gchar *type)
+{
+	return g_strdup_printf ("%s/%s", id, type);
+}
+
+/**
+ * up_history_get_key:
+ **/
+static gchar *
+up_history_get_key (UpHistory *history, const gchar *type)
+{
+	return up_history_build_key (history->priv->id, type);
+}
+
+/**
+ * up_history_get_legacy_filename:
+ *
+ * The text format used before the binary one; only read for migration.
+ **/
+static gchar *
+up_history_get_legacy_filename (UpHistory *history, const gchar *type)
+{
+	return up_history_build_filename (up_history_store_get_dir (history->priv->store),
+					  history->priv->id, type, "dat");
+}
+
+/**
+ * up_history_set_directory:
+ **/
+void
+up_history_set_directory (UpHistory *history, const gchar *dir)
+{
+	g_clear_object (&history->priv->store);
+	history->priv->store = up_history_store_new (dir);
+	g_mkdir_with_parents (dir, 0755);
+}
+
+/**
+ * up_history_series_to_record:
+ **/
+static void
+up_history_series_to_record (const UpHistorySeries *series, guint i, UpHistoryRecord *record)
+{
+	memset (record, 0, sizeof (UpHistoryRecord));
+	record->time = series->time[i];
+	record->state = series->state[i];
+	record->value = series->value[i];
+}
+
+/**
+ * up_history_put_varint:
+ **/
+static void
+up_history_put_varint (GByteArray *buffer, guint64 value)
+{
+	guint8 bytes[10];
+	guint len = 0;
+
+	do {
+		bytes[len] = value & 0x7f;
+		value >>= 7;
+		if (value != 0)
+			bytes[len] |= 0x80;
+		len++;
+	} while (value != 0);
+	g_byte_array_append (buffer, bytes, len);
+}
+
+/**
+ * up_history_get_varint:
+ **/
+static gboolean
+up_history_get_varint (const guint8 **data, const guint8 *end, guint64 *value)
+{
+	guint shift;
+
+	*value = 0;
+	for (shift = 0; *data < end && shift < 64; shift += 7) {
+		guint8 byte = *(*data)++;
+
+		*value |= (guint64) (byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/**
+ * up_history_codec_init:
+ *
+ * Sets up @codec to continue after the first @from points.
+ **/
+static void
+up_history_codec_init (UpHistoryCodec *codec, const UpHistorySeries *series, guint from)
+{
+	memset (codec, 0, sizeof (UpHistoryCodec));
+	codec->state = UP_DEVICE_STATE_UNKNOWN;
+	if (from == 0)
+		return;
+	codec->time = series->time[from-1];
+	codec->delta = codec->time - (from >= 2 ? series->time[from-2] : 0);
+	if (!up_history_quantize (series->value[from-1], &codec->quantum))
+		codec->quantum = 0;
+	codec->state = series->state[from-1];
+}
+
+/**
+ * up_history_codec_encode:
+ **/
+static void
+up_history_codec_encode (UpHistoryCodec *codec, GByteArray *buffer,
+			 guint32 time_s, gdouble value, guint8 state)
+{
+	gint64 delta = (gint64) time_s - codec->time;
+	gint64 quantum = 0;
+	gboolean raw;
+	guint64 tag;
+
+	raw = !up_history_quantize (value, &quantum);
+	tag = UP_HISTORY_ZIGZAG (delta - codec->delta) << 2;
+	if (raw)
+		tag |= UP_HISTORY_CODEC_RAW;
+	if (state != codec->state)
+		tag |= UP_HISTORY_CODEC_STATE;
+	up_history_put_varint (buffer, tag);
+	if (state != codec->state)
+		g_byte_array_append (buffer, &state, 1);
+	if (raw) {
+		g_byte_array_append (buffer, (const guint8 *) &value, sizeof (gdouble));
+		quantum = 0;
+	} else {
+		up_history_put_varint (buffer, UP_HISTORY_ZIGZAG (quantum - codec->quantum));
+	}
+
+	codec->time = time_s;
+	codec->delta = delta;
+	codec->quantum = quantum;
+	codec->state = state;
+}
+
+/**
+ * up_history_codec_decode:
+ **/
+static gboolean
+up_history_codec_decode (UpHistoryCodec *codec, const guint8 **data, const guint8 *end,
+			 guint32 *time_s, gdouble *value, guint8 *state)
+{
+	guint64 tag;
+	guint64 change;
+	gint64 delta;
+	gint64 time_next;
+
+	if (!up_history_get_varint (data, end, &tag))
+		return FALSE;
+	delta = codec->delta + UP_HISTORY_UNZIGZAG (tag >> 2);
+	time_next = codec->time + delta;
+	if (time_next < 0 || time_next > G_MAXUINT32)
+		return FALSE;
+	if (tag & UP_HISTORY_CODEC_STATE) {
+		if (*data >= end)
+			return FALSE;
+		codec->state = *(*data)++;
+	}
+	if (tag & UP_HISTORY_CODEC_RAW) {
+		if (end - *data < (gssize) sizeof (gdouble))
+			return FALSE;
+		memcpy (value, *data, sizeof (gdouble));
+		*data += sizeof (gdouble);
+		codec->quantum = 0;
+	} else {
+		if (!up_history_get_varint (data, end, &change))
+			return FALSE;
+		codec->quantum += UP_HISTORY_UNZIGZAG (change);
+		*value = (gdouble) codec->quantum / UP_HISTORY_QUANTUM;
+	}
+
+	codec->time = time_next;
+	codec->delta = delta;
+	*time_s = time_next;
+	*state = codec->state;
+	return TRUE;
+}
+
+/**
+ * up_history_array_encode:
+ *
+ * Adds a block with the points from @from in the compact encoding.
+ **/
+static void
+up_history_array_encode (const UpHistorySeries *series, guint from, GByteArray *buffer)
+{
+	UpHistoryBlockHeader *block;
+	UpHistoryCodec codec;
+	guint offset = buffer->len;
+	guint i;
+
+	up_history_codec_init (&codec, series, from);
+	g_byte_array_set_size (buffer, offset + sizeof (UpHistoryBlockHeader));
+	for (i = from; i < series->len; i++)
+		up_history_codec_encode (&codec, buffer, series->time[i], series->value[i], series->state[i]);
+
+	block = (UpHistoryBlockHeader *) (buffer->data + offset);
+	block->size = buffer->len - offset - sizeof (UpHistoryBlockHeader);
+	block->count = series->len - from;
+}
+
+/**
+ * up_history_array_decode:
+ *
+ * Return value: %FALSE if the data ends early, the points before
+ * that are still added
+ **/
+static gboolean
+up_history_array_decode (UpHistorySeries *series, const guint8 *data, gsize length)
+{
+	const guint8 *end = data + length;
+	UpHistoryCodec codec;
+	guint i;
+
+	memset (&codec, 0, sizeof (UpHistoryCodec));
+	codec.state = UP_DEVICE_STATE_UNKNOWN;
+	while (data < end) {
+		UpHistoryBlockHeader block;
+		const guint8 *block_end;
+
+		if ((gsize) (end - data) < sizeof (UpHistoryBlockHeader))
+			return FALSE;
+		memcpy (&block, data, sizeof (UpHistoryBlockHeader));
+		data += sizeof (UpHistoryBlockHeader);
+		/* every record takes at least two bytes */
+		if (block.size > (gsize) (end - data) || block.count > block.size / 2)
+			return FALSE;
+		block_end = data + block.size;
+
+		up_history_series_reserve (series, series->len + block.count);
+		for (i = 0; i < block.count; i++) {
+			guint32 time_s;
+			gdouble value;
+			guint8 state;
+
+			if (!up_history_codec_decode (&codec, &data, block_end, &time_s, &value, &state))
+				return FALSE;
+			up_history_series_append (series, time_s, value, state);
+		}
+		if (data != block_end)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_array_to_bytes:
+ * @series: the data to save
+ * @from: the first point to include
+ * @header: whether to start with the file header
+ * @compact: whether to use the compact encoding
+ *
+ * Return value: the points from @from as they are saved in the file
+ **/
+static GBytes *
+up_history_array_to_bytes (const UpHistorySeries *series, guint from,
+			   gboolean header, gboolean compact)
+{
+	GByteArray *buffer;
+	guint i;
+
+	buffer = g_byte_array_sized_new (sizeof (UpHistoryFileHeader) +
+					 (series->len - from) * sizeof (UpHistoryRecord));
+	if (header) {
+		UpHistoryFileHeader file_header;
+
+		memset (&file_header, 0, sizeof (file_header));
+		memcpy (file_header.magic, UP_HISTORY_FILE_MAGIC, sizeof (file_header.magic));
+		file_header.byte_order = UP_HISTORY_FILE_BYTE_ORDER;
+		file_header.version = compact ? UP_HISTORY_FILE_VERSION_COMPACT : UP_HISTORY_FILE_VERSION;
+		file_header.record_size = compact ? 0 : sizeof (UpHistoryRecord);
+		g_byte_array_append (buffer, (const guint8 *) &file_header, sizeof (file_header));
+	}
+
+	/* generate data */
+	if (compact) {
+		up_history_array_encode (series, from, buffer);
+	} else {
+		UpHistoryRecord *records;
+		guint offset = buffer->len;
+
+		g_byte_array_set_size (buffer, offset + (series->len - from) * sizeof (UpHistoryRecord));
+		records = (UpHistoryRecord *) (buffer->data + offset);
+		for (i = from; i < series->len; i++)
+			up_history_series_to_record (series, i, &records[i - from]);
+	}
+	return g_byte_array_free_to_bytes (buffer);
+}
+
+/**
+ * up_history_array_to_job:
+ * @series: the data to save
+ * @key: where to save it
+ * @compact: whether to use the compact encoding
+ *
+ * Queues the points of the series that are not yet on disk, so a save
+ * is proportional to the new data only.
+ **/
+static void
+up_history_array_to_job (UpHistorySeries *series, const gchar *key,
+			 gboolean compact, UpHistoryWriterJob *job)
+{
+	g_autoptr(GBytes) data = NULL;
+
+	/* nothing new */
+	if (series->saved >= series->len)
+		return;
+
+	/* first save for this device */
+	if (series->saved == 0) {
+		data = up_history_array_to_bytes (series, 0, TRUE, compact);
+		up_history_writer_job_replace (job, key, data);
+	} else {
+		/* with the compact encoding, each save adds a block */
+		data = up_history_array_to_bytes (series, series->saved, FALSE, compact);
+		up_history_writer_job_append (job, key, data);
+	}
+	series->saved = series->len;
+}
+
+/**
+ * up_history_array_cull:
+ * @series: the data to cull
+ *
+ * Removes the points older than the maximum data age
+ *
+ * Return value: the number of points removed
+ **/
+static guint
+up_history_array_cull (UpHistory *history, UpHistorySeries *series)
+{
+	guint i;
+	guint len = 0;
+	guint cull_count;
+	gint64 time_now;
+
+	/* get current time */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+
+	/* only keep entries for the maximum data age, and at most the
+	 * newest UP_HISTORY_MAX_POINTS of them */
+	for (i = 0; i < series->len; i++) {
+		if (time_now - series->time[i] > history->priv->max_data_age)
+			continue;
+		if (series->len - i > UP_HISTORY_MAX_POINTS)
+			continue;
+		series->time[len] = series->time[i];
+		series->value[len] = series->value[i];
+		series->state[len] = series->state[i];
+		len++;
+	}
+	cull_count = series->len - len;
+
+	/* how many did we kill? */
+	g_debug ("culled %i of %i", cull_count, series->len);
+	series->len = len;
+	return cull_count;
+}
+
+/**
+ * up_history_array_has_old:
+ *
+ * Points are added in time order, so only the oldest needs checking.
+ **/
+static gboolean
+up_history_array_has_old (UpHistory *history, const UpHistorySeries *series)
+{
+	if (series->len == 0)
+		return FALSE;
+	if (series->len > UP_HISTORY_MAX_POINTS)
+		return TRUE;
+	return (g_get_real_time () / G_USEC_PER_SEC) - series->time[0] > history->priv->max_data_age;
+}
+
+/* powers of ten that are exact as doubles */
+static const gdouble up_history_powers[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/**
+ * up_history_parse_legacy_line:
+ * @line: the start of the line
+ * @end: the newline ending it
+ *
+ * Parses a "time\tvalue\tstate" line in place. The plain decimals that
+ * were written are converted directly: with at most 15 digits the
+ * mantissa and the power of ten are exact, so the single division
+ * rounds exactly like strtod(). Anything unusual goes through
+ * atoi()/atof() as before, which stop at the tab.
+ **/
+gboolean
+up_history_parse_legacy_line (const gchar *line, const gchar *end,
+			      guint32 *time, gdouble *value, UpDeviceState *state)
+{
+	const gchar *field;
+	const gchar *tab1;
+	const gchar *tab2;
+	const gchar *p;
+	guint64 mantissa = 0;
+	guint digits = 0;
+	guint decimals = 0;
+
+	/* split by tab */
+	tab1 = memchr (line, '\t', end - line);
+	tab2 = tab1 != NULL ? memchr (tab1 + 1, '\t', end - tab1 - 1) : NULL;
+	if (tab2 == NULL || memchr (tab2 + 1, '\t', end - tab2 - 1) != NULL) {
+		g_warning ("invalid string: '%.*s'", (gint) (end - line), line);
+		return FALSE;
+	}
+
+	/* time */
+	for (p = line; p < tab1 && g_ascii_isdigit (*p); p++)
+		mantissa = mantissa * 10 + (*p - '0');
+	*time = (p == tab1 && tab1 - line <= 10) ? mantissa : (guint32) atoi (line);
+
+	/* value */
+	field = tab1 + 1;
+	p = field;
+	mantissa = 0;
+	if (p < tab2 && *p == '-')
+		p++;
+	for (; p < tab2 && g_ascii_isdigit (*p); p++, digits++)
+		mantissa = mantissa * 10 + (*p - '0');
+	if (p < tab2 && *p == '.') {
+		for (p++; p < tab2 && g_ascii_isdigit (*p); p++, digits++, decimals++)
+			mantissa = mantissa * 10 + (*p - '0');
+	}
+	if (p == tab2 && digits > 0 && digits < G_N_ELEMENTS (up_history_powers)) {
+		*value = (gdouble) mantissa / up_history_powers[decimals];
+		if (*field == '-')
+			*value = -*value;
+	} else {
+		*value = atof (field);
+	}
+
+	/* state */
+	*state = up_device_state_from_string_len (tab2 + 1, end - tab2 - 1);
+	return TRUE;
+}
+
+/**
+ * up_history_array_from_legacy_file:
+ * @series: the series to append to
+ * @filename: a filename
+ *
+ * Appends the data from a file in the old text format, walking the
+ * contents once without splitting them into separate strings.
+ **/
+static gboolean
+up_history_array_from_legacy_file (UpHistorySeries *series, const gchar *filename)
+{
+	gboolean ret;
+	GError *error = NULL;
+	gchar *data = NULL;
+	const gchar *line;
+	const gchar *end;
+	const gchar *eol;
+	gsize length;
+	guint count = 0;
+
+	/* get contents */
+	ret = g_file_get_contents (filename, &data, &length, &error);
+	if (!ret) {
+		g_warning ("failed to get data: %s", error->message);
+		g_error_free (error);
+		goto out;
+	}
+
+	/* add valid entries; only complete lines, as before */
+	end = data + length;
+	for (line = data; (eol = memchr (line, '\n', end - line)) != NULL; line = eol + 1) {
+		UpDeviceState state;
+		gdouble value;
+		guint32 time;
+
+		if (up_history_parse_legacy_line (line, eol, &time, &value, &state)) {
+			up_history_series_append (series, time, value, state);
+			count++;
+		}
+	}
+	g_debug ("migrated %u items of data from %s", count, filename);
+out:
+	g_free (data);
+	return ret;
+}
+
+/**
+ * up_history_array_from_bytes:
+ * @series: the series to append to
+ * @key: where the data was saved, for messages
+ * @bytes: the saved data
+ * @compact: set to whether the data uses the compact encoding
+ *
+ * Appends the saved data of a series.
+ *
+ * Return value: %FALSE if the data cannot be used or was cut short
+ **/
+static gboolean
+up_history_array_from_bytes (UpHistorySeries *series, const gchar *key, GBytes *bytes, gboolean *compact)
+{
+	const UpHistoryFileHeader *header;
+	const UpHistoryRecord *record;
+	const gchar *data;
+	gsize length;
+	gsize count;
+	gsize i;
+	gboolean ret;
+
+	data = g_bytes_get_data (bytes, &length);
+
+	/* check the header is something we can use */
+	if (length < sizeof (UpHistoryFileHeader)) {
+		g_warning ("history data %s is truncated", key);
+		return FALSE;
+	}
+	header = (const UpHistoryFileHeader *) data;
+	*compact = header->version == UP_HISTORY_FILE_VERSION_COMPACT;
+	if (memcmp (header->magic, UP_HISTORY_FILE_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->byte_order != UP_HISTORY_FILE_BYTE_ORDER ||
+	    (!*compact && (header->version != UP_HISTORY_FILE_VERSION ||
+			   header->record_size != sizeof (UpHistoryRecord)))) {
+		g_warning ("history data %s has an unsupported format", key);
+		return FALSE;
+	}
+
+	/* a block cut short is dropped, which needs a rewrite before appending */
+	if (*compact) {
+		g_debug ("loading compact data from %s", key);
+		ret = up_history_array_decode (series, (const guint8 *) data + sizeof (UpHistoryFileHeader),
+					       length - sizeof (UpHistoryFileHeader));
+		if (!ret)
+			g_warning ("history data %s is truncated", key);
+		return ret;
+	}
+
+	/* so is a partially written trailing record, from a file written
+	 * by a previous version */
+	count = (length - sizeof (UpHistoryFileHeader)) / sizeof (UpHistoryRecord);
+	g_debug ("loading %" G_GSIZE_FORMAT " items of data from %s", count, key);
+	record = (const UpHistoryRecord *) (data + sizeof (UpHistoryFileHeader));
+	up_history_series_reserve (series, series->len + count);
+	for (i = 0; i < count; i++) {
+		series->time[series->len] = record[i].time;
+		series->value[series->len] = record[i].value;
+		series->state[series->len] = record[i].state;
+		series->len++;
+	}
+	if ((length - sizeof (UpHistoryFileHeader)) % sizeof (UpHistoryRecord) != 0) {
+		g_warning ("history data %s is truncated", key);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * up_history_profile_to_bytes:
+ **/
+static GBytes *
+up_history_profile_to_bytes (UpHistory *history)
+{
+	UpHistoryFileHeader *header;
+	gchar *data;
+	gsize length;
+
+	length = sizeof (UpHistoryFileHeader) + sizeof (UpHistoryProfile);
+	data = g_malloc0 (length);
+	header = (UpHistoryFileHeader *) data;
+	memcpy (header->magic, UP_HISTORY_PROFILE_MAGIC, sizeof (header->magic));
+	header->byte_order = UP_HISTORY_FILE_BYTE_ORDER;
+	header->version = UP_HISTORY_FILE_VERSION;
+	header->record_size = sizeof (UpHistoryProfile);
+	memcpy (data + sizeof (UpHistoryFileHeader), &history->priv->profile, sizeof (UpHistoryProfile));
+	return g_bytes_new_take (data, length);
+}
+
+/**
+ * up_history_profile_to_job:
+ **/
+static void
+up_history_profile_to_job (UpHistory *history, UpHistoryWriterJob *job)
+{
+	g_autofree gchar *key = NULL;
+	g_autoptr(GBytes) data = NULL;
+
+	key = up_history_get_key (history, "profile");
+	data = up_history_profile_to_bytes (history);
+	up_history_writer_job_replace (job, key, data);
+	history->priv->profile_dirty = FALSE;
+}
+
+/**
+ * up_history_profile_from_store:
+ *
+ * Restores the saved statistics if they match the loaded charge data.
+ **/
+static void
+up_history_profile_from_store (UpHistoryLoad *load)
+{
+	const UpHistorySeries *series = &load->series[UP_HISTORY_TYPE_CHARGE];
+	const UpHistoryFileHeader *header;
+	const UpHistoryProfile *profile;
+	g_autofree gchar *key = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	const gchar *data;
+	gsize length;
+
+	key = up_history_build_key (load->id, "profile");
+	bytes = up_history_store_lookup (load->store, key);
+	if (bytes == NULL)
+		return;
+	data = g_bytes_get_data (bytes, &length);
+	if (length != sizeof (UpHistoryFileHeader) + sizeof (UpHistoryProfile))
+		return;
+	header = (const UpHistoryFileHeader *) data;
+	if (memcmp (header->magic, UP_HISTORY_PROFILE_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->byte_order != UP_HISTORY_FILE_BYTE_ORDER ||
+	    header->version != UP_HISTORY_FILE_VERSION ||
+	    header->record_size != sizeof (UpHistoryProfile))
+		return;
+
+	/* the charge data was culled or lost since */
+	profile = (const UpHistoryProfile *) (data + sizeof (UpHistoryFileHeader));
+	if (profile->covered > series->len)
+		return;
+	if (profile->covered > 0 &&
+	    (series->time[profile->covered-1] != profile->last_time ||
+	     series->value[profile->covered-1] != profile->last_value))
+		return;
+
+	g_debug ("statistics cover %i of %i charge points", profile->covered, series->len);
+	memcpy (&load->profile, profile, sizeof (UpHistoryProfile));
+	load->has_profile = TRUE;
+}
+
+/**
+ * up_history_tiers_to_job:
+ *
+ * Saves every tier of every series, oldest bucket first, together.
+ **/
+static void
+up_history_tiers_to_job (UpHistory *history, UpHistoryWriterJob *job)
+{
+	g_autofree gchar *key = NULL;
+	g_autoptr(GBytes) data = NULL;
+	UpHistoryFileHeader header;
+	GByteArray *buffer;
+	guint i, j, k;
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, UP_HISTORY_TIERS_MAGIC, sizeof (header.magic));
+	header.byte_order = UP_HISTORY_FILE_BYTE_ORDER;
+	header.version = UP_HISTORY_FILE_VERSION;
+	header.record_size = sizeof (UpHistoryTierRecord);
+
+	buffer = g_byte_array_new ();
+	g_byte_array_append (buffer, (const guint8 *) &header, sizeof (header));
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++) {
+			const UpHistoryTier *tier = &history->priv->tiers[i][j];
+
+			g_byte_array_append (buffer, (const guint8 *) &tier->header, sizeof (UpHistoryTierHeader));
+			for (k = 0; k < tier->header.len; k++)
+				g_byte_array_append (buffer, (const guint8 *) up_history_tier_get (tier, k),
+						     sizeof (UpHistoryTierRecord));
+		}
+	}
+
+	key = up_history_get_key (history, "tiers");
+	data = g_byte_array_free_to_bytes (buffer);
+	up_history_writer_job_replace (job, key, data);
+	history->priv->tiers_dirty = FALSE;
+}
+
+/**
+ * up_history_tiers_from_store:
+ *
+ * Restores the tiers; any that do not match the current sizes are
+ * left empty and rebuilt from the raw points.
+ **/
+static void
+up_history_tiers_from_store (UpHistoryLoad *load)
+{
+	g_autofree gchar *key = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	const UpHistoryFileHeader *header;
+	const gchar *data;
+	gsize length;
+	gsize offset;
+	guint i, j;
+
+	key = up_history_build_key (load->id, "tiers");
+	bytes = up_history_store_lookup (load->store, key);
+	if (bytes == NULL)
+		return;
+	data = g_bytes_get_data (bytes, &length);
+
+	if (length < sizeof (UpHistoryFileHeader))
+		return;
+	header = (const UpHistoryFileHeader *) data;
+	if (memcmp (header->magic, UP_HISTORY_TIERS_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->byte_order != UP_HISTORY_FILE_BYTE_ORDER ||
+	    header->version != UP_HISTORY_FILE_VERSION ||
+	    header->record_size != sizeof (UpHistoryTierRecord)) {
+		g_warning ("history data %s has an unsupported format", key);
+		return;
+	}
+
+	offset = sizeof (UpHistoryFileHeader);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++) {
+			UpHistoryTier *tier = &load->tiers[i][j];
+			UpHistoryTierHeader tier_header;
+			gsize size;
+
+			if (length - offset < sizeof (UpHistoryTierHeader))
+				return;
+			memcpy (&tier_header, data + offset, sizeof (UpHistoryTierHeader));
+			offset += sizeof (UpHistoryTierHeader);
+			size = (gsize) tier_header.len * sizeof (UpHistoryTierRecord);
+			if (tier_header.len > tier_header.capacity || length - offset < size)
+				return;
+			if (tier_header.width == tier->header.width &&
+			    tier_header.capacity == tier->header.capacity) {
+				g_free (tier->buckets);
+				tier->allocated = tier_header.len;
+				tier->buckets = g_new (UpHistoryTierRecord, tier_header.len);
+				memcpy (tier->buckets, data + offset, size);
+				tier->start = 0;
+				tier->header = tier_header;
+			}
+			offset += size;
+		}
+	}
+	g_debug ("loaded tiers from %s", key);
+}
+
+/**
+ * up_history_load_array:
+ *
+ * Loads one series, falling back to the old text file if nothing has
+ * been saved in the store yet.
+ **/
+static void
+up_history_load_array (UpHistoryLoad *load, UpHistoryType type)
+{
+	UpHistorySeries *series = &load->series[type];
+	g_autofree gchar *key = NULL;
+	g_autofree gchar *filename_legacy = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+	gboolean compact = FALSE;
+	guint i;
+
+	key = up_history_build_key (load->id, up_history_type_to_string (type));
+	filename_legacy = up_history_build_filename (up_history_store_get_dir (load->store), load->id,
+						     up_history_type_to_string (type), "dat");
+	bytes = up_history_store_lookup (load->store, key);
+	if (bytes != NULL) {
+		/* never append to data we could not read */
+		if (!up_history_array_from_bytes (series, key, bytes, &compact))
+			load->needs_rewrite = TRUE;
+		else if (compact != load->compact_encoding)
+			load->needs_rewrite = TRUE;
+		else
+			series->saved = series->len;
+	} else if (g_file_test (filename_legacy, G_FILE_TEST_EXISTS)) {
+		up_history_array_from_legacy_file (series, filename_legacy);
+		load->has_legacy_files = TRUE;
+	} else {
+		g_debug ("no data saved for %s", key);
+		return;
+	}
+
+	/* converted, so they are the same once saved again */
+	if (load->compact_encoding && !compact) {
+		for (i = 0; i < series->len; i++)
+			series->value[i] = up_history_quantize_value (series->value[i]);
+	}
+}
+
+/**
+ * up_history_load_new:
+ **/
+static UpHistoryLoad *
+up_history_load_new (UpHistory *history)
+{
+	UpHistoryLoad *load;
+	guint i, j;
+
+	load = g_new0 (UpHistoryLoad, 1);
+	load->id = g_strdup (history->priv->id);
+	load->store = g_object_ref (history->priv->store);
+	load->writer = g_object_ref (history->priv->writer);
+	load->compact_encoding = history->priv->compact_encoding;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++)
+			up_history_tier_reset (&load->tiers[i][j], j);
+	}
+	return load;
+}
+
+/**
+ * up_history_load_free:
+ **/
+static void
+up_history_load_free (UpHistoryLoad *load)
+{
+	guint i, j;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		up_history_series_clear (&load->series[i]);
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++)
+			g_free (load->tiers[i][j].buckets);
+	}
+	g_free (load->id);
+	g_object_unref (load->store);
+	g_object_unref (load->writer);
+	g_free (load);
 }
 
 /**
- * up_history_get_filename:
+ * up_history_load_files:
+ *
+ * Reads everything saved for the device. This may run in a thread.
  **/
-static gchar *
-up_history_get_filename (UpHistory *history, const gchar *type)
+static void
+up_history_load_files (UpHistoryLoad *load)
 {
-	gchar *path;
-	gchar *filename;
+	guint i;
 
-	filename = g_strdup_printf ("history-%s-%s.dat", type, history->priv->id);
-	path = g_build_filename (history->priv->dir, filename, NULL);
-	g_free (filename);
-	return path;
+	/* the data may still be being written */
+	up_history_writer_wait (load->writer);
+
+	up_history_tiers_from_store (load);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++)
+		up_history_load_array (load, i);
+	up_history_profile_from_store (load);
 }
 
 /**
- * up_history_set_directory:
+ * up_history_load_merge:
+ *
+ * Puts the data read from disk in place, before any points that were
+ * recorded while it was being read.
  **/
-void
-up_history_set_directory (UpHistory *history, const gchar *dir)
+static void
+up_history_load_merge (UpHistory *history, UpHistoryLoad *load)
 {
-	g_free (history->priv->dir);
-	history->priv->dir = g_strdup (dir);
-	g_mkdir_with_parents (dir, 0755);
+	guint i, j;
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		UpHistorySeries *series = &history->priv->series[i];
+		UpHistorySeries *loaded = &load->series[i];
+
+		up_history_series_reserve (loaded, loaded->len + series->len);
+		memcpy (loaded->time + loaded->len, series->time, series->len * sizeof (guint32));
+		memcpy (loaded->value + loaded->len, series->value, series->len * sizeof (gdouble));
+		memcpy (loaded->state + loaded->len, series->state, series->len * sizeof (guint8));
+		loaded->len += series->len;
+		up_history_series_clear (series);
+		*series = *loaded;
+		memset (loaded, 0, sizeof (UpHistorySeries));
+		history->priv->doors[i].pending = FALSE;
+		history->priv->generation[i]++;
+		history->priv->epoch[i]++;
+
+		/* the tiers and statistics pick up the new points from here */
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++) {
+			g_free (history->priv->tiers[i][j].buckets);
+			history->priv->tiers[i][j] = load->tiers[i][j];
+			load->tiers[i][j].buckets = NULL;
+		}
+		up_history_tiers_replay (history, i);
+	}
+	if (load->has_profile)
+		history->priv->profile = load->profile;
+	else
+		up_history_profile_reset (&history->priv->profile);
+	up_history_profile_replay (history);
+
+	history->priv->has_legacy_files = load->has_legacy_files;
+	history->priv->needs_rewrite = load->needs_rewrite;
+	history->priv->last_compact = g_get_monotonic_time ();
+	history->priv->loading = FALSE;
 }
 
 /**
- * up_history_array_to_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
+ * up_history_remove_legacy_files:
  *
- * Saves a copy of the list to a file
+ * Called once the migrated data has been queued in the binary format.
  **/
-static gboolean
-up_history_array_to_file (UpHistory *history, GPtrArray *list, const gchar *filename)
+static void
+up_history_remove_legacy_files (UpHistory *history, UpHistoryWriterJob *job)
 {
+	const gchar *types[] = { "rate", "charge", "time-full", "time-empty" };
 	guint i;
-	UpHistoryItem *item;
-	gchar *part;
-	GString *string;
-	gboolean ret = TRUE;
-	GError *error = NULL;
-	gint64 time_now;
-	guint time_item;
-	guint cull_count = 0;
-
-	/* get current time */
-	time_now = g_get_real_time ();
 
-	/* generate data */
-	string = g_string_new ("");
-	for (i=0; i<list->len; i++) {
-		item = g_ptr_array_index (list, i);
-
-		/* only save entries for the last 24 hours */
-		time_item = up_history_item_get_time (item);
-		if ((time_now / 1000000) - time_item > history->priv->max_data_age) {
-			cull_count++;
-			continue;
-		}
-		part = up_history_item_to_string (item);
-		if (part == NULL) {
-			ret = FALSE;
-			break;
-		}
-		g_string_append_printf (string, "%s\n", part);
-		g_free (part);
+	for (i = 0; i < G_N_ELEMENTS (types); i++) {
+		g_autofree gchar *filename = up_history_get_legacy_filename (history, types[i]);
+		up_history_writer_job_unlink (job, filename);
 	}
-	part = g_string_free (string, FALSE);
+	history->priv->has_legacy_files = FALSE;
+}
 
-	/* how many did we kill? */
-	g_debug ("culled %i of %i", cull_count, list->len);
+/**
+ * up_history_compact:
+ *
+ * Culls the points older than the maximum data age and replaces the
+ * saved series. This is the only place raw points are dropped,
+ * as normal saves only ever append; the tiers are written first so
+ * they still cover them.
+ **/
+static void
+up_history_compact (UpHistory *history, UpHistoryWriterJob *job)
+{
+	guint culled;
+	guint i;
 
-	/* we failed to convert to string */
-	if (!ret) {
-		g_warning ("failed to convert");
-		goto out;
-	}
+	/* the tiers keep a summary of what is about to be culled */
+	up_history_tiers_to_job (history, job);
+
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		UpHistorySeries *series = &history->priv->series[i];
+		g_autofree gchar *key = NULL;
+		g_autoptr(GBytes) data = NULL;
+
+		/* only keep the data we want */
+		culled = up_history_array_cull (history, series);
+		if (culled > 0) {
+			history->priv->tiers_covered[i] -= MIN (history->priv->tiers_covered[i], culled);
+			history->priv->generation[i]++;
+			history->priv->epoch[i]++;
+			if (i == UP_HISTORY_TYPE_CHARGE)
+				up_history_profile_rebuild (history);
+		}
 
-	/* save to disk */
-	ret = g_file_set_contents (filename, part, -1, &error);
-	if (!ret) {
-		g_warning ("failed to set data: %s", error->message);
-		g_error_free (error);
-		goto out;
+		key = up_history_get_key (history, up_history_type_to_string (i));
+		data = up_history_array_to_bytes (series, 0, TRUE, history->priv->compact_encoding);
+		up_history_writer_job_replace (job, key, data);
+		series->saved = series->len;
 	}
-	g_debug ("saved %s", filename);
+	if (history->priv->profile_dirty)
+		up_history_profile_to_job (history, job);
 
-out:
-	g_free (part);
-	return ret;
+	history->priv->needs_rewrite = FALSE;
+	history->priv->last_compact = g_get_monotonic_time ();
+
+	/* everything is in the new format now */
+	if (history->priv->has_legacy_files)
+		up_history_remove_legacy_files (history, job);
 }
 
 /**
- * up_history_array_from_file:
- * @list: a valid #GPtrArray instance
- * @filename: a filename
- *
- * Appends the list from a file
+ * up_history_has_old_data:
  **/
 static gboolean
-up_history_array_from_file (GPtrArray *list, const gchar *filename)
+up_history_has_old_data (UpHistory *history)
 {
-	gboolean ret;
-	GError *error = NULL;
-	gchar *data = NULL;
-	gchar **parts = NULL;
 	guint i;
-	guint length;
-	UpHistoryItem *item;
 
-	/* do we exist */
-	ret = g_file_test (filename, G_FILE_TEST_EXISTS);
-	if (!ret) {
-		g_debug ("failed to get data from %s as file does not exist", filename);
-		goto out;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		if (up_history_array_has_old (history, &history->priv->series[i]))
+			return TRUE;
 	}
+	return FALSE;
+}
 
-	/* get contents */
-	ret = g_file_get_contents (filename, &data, NULL, &error);
-	if (!ret) {
-		g_warning ("failed to get data: %s", error->message);
-		g_error_free (error);
-		goto out;
-	}
+/**
+ * up_history_write_failed:
+ *
+ * What is on disk is unknown, so everything is written again.
+ **/
+static void
+up_history_write_failed (GObject *owner)
+{
+	UpHistory *history = UP_HISTORY (owner);
 
-	/* split by line ending */
-	parts = g_strsplit (data, "\n", 0);
-	length = g_strv_length (parts);
-	if (length == 0) {
-		g_debug ("no data in %s", filename);
-		goto out;
+	g_debug ("writing %s failed, rewriting it", history->priv->id);
+	history->priv->needs_rewrite = TRUE;
+	history->priv->tiers_dirty = TRUE;
+	history->priv->profile_dirty = TRUE;
+	up_history_schedule_save (history);
+}
+
+/**
+ * up_history_prepare_job:
+ * @final: the object is going away, so compact regardless of when that
+ * was last done
+ *
+ * Takes a copy of what needs writing, the writes themselves are done
+ * by the #UpHistoryWriter.
+ **/
+static UpHistoryWriterJob *
+up_history_prepare_job (UpHistory *history, gboolean final)
+{
+	UpHistoryWriterJob *job;
+	gint64 now;
+	guint i;
+
+	job = up_history_writer_job_new (G_OBJECT (history), history->priv->store,
+					 up_history_write_failed);
+
+	/* saved once the previous data is in place */
+	if (history->priv->loading)
+		return job;
+
+	/* rewrite the series if they cannot be appended to, or every so
+	 * often to drop the points that have expired */
+	now = g_get_monotonic_time ();
+	if (history->priv->needs_rewrite || history->priv->has_legacy_files ||
+	    ((final || now - history->priv->last_compact >= (gint64) UP_HISTORY_COMPACT_INTERVAL * G_USEC_PER_SEC) &&
+	     up_history_has_old_data (history))) {
+		up_history_compact (history, job);
+		return job;
 	}
 
-	/* add valid entries */
-	g_debug ("loading %i items of data from %s", length, filename);
-	for (i=0; i<length-1; i++) {
-		item = up_history_item_new ();
-		ret = up_history_item_set_from_string (item, parts[i]);
-		if (ret)
-			g_ptr_array_add (list, item);
-		else
-			g_object_unref (item);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		g_autofree gchar *key = NULL;
+
+		key = up_history_get_key (history, up_history_type_to_string (i));
+		up_history_array_to_job (&history->priv->series[i], key,
+					 history->priv->compact_encoding, job);
 	}
+	if (history->priv->profile_dirty)
+		up_history_profile_to_job (history, job);
+	/* the tiers can be rebuilt from the raw points after a crash */
+	if (final && history->priv->tiers_dirty)
+		up_history_tiers_to_job (history, job);
+	return job;
+}
 
-out:
-	g_strfreev (parts);
-	g_free (data);
-	return ret;
+/**
+ * up_history_prepare_job_cb:
+ **/
+static UpHistoryWriterJob *
+up_history_prepare_job_cb (GObject *owner)
+{
+	return up_history_prepare_job (UP_HISTORY (owner), FALSE);
 }
 
 /**
  * up_history_save_data:
+ *
+ * Writes the new data now, rather than with the other devices.
  **/
 gboolean
 up_history_save_data (UpHistory *history)
 {
-	gboolean ret = FALSE;
-	gchar *filename_rate = NULL;
-	gchar *filename_charge = NULL;
-	gchar *filename_time_full = NULL;
-	gchar *filename_time_empty = NULL;
+	gboolean ret;
 
 	/* we have an ID? */
 	if (history->priv->id == NULL) {
 		g_warning ("no ID, cannot save");
-		goto out;
+		return FALSE;
 	}
 
-	/* get filenames */
-	filename_rate = up_history_get_filename (history, "rate");
-	filename_charge = up_history_get_filename (history, "charge");
-	filename_time_full = up_history_get_filename (history, "time-full");
-	filename_time_empty = up_history_get_filename (history, "time-empty");
-
-	/* save to disk */
-	ret = up_history_array_to_file (history, history->priv->data_rate, filename_rate);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_charge, filename_charge);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_full, filename_time_full);
-	if (!ret)
-		goto out;
-	ret = up_history_array_to_file (history, history->priv->data_time_empty, filename_time_empty);
+	ret = up_history_writer_run (history->priv->writer,
+				     up_history_prepare_job (history, FALSE));
 	if (!ret)
-		goto out;
-out:
-	g_free (filename_rate);
-	g_free (filename_charge);
-	g_free (filename_time_full);
-	g_free (filename_time_empty);
+		up_history_write_failed (G_OBJECT (history));
 	return ret;
 }
 
-/**
- * up_history_schedule_save_cb:
- **/
-static gboolean
-up_history_schedule_save_cb (UpHistory *history)
-{
-	up_history_save_data (history);
-	g_clear_pointer (&history->priv->save_source, g_source_destroy);
-	return FALSE;
-}
-
 /**
  * up_history_is_low_power:
  **/
 static gboolean
 up_history_is_low_power (UpHistory *history)
 {
-	guint length;
-	UpHistoryItem *item;
+	const UpHistorySeries *series = &history->priv->series[UP_HISTORY_TYPE_CHARGE];
 
 	/* current status is always up to date */
 	if (history->priv->state != UP_DEVICE_STATE_DISCHARGING)
 		return FALSE;
 
 	/* have we got any data? */
-	length = history->priv->data_charge->len;
-	if (length == 0)
+	if (series->len == 0)
 		return FALSE;
 
 	/* get the last saved charge object */
-	item = (UpHistoryItem *) g_ptr_array_index (history->priv->data_charge, length-1);
-	if (up_history_item_get_state (item) != UP_DEVICE_STATE_DISCHARGING)
+	if (series->state[series->len-1] != UP_DEVICE_STATE_DISCHARGING)
 		return FALSE;
 
 	/* high enough */
-	if (up_history_item_get_value (item) > UP_HISTORY_LOW_POWER_PERCENT)
+	if (series->value[series->len-1] > UP_HISTORY_LOW_POWER_PERCENT)
 		return FALSE;
 
 	/* we are low power */
@@ -627,6 +2871,9 @@ up_history_is_low_power (UpHistory *history)
 
 /**
  * up_history_schedule_save:
+ *
+ * The data of all devices is written together, as soon as one of
+ * them needs it.
  **/
 static gboolean
 up_history_schedule_save (UpHistory *history)
@@ -641,91 +2888,146 @@ up_history_schedule_save (UpHistory *history)
 		timeout = UP_HISTORY_SAVE_INTERVAL_LOW_POWER;
 	}
 
-	/* we already have one saved, clear it if it will fire earlier */
-	if (history->priv->save_source) {
-		guint64 ready = g_source_get_ready_time (history->priv->save_source);
-
-		if (ready > g_source_get_time (history->priv->save_source) + timeout * G_USEC_PER_SEC) {
-			g_clear_pointer (&history->priv->save_source, g_source_destroy);
-		} else {
-			g_debug ("deferring as earlier timeout is already queued");
-			return TRUE;
-		}
+	/* we already have one saved, it is kept if it will fire earlier */
+	if (!up_history_writer_schedule (history->priv->writer, G_OBJECT (history),
+					 up_history_prepare_job_cb, timeout)) {
+		g_debug ("deferring as earlier timeout is already queued");
+		return TRUE;
 	}
 
-	/* nothing scheduled */
+	/* nothing earlier scheduled */
 	g_debug ("saving in %i seconds", timeout);
-	history->priv->save_source = g_timeout_source_new_seconds (timeout);
-	g_source_set_name (history->priv->save_source, "[upower] up_history_schedule_save_cb");
-	g_source_attach (history->priv->save_source, NULL);
-	g_source_set_callback (history->priv->save_source,
-			       (GSourceFunc) up_history_schedule_save_cb, history,
-			       NULL);
 	return TRUE;
 }
 
 /**
- * up_history_load_data:
+ * up_history_start:
  **/
 static gboolean
-up_history_load_data (UpHistory *history)
+up_history_start (UpHistory *history, const gchar *id)
 {
-	gchar *filename;
-	UpHistoryItem *item;
-
-	/* load rate history from disk */
-	filename = up_history_get_filename (history, "rate");
-	up_history_array_from_file (history->priv->data_rate, filename);
-	g_free (filename);
-
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "charge");
-	up_history_array_from_file (history->priv->data_charge, filename);
-	g_free (filename);
-
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-full");
-	up_history_array_from_file (history->priv->data_time_full, filename);
-	g_free (filename);
+	guint32 time_now;
+	guint i;
 
-	/* load charge history from disk */
-	filename = up_history_get_filename (history, "time-empty");
-	up_history_array_from_file (history->priv->data_time_empty, filename);
-	g_free (filename);
+	if (history->priv->id != NULL)
+		return FALSE;
+	if (id == NULL)
+		return FALSE;
 
-	/* save a marker so we don't use incomplete percentages */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	g_ptr_array_add (history->priv->data_rate, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_charge, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_full, g_object_ref (item));
-	g_ptr_array_add (history->priv->data_time_empty, g_object_ref (item));
-	g_object_unref (item);
-	up_history_schedule_save (history);
+	g_debug ("using id: %s", id);
+	history->priv->id = g_strdup (id);
 
+	/* save a marker so we don't use incomplete percentages; the
+	 * previous data goes before it once loaded */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		up_history_append (history, i, time_now, 0.0f, UP_DEVICE_STATE_UNKNOWN);
+		up_history_summarize (history, i);
+	}
+	history->priv->loading = TRUE;
 	return TRUE;
 }
 
 /**
  * up_history_set_id:
+ *
+ * Sets the device ID and loads its previous data before returning.
  **/
 gboolean
 up_history_set_id (UpHistory *history, const gchar *id)
 {
-	gboolean ret;
+	UpHistoryLoad *load;
 
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
-	if (history->priv->id != NULL)
-		return FALSE;
-	if (id == NULL)
+	if (!up_history_start (history, id))
 		return FALSE;
 
-	g_debug ("using id: %s", id);
-	history->priv->id = g_strdup (id);
 	/* load all previous data */
-	ret = up_history_load_data (history);
-	return ret;
+	load = up_history_load_new (history);
+	up_history_load_files (load);
+	up_history_load_merge (history, load);
+	up_history_load_free (load);
+	up_history_schedule_save (history);
+	return TRUE;
+}
+
+/**
+ * up_history_load_thread:
+ **/
+static void
+up_history_load_thread (GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+	up_history_load_files (task_data);
+	g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * up_history_load_thread_cb:
+ **/
+static void
+up_history_load_thread_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+	UpHistory *history = UP_HISTORY (source_object);
+	g_autoptr(GTask) task = G_TASK (user_data);
+
+	up_history_load_merge (history, g_task_get_task_data (G_TASK (res)));
+	up_history_schedule_save (history);
+	if (!g_task_return_error_if_cancelled (task))
+		g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * up_history_load_async:
+ *
+ * Sets the device ID and loads its previous data in a thread. New data
+ * can be added in the meantime, but it is only saved once loaded.
+ **/
+void
+up_history_load_async (UpHistory		*history,
+		       const gchar		*id,
+		       GCancellable		*cancellable,
+		       GAsyncReadyCallback	 callback,
+		       gpointer			 user_data)
+{
+	g_autoptr(GTask) task = NULL;
+	g_autoptr(GTask) thread_task = NULL;
+
+	g_return_if_fail (UP_IS_HISTORY (history));
+
+	task = g_task_new (history, cancellable, callback, user_data);
+	g_task_set_source_tag (task, up_history_load_async);
+
+	if (!up_history_start (history, id)) {
+		g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+					 "cannot load history for %s", id);
+		return;
+	}
+
+	thread_task = g_task_new (history, NULL, up_history_load_thread_cb, g_object_ref (task));
+	g_task_set_task_data (thread_task, up_history_load_new (history),
+			      (GDestroyNotify) up_history_load_free);
+	g_task_run_in_thread (thread_task, up_history_load_thread);
+}
+
+/**
+ * up_history_load_finish:
+ **/
+gboolean
+up_history_load_finish (UpHistory *history, GAsyncResult *res, GError **error)
+{
+	g_return_val_if_fail (g_task_is_valid (res, history), FALSE);
+	return g_task_propagate_boolean (G_TASK (res), error);
+}
+
+/**
+ * up_history_is_loading:
+ **/
+gboolean
+up_history_is_loading (UpHistory *history)
+{
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+	return history->priv->loading;
 }
 
 /**
@@ -742,14 +3044,28 @@ up_history_set_state (UpHistory *history, UpDeviceState state)
 	return TRUE;
 }
 
+/**
+ * up_history_add_point:
+ **/
+static void
+up_history_add_point (UpHistory *history, UpHistoryType type, gdouble value)
+{
+	guint32 time_s = g_get_real_time () / G_USEC_PER_SEC;
+
+	if (!up_history_door_replace (history, type, time_s, value, history->priv->state)) {
+		up_history_append (history, type, time_s, value, history->priv->state);
+		up_history_door_open (history, type);
+	}
+	up_history_summarize (history, type);
+	up_history_schedule_save (history);
+}
+
 /**
  * up_history_set_charge_data:
  **/
 gboolean
 up_history_set_charge_data (UpHistory *history, gdouble percentage)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -760,12 +3076,7 @@ up_history_set_charge_data (UpHistory *history, gdouble percentage)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, percentage);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_charge, item);
-	up_history_schedule_save (history);
+	up_history_add_point (history, UP_HISTORY_TYPE_CHARGE, percentage);
 
 	/* save last value */
 	history->priv->percentage_last = percentage;
@@ -779,8 +3090,6 @@ up_history_set_charge_data (UpHistory *history, gdouble percentage)
 gboolean
 up_history_set_rate_data (UpHistory *history, gdouble rate)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -791,12 +3100,7 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, rate);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_rate, item);
-	up_history_schedule_save (history);
+	up_history_add_point (history, UP_HISTORY_TYPE_RATE, rate);
 
 	/* save last value */
 	history->priv->rate_last = rate;
@@ -810,8 +3114,6 @@ up_history_set_rate_data (UpHistory *history, gdouble rate)
 gboolean
 up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -824,12 +3126,7 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_full, item);
-	up_history_schedule_save (history);
+	up_history_add_point (history, UP_HISTORY_TYPE_TIME_FULL, (gdouble) time_s);
 
 	/* save last value */
 	history->priv->time_full_last = time_s;
@@ -843,8 +3140,6 @@ up_history_set_time_full_data (UpHistory *history, gint64 time_s)
 gboolean
 up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 {
-	UpHistoryItem *item;
-
 	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
 
 	if (history->priv->id == NULL)
@@ -857,12 +3152,7 @@ up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 		return FALSE;
 
 	/* add to array and schedule save file */
-	item = up_history_item_new ();
-	up_history_item_set_time_to_present (item);
-	up_history_item_set_value (item, (gdouble) time_s);
-	up_history_item_set_state (item, history->priv->state);
-	g_ptr_array_add (history->priv->data_time_empty, item);
-	up_history_schedule_save (history);
+	up_history_add_point (history, UP_HISTORY_TYPE_TIME_EMPTY, (gdouble) time_s);
 
 	/* save last value */
 	history->priv->time_empty_last = time_s;
@@ -870,6 +3160,71 @@ up_history_set_time_empty_data (UpHistory *history, gint64 time_s)
 	return TRUE;
 }
 
+/**
+ * up_history_point_compare:
+ **/
+static gint
+up_history_point_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const UpHistoryPoint *point_a = a;
+	const UpHistoryPoint *point_b = b;
+
+	if (point_a->time < point_b->time)
+		return -1;
+	return point_a->time > point_b->time;
+}
+
+/**
+ * up_history_import_data:
+ * @points: the points of the series, in any order; they are sorted in place
+ *
+ * Replaces a whole series, for instance to replay a saved history on a
+ * test system. The tiers, and the statistics for the charge, are
+ * rebuilt from the new points.
+ **/
+gboolean
+up_history_import_data (UpHistory *history, UpHistoryType type, UpHistoryPoint *points, guint len)
+{
+	UpHistorySeries *series;
+	gdouble value;
+	guint i;
+
+	g_return_val_if_fail (UP_IS_HISTORY (history), FALSE);
+
+	if (history->priv->id == NULL)
+		return FALSE;
+	if (up_history_type_to_string (type) == NULL)
+		return FALSE;
+
+	/* stable, so points with the same time keep their order */
+	g_qsort_with_data (points, len, sizeof (UpHistoryPoint), up_history_point_compare, NULL);
+
+	series = &history->priv->series[type];
+	series->len = 0;
+	series->saved = 0;
+	history->priv->doors[type].pending = FALSE;
+	up_history_series_reserve (series, len);
+	for (i = 0; i < len; i++) {
+		value = points[i].value;
+		if (history->priv->compact_encoding)
+			value = up_history_quantize_value (value);
+		up_history_series_append (series, points[i].time, value, points[i].state);
+	}
+	history->priv->generation[type]++;
+	history->priv->epoch[type]++;
+
+	for (i = 0; i < UP_HISTORY_TIER_LAST; i++)
+		up_history_tier_reset (&history->priv->tiers[type][i], i);
+	up_history_tiers_replay (history, type);
+	if (type == UP_HISTORY_TYPE_CHARGE)
+		up_history_profile_rebuild (history);
+
+	g_debug ("imported %u %s points", len, up_history_type_to_string (type));
+	history->priv->needs_rewrite = TRUE;
+	up_history_schedule_save (history);
+	return TRUE;
+}
+
 /**
  * up_history_is_device_id_equal:
  **/
@@ -902,12 +3257,26 @@ up_history_class_init (UpHistoryClass *klass)
 static void
 up_history_init (UpHistory *history)
 {
+	g_autoptr(UpConfig) config = NULL;
+	guint i, j;
+
 	history->priv = up_history_get_instance_private (history);
-	history->priv->data_rate = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_charge = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_full = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
-	history->priv->data_time_empty = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
 	history->priv->max_data_age = UP_HISTORY_DEFAULT_MAX_DATA_AGE;
+	history->priv->writer = up_history_writer_new ();
+	config = up_config_new ();
+	history->priv->compact_encoding = up_config_get_boolean (config, "HistoryCompactEncoding");
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		gdouble tolerance = up_history_tolerance_defaults[i];
+
+		if (up_config_has_key (config, up_history_tolerance_keys[i]))
+			tolerance = up_config_get_double (config, up_history_tolerance_keys[i]);
+		up_history_set_tolerance (history, i, tolerance);
+	}
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++)
+			up_history_tier_reset (&history->priv->tiers[i][j], j);
+	}
+	up_history_profile_reset (&history->priv->profile);
 
 	if (g_getenv ("UPOWER_HISTORY_DIR"))
 		up_history_set_directory (history, g_getenv ("UPOWER_HISTORY_DIR"));
@@ -923,23 +3292,29 @@ static void
 up_history_finalize (GObject *object)
 {
 	UpHistory *history;
+	guint i;
 
 	g_return_if_fail (UP_IS_HISTORY (object));
 
 	history = UP_HISTORY (object);
 
-	/* save */
-	g_clear_pointer (&history->priv->save_source, g_source_destroy);
+	/* save, without waiting for the data to hit the disk */
+	up_history_writer_unschedule (history->priv->writer, object);
 	if (history->priv->id != NULL)
-		up_history_save_data (history);
+		up_history_writer_submit (history->priv->writer,
+					  up_history_prepare_job (history, TRUE), TRUE);
+	g_object_unref (history->priv->writer);
 
-	g_ptr_array_unref (history->priv->data_rate);
-	g_ptr_array_unref (history->priv->data_charge);
-	g_ptr_array_unref (history->priv->data_time_full);
-	g_ptr_array_unref (history->priv->data_time_empty);
+	for (i = 0; i < UP_HISTORY_TYPE_UNKNOWN; i++) {
+		guint j;
+
+		up_history_series_clear (&history->priv->series[i]);
+		for (j = 0; j < UP_HISTORY_TIER_LAST; j++)
+			g_free (history->priv->tiers[i][j].buckets);
+	}
 
 	g_free (history->priv->id);
-	g_free (history->priv->dir);
+	g_clear_object (&history->priv->store);
 
 	g_return_if_fail (history->priv != NULL);
 
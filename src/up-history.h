@@ -23,6 +23,7 @@
 #define __UP_HISTORY_H
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 #include "up-types.h"
 
@@ -58,6 +59,42 @@ typedef enum {
 	UP_HISTORY_TYPE_UNKNOWN
 } UpHistoryType;
 
+typedef enum {
+	UP_HISTORY_DOWNSAMPLE_AVERAGE,
+	UP_HISTORY_DOWNSAMPLE_LTTB,
+	UP_HISTORY_DOWNSAMPLE_MINMAX,
+	UP_HISTORY_DOWNSAMPLE_UNKNOWN
+} UpHistoryDownsample;
+
+/* a bucket of GetHistoryAggregate */
+typedef struct {
+	guint32			 time;		/* mean */
+	guint32			 count;
+	guint32			 state;
+	guint32			 reserved;
+	gdouble			 min;
+	gdouble			 max;
+	gdouble			 mean;
+} UpHistoryAggregate;
+
+/* the time-aligned series of GetHistoryMulti */
+typedef struct {
+	guint			 len;		/* of each column */
+	guint			 n_types;
+	guint32			*time;		/* mean of each slot */
+	guint32			*state;
+	gdouble			*value;		/* one column of @len after the other */
+} UpHistoryColumns;
+
+/* the records exchanged with GetHistoryFd and ImportHistory */
+typedef struct {
+	guint32			 time;
+	guint32			 state;
+	gdouble			 value;
+} UpHistoryPoint;
+
+G_STATIC_ASSERT (sizeof (UpHistoryPoint) == 16);
+
 
 GType		 up_history_get_type			(void);
 gboolean	 up_history_is_device_id_equal		(UpHistory *history,	 const gchar *id);
@@ -67,10 +104,42 @@ GPtrArray	*up_history_get_data			(UpHistory		*history,
 							 UpHistoryType		 type,
 							 guint			 timespan,
 							 guint			 resolution);
+GPtrArray	*up_history_get_data_downsampled	(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 timespan,
+							 guint			 resolution,
+							 UpHistoryDownsample	 method);
+GArray		*up_history_get_aggregate		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 timespan,
+							 guint			 buckets);
+UpHistoryColumns *up_history_get_columns		(UpHistory		*history,
+							 const UpHistoryType	*types,
+							 guint			 n_types,
+							 guint			 timespan,
+							 guint			 resolution);
+void		 up_history_columns_free		(UpHistoryColumns	*columns);
+GPtrArray	*up_history_get_data_since		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 guint			 since);
+guint64		 up_history_get_generation		(UpHistory		*history,
+							 UpHistoryType		 type);
+guint64		 up_history_get_epoch			(UpHistory		*history,
+							 UpHistoryType		 type);
+UpHistoryDownsample up_history_downsample_from_string	(const gchar		*method);
 GPtrArray	*up_history_get_profile_data		(UpHistory		*history,
 							 gboolean		 charging);
 gboolean	 up_history_set_id			(UpHistory		*history,
 							 const gchar		*id);
+void		 up_history_load_async			(UpHistory		*history,
+							 const gchar		*id,
+							 GCancellable		*cancellable,
+							 GAsyncReadyCallback	 callback,
+							 gpointer		 user_data);
+gboolean	 up_history_load_finish			(UpHistory		*history,
+							 GAsyncResult		*res,
+							 GError			**error);
+gboolean	 up_history_is_loading			(UpHistory		*history);
 gboolean	 up_history_set_state			(UpHistory		*history,
 							 UpDeviceState		 state);
 gboolean	 up_history_set_charge_data		(UpHistory		*history,
@@ -83,10 +152,26 @@ gboolean	 up_history_set_time_empty_data		(UpHistory		*history,
 							 gint64			 time);
 void		 up_history_set_max_data_age		(UpHistory		*history,
 							 guint			 max_data_age);
+void		 up_history_set_compact_encoding	(UpHistory		*history,
+							 gboolean		 compact_encoding);
+void		 up_history_set_tolerance		(UpHistory		*history,
+							 UpHistoryType		 type,
+							 gdouble		 tolerance);
+gboolean	 up_history_import_data			(UpHistory		*history,
+							 UpHistoryType		 type,
+							 UpHistoryPoint		*points,
+							 guint			 len);
 gboolean	 up_history_save_data			(UpHistory		*history);
 
 void		 up_history_set_directory		(UpHistory		*history,
 							 const gchar		*dir);
+gboolean	 up_history_parse_legacy_line		(const gchar		*line,
+							 const gchar		*end,
+							 guint32		*time,
+							 gdouble		*value,
+							 UpDeviceState		*state);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (UpHistoryColumns, up_history_columns_free)
 
 G_END_DECLS
 
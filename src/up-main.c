@@ -35,6 +35,7 @@
 #include <locale.h>
 
 #include "up-daemon.h"
+#include "up-history-writer.h"
 #include "up-kbd-backlight.h"
 
 #define DEVKIT_POWER_SERVICE_NAME "org.freedesktop.UPower"
@@ -115,7 +116,12 @@ static gboolean
 up_main_sigterm_cb (gpointer user_data)
 {
 	UpState *state = user_data;
+	g_autoptr(UpHistoryWriter) writer = up_history_writer_new ();
+
 	g_debug ("Handling SIGTERM");
+
+	/* do not lose what was recorded since the last save */
+	up_history_writer_flush (writer, TRUE);
 	g_main_loop_quit (state->loop);
 	return FALSE;
 }
@@ -24,7 +24,10 @@
 #include <glib-object.h>
 #include <glib/gstdio.h>
 #include <up-history-item.h>
+#include <up-stats-item.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
 #include <errno.h>
 #include "up-backend.h"
@@ -32,8 +35,11 @@
 #include "up-device.h"
 #include "up-device-list.h"
 #include "up-history.h"
+#include "up-history-store.h"
+#include "up-history-writer.h"
 #include "up-native.h"
 #include "up-polkit.h"
+#include "up-tick.h"
 
 gchar *history_dir = NULL;
 
@@ -96,7 +102,9 @@ up_test_device_list_func (void)
 	UpDeviceList *list;
 	GObject *native;
 	UpDevice *device;
+	UpDevice *other;
 	GObject *found;
+	GPtrArray *array;
 	gboolean ret;
 
 	list = up_device_list_new ();
@@ -105,6 +113,10 @@ up_test_device_list_func (void)
 	/* add device */
 	native = g_object_new (G_TYPE_OBJECT, NULL);
 	device = up_device_new (NULL, native);
+	g_object_set (device,
+		      "type", UP_DEVICE_KIND_BATTERY,
+		      "serial", "ABC123",
+		      NULL);
 	ret = up_device_list_insert (list, device);
 	g_assert (ret);
 
@@ -113,32 +125,102 @@ up_test_device_list_func (void)
 	g_assert (found != NULL);
 	g_object_unref (found);
 
+	/* find a second device by serial, ignoring case */
+	other = up_device_new (NULL, native);
+	g_object_set (other, "serial", "abc123", NULL);
+	ret = up_device_list_insert (list, other);
+	g_assert (ret);
+	found = up_device_list_lookup_serial (list, "Abc123", device);
+	g_assert (found == G_OBJECT (other));
+	g_object_unref (found);
+	g_assert_null (up_device_list_lookup_serial (list, "xyz", NULL));
+
+	/* the indexes follow property changes */
+	array = up_device_list_get_kind (list, UP_DEVICE_KIND_BATTERY);
+	g_assert_cmpint (array->len, ==, 1);
+	g_ptr_array_unref (array);
+	array = up_device_list_get_power_supplies (list);
+	g_assert_cmpint (array->len, ==, 0);
+	g_ptr_array_unref (array);
+	g_object_set (device, "power-supply", TRUE, NULL);
+	g_object_set (other, "type", UP_DEVICE_KIND_BATTERY, "serial", "def", NULL);
+	array = up_device_list_get_kind (list, UP_DEVICE_KIND_BATTERY);
+	g_assert_cmpint (array->len, ==, 2);
+	g_assert (g_ptr_array_index (array, 0) == device);
+	g_ptr_array_unref (array);
+	array = up_device_list_get_power_supplies (list);
+	g_assert_cmpint (array->len, ==, 1);
+	g_ptr_array_unref (array);
+	g_assert_null (up_device_list_lookup_serial (list, "abc123", device));
+
 	/* remove device */
 	ret = up_device_list_remove (list, device);
 	g_assert (ret);
+	array = up_device_list_get_array (list);
+	g_assert_cmpint (array->len, ==, 1);
+	g_ptr_array_unref (array);
+	array = up_device_list_get_power_supplies (list);
+	g_assert_cmpint (array->len, ==, 0);
+	g_ptr_array_unref (array);
+	g_assert_null (up_device_list_lookup_serial (list, "abc123", NULL));
 
 	/* unref */
 	g_object_unref (native);
 	g_object_unref (device);
+	g_object_unref (other);
 	g_object_unref (list);
 }
 
 static void
 up_test_history_remove_temp_files (void)
 {
-	gchar *filename;
-	filename = g_build_filename (history_dir, "history-time-full-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-time-empty-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
-	filename = g_build_filename (history_dir, "history-rate-test.dat", NULL);
-	g_unlink (filename);
-	g_free (filename);
+	const gchar *types[] = { "time-full", "time-empty", "charge", "rate", "profile", "tiers" };
+	const gchar *extensions[] = { "dat", "bin" };
+	const gchar *store_files[] = { "history.db", "history.db.tmp", "history.db.old" };
+	g_autoptr(UpHistoryWriter) writer = NULL;
+	guint i, j;
+
+	/* the last saves may still be queued */
+	writer = up_history_writer_new ();
+	up_history_writer_wait (writer);
+
+	for (i = 0; i < G_N_ELEMENTS (store_files); i++) {
+		g_autofree gchar *filename = g_build_filename (history_dir, store_files[i], NULL);
+		g_unlink (filename);
+	}
+	for (i = 0; i < G_N_ELEMENTS (types); i++) {
+		for (j = 0; j < G_N_ELEMENTS (extensions); j++) {
+			g_autofree gchar *basename = g_strdup_printf ("history-%s-test.%s", types[i], extensions[j]);
+			g_autofree gchar *filename = g_build_filename (history_dir, basename, NULL);
+			g_unlink (filename);
+		}
+	}
+}
+
+/* each history test gets its own empty directory */
+static void
+up_test_history_dir_setup (void)
+{
+	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
+	if (mkdtemp (history_dir) == NULL)
+		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+}
+
+static void
+up_test_history_dir_teardown (void)
+{
+	up_test_history_remove_temp_files ();
+	rmdir (history_dir);
+	g_clear_pointer (&history_dir, g_free);
+}
+
+static gsize
+up_test_history_get_saved_size (const gchar *key)
+{
+	g_autoptr(UpHistoryStore) store = up_history_store_new (history_dir);
+	g_autoptr(GBytes) bytes = up_history_store_lookup (store, key);
+
+	return bytes != NULL ? g_bytes_get_size (bytes) : 0;
 }
 
 static void
@@ -154,9 +236,7 @@ up_test_history_func (void)
 	g_assert (history != NULL);
 
 	/* set a temporary directory for the history */
-	history_dir = g_build_filename (g_get_tmp_dir(), "upower-test.XXXXXX", NULL);
-	if (mkdtemp (history_dir) == NULL)
-		g_error ("Cannot create temporary directory: %s", g_strerror(errno));
+	up_test_history_dir_setup ();
 	up_history_set_directory (history, history_dir);
 
 	/* remove previous test files */
@@ -239,10 +319,8 @@ up_test_history_func (void)
 	g_assert (ret);
 	g_object_unref (history);
 
-	/* ensure the file was created */
-	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
-	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
-	g_free (filename);
+	/* ensure the data was saved */
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), >, 0);
 
 	/* ensure we can load from disk */
 	history = up_history_new ();
@@ -277,8 +355,1374 @@ up_test_history_func (void)
 	g_object_unref (history);
 
 	/* remove these test files */
-	up_test_history_remove_temp_files ();
-	rmdir (history_dir);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_migration_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gchar *filename;
+	gchar *data;
+	gboolean ret;
+	guint time_now;
+
+	up_test_history_dir_setup ();
+
+	/* write a history file in the old text format */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_strdup_printf ("%u\t%.3f\tcharging\n"
+				"%u\t%.3f\tdischarging\n",
+				time_now - 2, 42.5,
+				time_now - 1, 41.0);
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	ret = g_file_set_contents (filename, data, -1, NULL);
+	g_assert (ret);
+	g_free (data);
+
+	/* the old data is picked up */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 3); /* plus the marker */
+	item = g_ptr_array_index (array, 0);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 42.5);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_CHARGING);
+	item = g_ptr_array_index (array, 1);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 41.0);
+	g_assert_cmpint (up_history_item_get_time (item), ==, time_now - 1);
+	g_ptr_array_unref (array);
+
+	/* saving moves the text file into the store */
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), >, 0);
+	g_object_unref (history);
+
+	/* and it loads back the same */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 4);
+	item = g_ptr_array_index (array, 0);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 42.5);
+	g_assert_cmpint (up_history_item_get_time (item), ==, time_now - 2);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_append_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gchar *filename;
+	FILE *file;
+	gboolean ret;
+
+	up_test_history_dir_setup ();
+	filename = g_build_filename (history_dir, "history.db", NULL);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+
+	/* the first save writes the header, the marker and the point */
+	up_history_set_charge_data (history, 50);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), ==, 16 + 2 * 16);
+
+	/* later saves only add the new point */
+	up_history_set_charge_data (history, 51);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), ==, 16 + 3 * 16);
+
+	/* nothing new, nothing written */
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), ==, 16 + 3 * 16);
+
+	/* a torn write is overwritten by the next one */
+	file = fopen (filename, "ab");
+	g_assert (file != NULL);
+	fputc (0xff, file);
+	fclose (file);
+	up_history_set_charge_data (history, 52);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), ==, 16 + 4 * 16);
+	g_object_unref (history);
+
+	/* everything loads back */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 5); /* plus the marker */
+	item = g_ptr_array_index (array, 1);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 50);
+	item = g_ptr_array_index (array, 3);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 52);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_CHARGING);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	g_free (filename);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_tolerance_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	gboolean ret;
+
+	up_test_history_dir_setup ();
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_tolerance (history, UP_HISTORY_TYPE_RATE, 0.1);
+	up_history_set_id (history, "test");
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+
+	/* the middle point is close enough to the line from the first to
+	 * the last one, so it is replaced */
+	up_history_set_rate_data (history, 10.0);
+	g_usleep (G_USEC_PER_SEC);
+	up_history_set_rate_data (history, 10.05);
+	g_usleep (G_USEC_PER_SEC);
+	up_history_set_rate_data (history, 10.02);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_RATE, 0, 100);
+	g_assert_cmpint (array->len, ==, 3); /* plus the marker */
+	item = g_ptr_array_index (array, 2);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 10.02);
+	g_ptr_array_unref (array);
+
+	/* too far from it */
+	g_usleep (G_USEC_PER_SEC);
+	up_history_set_rate_data (history, 12.0);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_RATE, 0, 100);
+	g_assert_cmpint (array->len, ==, 4);
+	g_ptr_array_unref (array);
+
+	/* points that were saved are kept */
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_usleep (G_USEC_PER_SEC);
+	up_history_set_rate_data (history, 12.01);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_RATE, 0, 100);
+	g_assert_cmpint (array->len, ==, 5);
+	item = g_ptr_array_index (array, 3);
+	g_assert_cmpfloat (up_history_item_get_value (item), ==, 12.0);
+	g_ptr_array_unref (array);
+
+	/* a change of state is always kept */
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	up_history_set_rate_data (history, 12.02);
+	array = up_history_get_data (history, UP_HISTORY_TYPE_RATE, 0, 100);
+	g_assert_cmpint (array->len, ==, 6);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_compact_func (void)
+{
+	UpHistory *history;
+	GPtrArray *before;
+	GPtrArray *after;
+	gboolean ret;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	history = up_history_new ();
+	up_history_set_compact_encoding (history, TRUE);
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	for (i = 0; i < 1000; i++) {
+		if (i == 500)
+			up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+		up_history_set_charge_data (history, 100.0 - i * 0.0937);
+	}
+	ret = up_history_save_data (history);
+	g_assert (ret);
+
+	/* later saves add a block */
+	for (i = 0; i < 10; i++)
+		up_history_set_charge_data (history, 10.0 + i / 3.0);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	before = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, G_MAXUINT);
+	g_assert (before != NULL);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), <, (16 + before->len * 16) / 4);
+	g_object_unref (history);
+
+	/* everything comes back exactly */
+	history = up_history_new ();
+	up_history_set_compact_encoding (history, TRUE);
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	after = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, G_MAXUINT);
+	g_assert (after != NULL);
+	g_assert_cmpint (after->len, ==, before->len + 1); /* plus the marker */
+	for (i = 0; i < before->len; i++) {
+		UpHistoryItem *item = g_ptr_array_index (before, i);
+		UpHistoryItem *loaded = g_ptr_array_index (after, i);
+
+		g_assert_cmpint (up_history_item_get_time (loaded), ==, up_history_item_get_time (item));
+		g_assert_cmpfloat (up_history_item_get_value (loaded), ==, up_history_item_get_value (item));
+		g_assert_cmpint (up_history_item_get_state (loaded), ==, up_history_item_get_state (item));
+	}
+	g_ptr_array_unref (after);
+	g_object_unref (history);
+
+	/* switching back rewrites it with fixed-size records */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), ==, 16 + (before->len + 2) * 16);
+	g_object_unref (history);
+	g_ptr_array_unref (before);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_tick_cb (gpointer user_data)
+{
+	UpTick *tick = up_tick_new ();
+	guint64 *wakeup = user_data;
+
+	*wakeup = up_tick_get_wakeups (tick, NULL);
+	g_object_unref (tick);
+}
+
+static void
+up_test_tick_func (void)
+{
+	UpTick *tick;
+	guint64 wakeup[2] = { 0, 0 };
+	guint id[2];
+	gint64 now;
+
+	tick = up_tick_new ();
+	id[0] = up_tick_add (tick, "test-due", up_test_tick_cb, &wakeup[0]);
+	id[1] = up_tick_add (tick, "test-slack", up_test_tick_cb, &wakeup[1]);
+
+	/* the one with some slack runs with the one that is due */
+	now = g_get_monotonic_time ();
+	up_tick_schedule (tick, id[0], now + G_USEC_PER_SEC / 2, 0);
+	up_tick_schedule (tick, id[1], now + G_USEC_PER_SEC / 4, 5);
+	g_assert_cmpint (up_tick_get_ready_time (tick, id[1]), ==, now + G_USEC_PER_SEC / 4);
+	while (wakeup[0] == 0 || wakeup[1] == 0)
+		g_main_context_iteration (NULL, TRUE);
+	g_assert_cmpint (g_get_monotonic_time (), >=, now + G_USEC_PER_SEC / 2);
+	g_assert_cmpint (wakeup[0], ==, wakeup[1]);
+	g_assert_cmpint (up_tick_get_wakeups (tick, "test-due"), ==, 1);
+	g_assert_cmpint (up_tick_get_wakeups (tick, "test-slack"), ==, 1);
+	g_assert_cmpint (up_tick_get_ready_time (tick, id[0]), ==, -1);
+
+	/* nothing runs once unscheduled */
+	up_tick_schedule (tick, id[0], g_get_monotonic_time (), 0);
+	up_tick_schedule (tick, id[0], -1, 0);
+	up_tick_remove (tick, id[1]);
+	while (g_main_context_iteration (NULL, FALSE));
+	g_assert_cmpint (up_tick_get_wakeups (tick, "test-due"), ==, 1);
+
+	up_tick_remove (tick, id[0]);
+	g_object_unref (tick);
+}
+
+static void
+up_test_history_writer_func (void)
+{
+	const gchar *ids[] = { "test", "writer" };
+	UpHistoryWriter *writer;
+	UpHistory *history[2];
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	writer = up_history_writer_new ();
+	for (i = 0; i < G_N_ELEMENTS (history); i++) {
+		history[i] = up_history_new ();
+		up_history_set_directory (history[i], history_dir);
+		up_history_set_id (history[i], ids[i]);
+		up_history_set_state (history[i], UP_DEVICE_STATE_CHARGING);
+		up_history_set_charge_data (history[i], 50);
+	}
+
+	/* nothing is written before the writer flushes */
+	g_assert_cmpint (up_test_history_get_saved_size ("test/charge"), ==, 0);
+
+	/* both devices are written in one go */
+	up_history_writer_flush (writer, TRUE);
+	for (i = 0; i < G_N_ELEMENTS (history); i++) {
+		g_autofree gchar *key = g_strdup_printf ("%s/charge", ids[i]);
+		g_assert_cmpint (up_test_history_get_saved_size (key), ==, 16 + 2 * 16);
+	}
+
+	/* and the rest once they go away */
+	for (i = 0; i < G_N_ELEMENTS (history); i++) {
+		up_history_set_charge_data (history[i], 51);
+		g_object_unref (history[i]);
+	}
+	up_history_writer_wait (writer);
+	for (i = 0; i < G_N_ELEMENTS (history); i++) {
+		g_autofree gchar *key = g_strdup_printf ("%s/charge", ids[i]);
+		g_assert_cmpint (up_test_history_get_saved_size (key), ==, 16 + 3 * 16);
+	}
+	g_object_unref (writer);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_store_commit (UpHistoryStore *store, UpHistoryStoreChangeKind kind,
+			      const gchar *key, const gchar *data, gboolean expected)
+{
+	g_autoptr(GPtrArray) changes = NULL;
+	g_autoptr(GBytes) bytes = NULL;
+
+	changes = g_ptr_array_new_with_free_func ((GDestroyNotify) up_history_store_change_free);
+	bytes = g_bytes_new (data, strlen (data));
+	g_ptr_array_add (changes, up_history_store_change_new (kind, key, bytes));
+	g_assert_cmpint (up_history_store_commit (store, changes, FALSE), ==, expected);
+}
+
+static void
+up_test_history_store_check (UpHistoryStore *store, const gchar *key, const gchar *expected)
+{
+	g_autoptr(GBytes) bytes = up_history_store_lookup (store, key);
+
+	g_assert (bytes != NULL);
+	g_assert_cmpmem (g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes),
+			 expected, strlen (expected));
+}
+
+static void
+up_test_history_store_func (void)
+{
+	UpHistoryStore *store;
+	GStatBuf buf;
+	gchar *filename;
+	goffset size;
+	FILE *file;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	/* the files of previous versions are moved in, and only those */
+	filename = g_build_filename (history_dir, "history-time-full-test.bin", NULL);
+	g_assert (g_file_set_contents (filename, "old", -1, NULL));
+	g_free (filename);
+	filename = g_build_filename (history_dir, "charging-threshold-status", NULL);
+	g_assert (g_file_set_contents (filename, "1", -1, NULL));
+	store = up_history_store_new (history_dir);
+	up_test_history_store_check (store, "test/time-full", "old");
+	g_assert (g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_unlink (filename);
+	g_free (filename);
+	filename = g_build_filename (history_dir, "history-time-full-test.bin", NULL);
+	g_assert (!g_file_test (filename, G_FILE_TEST_EXISTS));
+	g_free (filename);
+
+	/* appends add to what was saved before */
+	up_test_history_store_commit (store, UP_HISTORY_STORE_REPLACE, "test/charge", "hello", TRUE);
+	up_test_history_store_commit (store, UP_HISTORY_STORE_APPEND, "test/charge", " world", TRUE);
+	up_test_history_store_check (store, "test/charge", "hello world");
+	up_test_history_store_commit (store, UP_HISTORY_STORE_APPEND, "test/rate", "lost", FALSE);
+	g_assert (up_history_store_lookup (store, "test/rate") == NULL);
+
+	/* superseded data is dropped when compacting */
+	for (i = 0; i < 100; i++)
+		up_test_history_store_commit (store, UP_HISTORY_STORE_REPLACE, "test/profile", "statistics", TRUE);
+	filename = g_build_filename (history_dir, "history.db", NULL);
+	g_assert_cmpint (g_stat (filename, &buf), ==, 0);
+	size = buf.st_size;
+	g_assert (up_history_store_compact (store));
+	g_assert_cmpint (g_stat (filename, &buf), ==, 0);
+	g_assert_cmpint (buf.st_size, <, size / 10);
+	size = buf.st_size;
+	up_test_history_store_check (store, "test/profile", "statistics");
+	up_test_history_store_check (store, "test/charge", "hello world");
+
+	/* a write that did not complete is dropped when opening again */
+	file = fopen (filename, "ab");
+	g_assert (file != NULL);
+	fputs ("torn", file);
+	fclose (file);
+	g_object_unref (store);
+	store = up_history_store_new (history_dir);
+	up_test_history_store_check (store, "test/charge", "hello world");
+	up_test_history_store_check (store, "test/time-full", "old");
+	g_assert_cmpint (g_stat (filename, &buf), ==, 0);
+	g_assert_cmpint (buf.st_size, ==, size);
+	g_object_unref (store);
+	g_free (filename);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_parse_func (void)
+{
+	const gchar *values[] = { "42.500", "-1.250", "0.100", "99.999", "7", "1e3", "123456789.123456789" };
+	UpHistoryItem *item;
+	gboolean ret;
+	guint i;
+
+	/* the values match what strtod() makes of them */
+	item = up_history_item_new ();
+	for (i = 0; i < G_N_ELEMENTS (values); i++) {
+		g_autofree gchar *text = g_strdup_printf ("1700000000\t%s\tcharging", values[i]);
+
+		ret = up_history_item_set_from_string (item, text);
+		g_assert (ret);
+		g_assert_cmpint (up_history_item_get_time (item), ==, 1700000000);
+		g_assert_cmpfloat (up_history_item_get_value (item), ==, g_ascii_strtod (values[i], NULL));
+		g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_CHARGING);
+	}
+
+	/* only complete names are states */
+	ret = up_history_item_set_from_string (item, "1\t2.0\tpending-discharge");
+	g_assert (ret);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_PENDING_DISCHARGE);
+	ret = up_history_item_set_from_string (item, "1\t2.0\tchargeing");
+	g_assert (ret);
+	g_assert_cmpint (up_history_item_get_state (item), ==, UP_DEVICE_STATE_UNKNOWN);
+	g_assert_cmpint (up_device_state_from_string_len ("emptying", 5), ==, UP_DEVICE_STATE_EMPTY);
+	g_assert_cmpint (up_device_state_from_string ("fully-charge"), ==, UP_DEVICE_STATE_UNKNOWN);
+
+	/* three fields are needed */
+	g_test_expect_message ("libupower-glib", G_LOG_LEVEL_WARNING, "invalid string*");
+	ret = up_history_item_set_from_string (item, "1\t2.0");
+	g_test_assert_expected_messages ();
+	g_assert (!ret);
+	g_object_unref (item);
+}
+
+/* the text parser as it was, to compare against */
+static UpDeviceState
+up_test_state_from_string_reference (const gchar *state)
+{
+	if (g_str_equal (state, "charging"))
+		return UP_DEVICE_STATE_CHARGING;
+	if (g_str_equal (state, "discharging"))
+		return UP_DEVICE_STATE_DISCHARGING;
+	if (g_str_equal (state, "empty"))
+		return UP_DEVICE_STATE_EMPTY;
+	if (g_str_equal (state, "fully-charged"))
+		return UP_DEVICE_STATE_FULLY_CHARGED;
+	if (g_str_equal (state, "pending-charge"))
+		return UP_DEVICE_STATE_PENDING_CHARGE;
+	if (g_str_equal (state, "pending-discharge"))
+		return UP_DEVICE_STATE_PENDING_DISCHARGE;
+	return UP_DEVICE_STATE_UNKNOWN;
+}
+
+static guint
+up_test_history_parse_reference (const gchar *data, gdouble *sum)
+{
+	g_auto(GStrv) lines = NULL;
+	guint count = 0;
+	guint i;
+
+	*sum = 0;
+	lines = g_strsplit (data, "\n", 0);
+	for (i = 0; lines[i] != NULL && lines[i+1] != NULL; i++) {
+		g_auto(GStrv) parts = g_strsplit (lines[i], "\t", 0);
+
+		if (g_strv_length (parts) != 3)
+			continue;
+		*sum += (guint32) atoi (parts[0]);
+		*sum += atof (parts[1]);
+		*sum += up_test_state_from_string_reference (parts[2]);
+		count++;
+	}
+	return count;
+}
+
+/* the same walk as when migrating a file, without storing the points */
+static guint
+up_test_history_parse_in_place (const gchar *data, gsize length, gdouble *sum)
+{
+	const gchar *end = data + length;
+	const gchar *line;
+	const gchar *eol;
+	guint count = 0;
+
+	*sum = 0;
+	for (line = data; (eol = memchr (line, '\n', end - line)) != NULL; line = eol + 1) {
+		UpDeviceState state;
+		gdouble value;
+		guint32 time;
+
+		if (!up_history_parse_legacy_line (line, eol, &time, &value, &state))
+			continue;
+		*sum += time;
+		*sum += value;
+		*sum += state;
+		count++;
+	}
+	return count;
+}
+
+static void
+up_test_history_parse_benchmark_func (void)
+{
+	const guint count = 100000;
+	UpHistory *history;
+	GPtrArray *array;
+	GString *data;
+	gchar *filename;
+	gdouble reference;
+	gdouble elapsed;
+	gdouble sum_reference;
+	gdouble sum;
+	guint time_now;
+	guint i;
+
+	if (!g_test_perf ()) {
+		g_test_skip ("only run in performance mode");
+		return;
+	}
+
+	up_test_history_dir_setup ();
+
+	/* a text history as the old versions wrote it */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	data = g_string_new (NULL);
+	for (i = 0; i < count; i++) {
+		g_string_append_printf (data, "%u\t%.3f\t%s\n",
+					time_now - (count - i) * 2,
+					100.0f * (i % 3600) / 3600,
+					up_device_state_to_string ((i / 3600) % 2 ? UP_DEVICE_STATE_CHARGING : UP_DEVICE_STATE_DISCHARGING));
+	}
+
+	/* only the parsing, of the same lines in memory */
+	g_test_timer_start ();
+	g_assert_cmpint (up_test_history_parse_reference (data->str, &sum_reference), ==, count);
+	reference = g_test_timer_elapsed ();
+	g_test_message ("splitting %u lines: %.3f s", count, reference);
+
+	g_test_timer_start ();
+	g_assert_cmpint (up_test_history_parse_in_place (data->str, data->len, &sum), ==, count);
+	elapsed = g_test_timer_elapsed ();
+	g_assert_cmpfloat (sum, ==, sum_reference);
+	g_test_minimized_result (elapsed, "parsing %u lines in place: %.3f s", count, elapsed);
+	g_test_maximized_result (reference / elapsed, "%.1f times faster", reference / elapsed);
+
+	filename = g_build_filename (history_dir, "history-charge-test.dat", NULL);
+	g_assert (g_file_set_contents (filename, data->str, data->len, NULL));
+	g_string_free (data, TRUE);
+
+	/* this includes building the tiers and statistics */
+	g_test_timer_start ();
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	elapsed = g_test_timer_elapsed ();
+	g_test_message ("migrating %u lines: %.3f s", count, elapsed);
+
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, G_MAXUINT);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >, count / 2);
+	g_ptr_array_unref (array);
+
+	g_object_unref (history);
+	g_unlink (filename);
+	g_free (filename);
+	up_test_history_dir_teardown ();
+}
+
+static glong
+up_test_get_rss_kb (void)
+{
+	g_autofree gchar *data = NULL;
+	glong size = 0;
+	glong resident = 0;
+
+	if (!g_file_get_contents ("/proc/self/statm", &data, NULL, NULL))
+		return 0;
+	if (sscanf (data, "%ld %ld", &size, &resident) != 2)
+		return 0;
+	return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/* mirrors the files written by previous versions, moved into the store
+ * when it is created */
+typedef struct {
+	guint32 time;
+	guint8 state;
+	guint8 reserved[3];
+	gdouble value;
+} UpTestHistoryRecord;
+
+static void
+up_test_history_write_file (const gchar *type, const UpTestHistoryRecord *records, guint count)
+{
+	struct {
+		gchar magic[6];
+		guint8 byte_order;
+		guint8 version;
+		guint32 record_size;
+		guint32 reserved;
+	} header = { { 'U', 'P', 'H', 'I', 'S', 'T' }, G_BYTE_ORDER == G_LITTLE_ENDIAN ? 'l' : 'B',
+		     1, sizeof (UpTestHistoryRecord), 0 };
+	GString *data;
+	gchar *basename;
+	gchar *filename;
+
+	data = g_string_new_len ((const gchar *) &header, sizeof (header));
+	g_string_append_len (data, (const gchar *) records, count * sizeof (UpTestHistoryRecord));
+	basename = g_strdup_printf ("history-%s-test.bin", type);
+	filename = g_build_filename (history_dir, basename, NULL);
+	g_assert (g_file_set_contents (filename, data->str, data->len, NULL));
+	g_string_free (data, TRUE);
+	g_free (basename);
+	g_free (filename);
+}
+
+static void
+up_test_history_tiers_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 24 * 60 * 6; /* a day, every ten seconds */
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	UpHistoryItem *item_last;
+	guint time_now;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	/* discharge over the day */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 10;
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = 100.0f - 100.0f * i / count;
+	}
+	up_test_history_write_file ("charge", records, count);
+	g_free (records);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+
+	/* with enough resolution every point in the range is returned */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 60 * 60, 1000);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >=, 60 * 6 * 0.95f - 2);
+	g_assert_cmpint (array->len, <=, 60 * 6 * 0.95f + 2);
+	g_ptr_array_unref (array);
+
+	/* the whole day at low resolution comes from the pre-averaged
+	 * data, still newest first and within the range of values */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 24 * 60 * 60, 100);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >, 0);
+	g_assert_cmpint (array->len, <=, 24 * 6 + 1);
+	item_last = NULL;
+	for (i = 0; i < array->len; i++) {
+		item = g_ptr_array_index (array, i);
+		g_assert_cmpfloat (up_history_item_get_value (item), >=, 0);
+		g_assert_cmpfloat (up_history_item_get_value (item), <=, 100);
+		if (item_last != NULL)
+			g_assert_cmpint (up_history_item_get_time (item), <=, up_history_item_get_time (item_last));
+		item_last = item;
+	}
+	g_ptr_array_unref (array);
+
+	/* and so does all of it */
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, 10);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >, 0);
+	g_assert_cmpint (array->len, <=, 10 + 1);
+	g_ptr_array_unref (array);
+
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
+}
+
+static gdouble
+up_test_history_get_max_value (GPtrArray *array)
+{
+	gdouble max = 0;
+	guint i;
+
+	for (i = 0; i < array->len; i++) {
+		UpHistoryItem *item = g_ptr_array_index (array, i);
+		max = MAX (max, up_history_item_get_value (item));
+	}
+	return max;
+}
+
+static void
+up_test_history_downsample_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 1000;
+	UpHistory *history;
+	GPtrArray *array;
+	guint time_now;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	/* flat, with a single spike */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 3;
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = i == count / 2 ? 90.0f : 50.0f;
+	}
+	up_test_history_write_file ("rate", records, count);
+	g_free (records);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+
+	/* averaging hides it */
+	array = up_history_get_data_downsampled (history, UP_HISTORY_TYPE_RATE, 0, 20,
+						 UP_HISTORY_DOWNSAMPLE_AVERAGE);
+	g_assert (array != NULL);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), <, 90.0f);
+	g_ptr_array_unref (array);
+
+	/* the others keep it */
+	array = up_history_get_data_downsampled (history, UP_HISTORY_TYPE_RATE, 0, 20,
+						 UP_HISTORY_DOWNSAMPLE_LTTB);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 20);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), ==, 90.0f);
+	g_ptr_array_unref (array);
+
+	array = up_history_get_data_downsampled (history, UP_HISTORY_TYPE_RATE, 0, 20,
+						 UP_HISTORY_DOWNSAMPLE_MINMAX);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, <=, 20);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), ==, 90.0f);
+	g_ptr_array_unref (array);
+
+	/* also from a range */
+	array = up_history_get_data_downsampled (history, UP_HISTORY_TYPE_RATE, count * 3, 20,
+						 UP_HISTORY_DOWNSAMPLE_LTTB);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 20);
+	g_assert_cmpfloat (up_test_history_get_max_value (array), ==, 90.0f);
+	g_ptr_array_unref (array);
+
+	g_assert_cmpint (up_history_downsample_from_string ("lttb"), ==, UP_HISTORY_DOWNSAMPLE_LTTB);
+	g_assert_cmpint (up_history_downsample_from_string ("spline"), ==, UP_HISTORY_DOWNSAMPLE_UNKNOWN);
+
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_columns_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 1000;
+	const UpHistoryType types[] = { UP_HISTORY_TYPE_CHARGE, UP_HISTORY_TYPE_RATE };
+	const UpHistoryType invalid[] = { UP_HISTORY_TYPE_RATE, UP_HISTORY_TYPE_UNKNOWN };
+	UpHistoryColumns *columns;
+	UpHistory *history;
+	guint missing = 0;
+	guint time_now;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	/* the rate all along, the charge only in the first half */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 3;
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = 10.0f;
+	}
+	up_test_history_write_file ("rate", records, count);
+	for (i = 0; i < count / 2; i++)
+		records[i].value = 50.0f;
+	up_test_history_write_file ("charge", records, count / 2);
+	g_free (records);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+
+	columns = up_history_get_columns (history, types, G_N_ELEMENTS (types), 0, 10);
+	g_assert (columns != NULL);
+	g_assert_cmpint (columns->n_types, ==, 2);
+	g_assert_cmpint (columns->len, >, 0);
+	g_assert_cmpint (columns->len, <=, 10);
+	for (i = 0; i < columns->len; i++) {
+		gdouble charge = columns->value[i];
+		gdouble rate = columns->value[columns->len + i];
+
+		if (i > 0)
+			g_assert_cmpint (columns->time[i], >, columns->time[i - 1]);
+		g_assert (!isnan (rate));
+		if (isnan (charge))
+			missing++;
+		else if (i < columns->len - 1)
+			g_assert_cmpfloat (charge, ==, 50.0f);
+	}
+	g_assert_cmpint (missing, >, 0);
+	up_history_columns_free (columns);
+
+	/* all or nothing */
+	g_assert (up_history_get_columns (history, invalid, G_N_ELEMENTS (invalid), 0, 10) == NULL);
+
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_since_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 100;
+	UpHistory *history;
+	GPtrArray *array;
+	guint64 generation;
+	guint time_now;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 3;
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = 50.0f;
+	}
+	up_test_history_write_file ("rate", records, count);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+
+	/* everything, oldest first */
+	array = up_history_get_data_since (history, UP_HISTORY_TYPE_RATE, 0);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, count + 1); /* plus the marker */
+	g_assert_cmpint (up_history_item_get_time (g_ptr_array_index (array, 0)), ==, records[0].time);
+	g_ptr_array_unref (array);
+
+	/* only the marker is newer */
+	array = up_history_get_data_since (history, UP_HISTORY_TYPE_RATE, records[count - 1].time);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 1);
+	g_ptr_array_unref (array);
+
+	/* new points bump the generation */
+	generation = up_history_get_generation (history, UP_HISTORY_TYPE_RATE);
+	g_assert_cmpint (generation, >, 0);
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_rate_data (history, 10.0f);
+	g_assert_cmpint (up_history_get_generation (history, UP_HISTORY_TYPE_RATE), >, generation);
+	array = up_history_get_data_since (history, UP_HISTORY_TYPE_RATE, records[count - 1].time);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 2);
+	g_assert_cmpfloat (up_history_item_get_value (g_ptr_array_index (array, 1)), ==, 10.0f);
+	g_ptr_array_unref (array);
+
+	/* nothing newer than the newest */
+	array = up_history_get_data_since (history, UP_HISTORY_TYPE_RATE, G_MAXUINT);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 0);
+	g_ptr_array_unref (array);
+
+	g_free (records);
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_aggregate_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 1000;
+	UpHistory *history;
+	GArray *array;
+	guint total = 0;
+	guint time_now;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 3;
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = 10 + i % 10;
+	}
+	up_test_history_write_file ("rate", records, count);
+	g_free (records);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+
+	/* every point is in one of the buckets, oldest first */
+	array = up_history_get_aggregate (history, UP_HISTORY_TYPE_RATE, 0, 10);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >, 0);
+	g_assert_cmpint (array->len, <=, 10);
+	for (i = 0; i < array->len; i++) {
+		UpHistoryAggregate *bucket = &g_array_index (array, UpHistoryAggregate, i);
+
+		g_assert_cmpfloat (bucket->min, <=, bucket->mean);
+		g_assert_cmpfloat (bucket->mean, <=, bucket->max);
+		if (i > 0)
+			g_assert_cmpint (bucket->time, >, g_array_index (array, UpHistoryAggregate, i - 1).time);
+		total += bucket->count;
+	}
+	g_assert_cmpint (total, ==, count + 1); /* plus the marker */
+
+	/* the full envelope of the recorded points */
+	g_assert_cmpfloat (g_array_index (array, UpHistoryAggregate, 0).min, ==, 10);
+	g_assert_cmpfloat (g_array_index (array, UpHistoryAggregate, 0).max, ==, 19);
+	g_array_unref (array);
+
+	/* only the last part */
+	array = up_history_get_aggregate (history, UP_HISTORY_TYPE_RATE, 300, 1);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, ==, 1);
+	g_assert_cmpint (g_array_index (array, UpHistoryAggregate, 0).count, <=, 100);
+	g_array_unref (array);
+
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_archive_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 30 * 24 * 6; /* a month, every ten minutes */
+	UpHistory *history;
+	GPtrArray *array;
+	UpHistoryItem *item;
+	guint time_now;
+	guint i;
+
+	up_test_history_dir_setup ();
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 10 * 60;
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = i % 100;
+	}
+	up_test_history_write_file ("charge", records, count);
+	g_free (records);
+
+	/* only the last week is kept at full resolution */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	g_object_unref (history);
+
+	/* but the rest is still there, as hourly buckets */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 30 * 24 * 60 * 60, 5000);
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, >, 7 * 24 * 6 + 20 * 24);
+	g_assert_cmpint (array->len, <, 7 * 24 * 6 + 23 * 24);
+	for (i = 1; i < array->len; i++) {
+		item = g_ptr_array_index (array, i);
+		g_assert_cmpint (up_history_item_get_time (item), <=, up_history_item_get_time (g_ptr_array_index (array, i - 1)));
+		g_assert_cmpfloat (up_history_item_get_value (item), >=, 0);
+		g_assert_cmpfloat (up_history_item_get_value (item), <, 100);
+	}
+	item = g_ptr_array_index (array, array->len - 1);
+	g_assert_cmpint (up_history_item_get_time (item), <, time_now - 27 * 24 * 60 * 60);
+	g_ptr_array_unref (array);
+	g_object_unref (history);
+
+	up_test_history_dir_teardown ();
+}
+
+/* the statistics as they were computed from scratch on every request */
+static GPtrArray *
+up_test_history_profile_reference (GPtrArray *array, gboolean charging)
+{
+	guint i;
+	guint non_zero_accuracy = 0;
+	gfloat average = 0.0f;
+	guint bin;
+	guint oldbin = 999;
+	UpHistoryItem *item_last = NULL;
+	UpHistoryItem *item;
+	UpHistoryItem *item_old = NULL;
+	UpStatsItem *stats;
+	GPtrArray *data;
+	guint time_s;
+	gdouble value;
+	gdouble total_value = 0.0f;
+
+	data = g_ptr_array_new_full (101, g_object_unref);
+	for (i=0; i<101; i++)
+		g_ptr_array_add (data, up_stats_item_new ());
+
+	for (i=0; i<array->len; i++) {
+		item = (UpHistoryItem *) g_ptr_array_index (array, i);
+		if (item_last == NULL ||
+		    up_history_item_get_state (item) != up_history_item_get_state (item_last)) {
+			item_old = NULL;
+			goto cont;
+		}
+		bin = rint (up_history_item_get_value (item));
+		if (bin >= data->len)
+			bin = data->len - 1;
+		if (oldbin != bin) {
+			oldbin = bin;
+			if (item_old != NULL) {
+				value = fabs (up_history_item_get_value (item) - up_history_item_get_value (item_old));
+				if (value < 0.01f) {
+					item_old = NULL;
+					goto cont;
+				}
+				if (value > 3.0f) {
+					item_old = NULL;
+					goto cont;
+				}
+				time_s = up_history_item_get_time (item) - up_history_item_get_time (item_old);
+				if ((charging && up_history_item_get_state (item) == UP_DEVICE_STATE_CHARGING) ||
+				    (!charging && up_history_item_get_state (item) == UP_DEVICE_STATE_DISCHARGING)) {
+					stats = (UpStatsItem *) g_ptr_array_index (data, bin);
+					up_stats_item_set_value (stats, up_stats_item_get_value (stats) + time_s);
+					up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) + 1);
+				}
+			}
+			item_old = item;
+		}
+cont:
+		item_last = item;
+	}
+
+	for (i=0; i<101; i++) {
+		stats = (UpStatsItem *) g_ptr_array_index (data, i);
+		if (up_stats_item_get_accuracy (stats) != 0)
+			up_stats_item_set_value (stats, up_stats_item_get_value (stats) / up_stats_item_get_accuracy (stats));
+	}
+	for (i=0; i<101; i++) {
+		stats = (UpStatsItem *) g_ptr_array_index (data, i);
+		if (up_stats_item_get_accuracy (stats) > 0) {
+			total_value += up_stats_item_get_value (stats);
+			non_zero_accuracy++;
+		}
+	}
+	if (non_zero_accuracy != 0)
+		average = total_value / non_zero_accuracy;
+	for (i=0; i<101; i++) {
+		stats = (UpStatsItem *) g_ptr_array_index (data, i);
+		if (up_stats_item_get_accuracy (stats) > 0)
+			up_stats_item_set_value (stats, (up_stats_item_get_value (stats) - average) / average);
+		else
+			up_stats_item_set_value (stats, 0.0f);
+	}
+	for (i=0; i<101; i++) {
+		stats = (UpStatsItem *) g_ptr_array_index (data, i);
+		up_stats_item_set_accuracy (stats, up_stats_item_get_accuracy (stats) * 20.0f);
+	}
+	return data;
+}
+
+static void
+up_test_history_profile_check (UpHistory *history)
+{
+	GPtrArray *array;
+	GPtrArray *expected;
+	GPtrArray *profile;
+	UpStatsItem *stats;
+	UpStatsItem *stats_expected;
+	guint non_zero = 0;
+	guint i, j;
+
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 0, G_MAXUINT);
+	g_assert (array != NULL);
+	for (j = 0; j < 2; j++) {
+		expected = up_test_history_profile_reference (array, j == 0);
+		profile = up_history_get_profile_data (history, j == 0);
+		g_assert_cmpint (profile->len, ==, expected->len);
+		for (i = 0; i < profile->len; i++) {
+			stats = g_ptr_array_index (profile, i);
+			stats_expected = g_ptr_array_index (expected, i);
+			g_assert_cmpfloat (up_stats_item_get_value (stats), ==, up_stats_item_get_value (stats_expected));
+			g_assert_cmpfloat (up_stats_item_get_accuracy (stats), ==, up_stats_item_get_accuracy (stats_expected));
+			if (up_stats_item_get_accuracy (stats) > 0)
+				non_zero++;
+		}
+		g_ptr_array_unref (expected);
+		g_ptr_array_unref (profile);
+	}
+	g_ptr_array_unref (array);
+
+	/* make sure the data actually exercises the statistics */
+	g_assert_cmpint (non_zero, >, 10);
+}
+
+/* charge and discharge cycles, with repeats, jumps and gaps */
+static void
+up_test_history_write_profile_file (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 20000;
+	GRand *rand;
+	gdouble value = 50.0f;
+	guint32 time_s;
+	guint state = UP_DEVICE_STATE_DISCHARGING;
+	guint i;
+
+	rand = g_rand_new_with_seed (42);
+	time_s = g_get_real_time () / G_USEC_PER_SEC - count * 30;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		gdouble step = g_rand_double_range (rand, 0.0f, 1.5f);
+
+		if (g_rand_int_range (rand, 0, 50) == 0)
+			step += 4.0f;
+		if (g_rand_int_range (rand, 0, 20) == 0)
+			step = 0.0f;
+		if (state == UP_DEVICE_STATE_DISCHARGING) {
+			value -= step;
+			if (value <= 5.0f)
+				state = UP_DEVICE_STATE_CHARGING;
+		} else {
+			value += step;
+			if (value >= 100.0f) {
+				value = 100.0f;
+				state = UP_DEVICE_STATE_DISCHARGING;
+			}
+		}
+		time_s += g_rand_int_range (rand, 10, 30);
+		records[i].time = time_s;
+		records[i].state = g_rand_int_range (rand, 0, 200) == 0 ? UP_DEVICE_STATE_UNKNOWN : state;
+		records[i].value = value;
+	}
+	up_test_history_write_file ("charge", records, count);
+	g_free (records);
+	g_rand_free (rand);
+}
+
+static void
+up_test_history_profile_func (void)
+{
+	UpHistory *history;
+
+	up_test_history_dir_setup ();
+	up_test_history_write_profile_file ();
+
+	/* computed while loading */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_profile_check (history);
+
+	/* updated as points come in */
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	up_history_set_charge_data (history, 40.0f);
+	up_history_set_charge_data (history, 41.0f);
+	up_history_set_charge_data (history, 42.5f);
+	up_test_history_profile_check (history);
+	g_object_unref (history);
+
+	/* and restored from disk */
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	up_test_history_profile_check (history);
+	g_object_unref (history);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_profile_tolerance_func (void)
+{
+	UpHistory *history;
+	GPtrArray *array;
+	gboolean ret;
+
+	up_test_history_dir_setup ();
+	up_test_history_write_profile_file ();
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_tolerance (history, UP_HISTORY_TYPE_CHARGE, 0.5);
+	up_history_set_id (history, "test");
+
+	/* 49 is replaced by 48, which would have counted for the 48%
+	 * bin coming from 49 */
+	up_history_set_state (history, UP_DEVICE_STATE_DISCHARGING);
+	up_history_set_charge_data (history, 50.0f);
+	g_usleep (G_USEC_PER_SEC);
+	up_history_set_charge_data (history, 49.0f);
+	g_usleep (G_USEC_PER_SEC);
+	up_history_set_charge_data (history, 48.0f);
+	array = up_history_get_data_since (history, UP_HISTORY_TYPE_CHARGE, 0);
+	g_assert_cmpfloat (up_history_item_get_value (g_ptr_array_index (array, array->len - 2)), ==, 50.0f);
+	g_assert_cmpfloat (up_history_item_get_value (g_ptr_array_index (array, array->len - 1)), ==, 48.0f);
+	g_ptr_array_unref (array);
+
+	/* the statistics only count the points that are kept */
+	up_history_set_state (history, UP_DEVICE_STATE_CHARGING);
+	up_history_set_charge_data (history, 48.5f);
+	up_test_history_profile_check (history);
+
+	/* and the same once rebuilt, as compacting culls the oldest days */
+	up_history_set_max_data_age (history, 5 * 24 * 60 * 60);
+	ret = up_history_save_data (history);
+	g_assert (ret);
+	up_test_history_profile_check (history);
+	g_object_unref (history);
+
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_benchmark_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 7 * 24 * 60 * 30; /* a week, every two seconds */
+	UpHistory *history;
+	GPtrArray *array;
+	glong rss;
+	gdouble elapsed;
+	guint time_now;
+	guint i;
+
+	if (!g_test_perf ()) {
+		g_test_skip ("only run in performance mode");
+		return;
+	}
+
+	up_test_history_dir_setup ();
+
+	/* a week of charge data */
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i) * 2;
+		records[i].state = (i / 3600) % 2 ? UP_DEVICE_STATE_CHARGING : UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = 100.0f * (i % 3600) / 3600;
+	}
+	up_test_history_write_file ("charge", records, count);
+	g_free (records);
+
+	/* load it */
+	rss = up_test_get_rss_kb ();
+	g_test_timer_start ();
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+	elapsed = g_test_timer_elapsed ();
+	g_test_minimized_result (elapsed, "loading %u points: %.3f s", count, elapsed);
+	g_test_message ("resident memory grew by %ld kB", up_test_get_rss_kb () - rss);
+
+	/* and query it the way the graphs do */
+	g_test_timer_start ();
+	array = up_history_get_data (history, UP_HISTORY_TYPE_CHARGE, 7 * 24 * 60 * 60, 150);
+	elapsed = g_test_timer_elapsed ();
+	g_assert (array != NULL);
+	g_ptr_array_unref (array);
+	g_test_minimized_result (elapsed, "querying a week: %.3f s", elapsed);
+
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
+}
+
+static void
+up_test_history_aggregate_benchmark_func (void)
+{
+	UpTestHistoryRecord *records;
+	const guint count = 1000000;
+	UpHistory *history;
+	GPtrArray *items;
+	GArray *array;
+	gdouble reference;
+	gdouble elapsed;
+	guint time_now;
+	guint i;
+
+	if (!g_test_perf ()) {
+		g_test_skip ("only run in performance mode");
+		return;
+	}
+
+	up_test_history_dir_setup ();
+
+	time_now = g_get_real_time () / G_USEC_PER_SEC;
+	records = g_new0 (UpTestHistoryRecord, count);
+	for (i = 0; i < count; i++) {
+		records[i].time = time_now - (count - i);
+		records[i].state = UP_DEVICE_STATE_DISCHARGING;
+		records[i].value = 100.0f * (i % 3600) / 3600;
+	}
+	up_test_history_write_file ("rate", records, count);
+	g_free (records);
+
+	history = up_history_new ();
+	up_history_set_directory (history, history_dir);
+	up_history_set_id (history, "test");
+
+	/* the same number of points, limited to the resolution */
+	g_test_timer_start ();
+	items = up_history_get_data (history, UP_HISTORY_TYPE_RATE, 0, 150);
+	reference = g_test_timer_elapsed ();
+	g_assert (items != NULL);
+	g_test_message ("limiting %u points to %u: %.3f s", count, items->len, reference);
+	g_ptr_array_unref (items);
+
+	g_test_timer_start ();
+	array = up_history_get_aggregate (history, UP_HISTORY_TYPE_RATE, 0, 150);
+	elapsed = g_test_timer_elapsed ();
+	g_assert (array != NULL);
+	g_assert_cmpint (array->len, <=, 150);
+	g_array_unref (array);
+	g_test_minimized_result (elapsed, "aggregating %u points: %.3f s", count, elapsed);
+	g_test_maximized_result (reference / elapsed, "%.1f times faster", reference / elapsed);
+
+	g_object_unref (history);
+	up_test_history_dir_teardown ();
 }
 
 static void
@@ -314,6 +1758,25 @@ main (int argc, char **argv)
 	g_test_add_func ("/power/device", up_test_device_func);
 	g_test_add_func ("/power/device_list", up_test_device_list_func);
 	g_test_add_func ("/power/history", up_test_history_func);
+	g_test_add_func ("/power/history-migration", up_test_history_migration_func);
+	g_test_add_func ("/power/history-parse", up_test_history_parse_func);
+	g_test_add_func ("/power/history-parse-benchmark", up_test_history_parse_benchmark_func);
+	g_test_add_func ("/power/history-append", up_test_history_append_func);
+	g_test_add_func ("/power/history-tolerance", up_test_history_tolerance_func);
+	g_test_add_func ("/power/history-writer", up_test_history_writer_func);
+	g_test_add_func ("/power/tick", up_test_tick_func);
+	g_test_add_func ("/power/history-store", up_test_history_store_func);
+	g_test_add_func ("/power/history-compact", up_test_history_compact_func);
+	g_test_add_func ("/power/history-tiers", up_test_history_tiers_func);
+	g_test_add_func ("/power/history-archive", up_test_history_archive_func);
+	g_test_add_func ("/power/history-downsample", up_test_history_downsample_func);
+	g_test_add_func ("/power/history-aggregate", up_test_history_aggregate_func);
+	g_test_add_func ("/power/history-since", up_test_history_since_func);
+	g_test_add_func ("/power/history-columns", up_test_history_columns_func);
+	g_test_add_func ("/power/history-profile", up_test_history_profile_func);
+	g_test_add_func ("/power/history-profile-tolerance", up_test_history_profile_tolerance_func);
+	g_test_add_func ("/power/history-benchmark", up_test_history_benchmark_func);
+	g_test_add_func ("/power/history-aggregate-benchmark", up_test_history_aggregate_benchmark_func);
 	g_test_add_func ("/power/native", up_test_native_func);
 	g_test_add_func ("/power/polkit", up_test_polkit_func);
 	g_test_add_func ("/power/daemon", up_test_daemon_func);
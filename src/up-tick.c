@@ -0,0 +1,357 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "config.h"
+
+#include "up-tick.h"
+
+/* All the periodic work of the daemon shares a single timer. It only
+ * wakes up on whole seconds of the monotonic clock, like the timeouts
+ * added with g_timeout_add_seconds(), and at the latest time that suits
+ * every client, so that clients which allow some slack run together
+ * with the others. How often each client ran is logged about once an
+ * hour, to see what keeps the machine awake. */
+
+#define UP_TICK_SUMMARY_INTERVAL	G_TIME_SPAN_HOUR
+
+typedef struct {
+	guint			 id;
+	gchar			*name;
+	UpTickFunc		 func;
+	gpointer		 user_data;
+	gint64			 ready_time;	/* -1 if not scheduled */
+	gint64			 slack;		/* in microseconds */
+} UpTickClient;
+
+struct _UpTick
+{
+	GObject			 parent_instance;
+
+	GSource			*source;
+	GHashTable		*clients;	/* id -> UpTickClient */
+	GHashTable		*wakeups;	/* name -> guint64 */
+	guint64			 total_wakeups;
+	gint64			 last_summary;
+	guint			 last_id;
+};
+
+G_DEFINE_TYPE (UpTick, up_tick, G_TYPE_OBJECT)
+
+static gpointer up_tick_object = NULL;
+
+/**
+ * up_tick_client_free:
+ **/
+static void
+up_tick_client_free (UpTickClient *client)
+{
+	g_free (client->name);
+	g_free (client);
+}
+
+/**
+ * up_tick_update:
+ *
+ * Sets the next wakeup to the first whole second by which every
+ * scheduled client must have run.
+ **/
+static void
+up_tick_update (UpTick *tick)
+{
+	GHashTableIter iter;
+	gpointer value;
+	gint64 deadline = G_MAXINT64;
+
+	g_hash_table_iter_init (&iter, tick->clients);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		UpTickClient *client = value;
+
+		if (client->ready_time < 0)
+			continue;
+		deadline = MIN(deadline, client->ready_time + client->slack);
+	}
+
+	if (deadline == G_MAXINT64) {
+		g_source_set_ready_time (tick->source, -1);
+		return;
+	}
+
+	/* never early, so the clients are due when we wake up */
+	deadline += G_USEC_PER_SEC - 1;
+	deadline -= deadline % G_USEC_PER_SEC;
+	g_source_set_ready_time (tick->source, deadline);
+}
+
+/**
+ * up_tick_log_summary:
+ *
+ * Logs how many wakeups there were so far, and in how many of them
+ * each kind of client ran.
+ **/
+static void
+up_tick_log_summary (UpTick *tick)
+{
+	g_autoptr(GString) counts = NULL;
+	g_autoptr(GList) names = NULL;
+	GList *l;
+
+	counts = g_string_new (NULL);
+	names = g_list_sort (g_hash_table_get_keys (tick->wakeups), (GCompareFunc) g_strcmp0);
+	for (l = names; l != NULL; l = l->next)
+		g_string_append_printf (counts, " %s=%" G_GUINT64_FORMAT,
+					(const gchar *) l->data,
+					up_tick_get_wakeups (tick, l->data));
+	g_info ("%" G_GUINT64_FORMAT " wakeups since startup:%s",
+		up_tick_get_wakeups (tick, NULL), counts->str);
+}
+
+/**
+ * up_tick_dispatch:
+ **/
+static gboolean
+up_tick_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	UpTick *tick = UP_TICK (user_data);
+	g_autoptr(GArray) due = NULL;
+	g_autoptr(GString) names = NULL;
+	GHashTableIter iter;
+	gpointer value;
+	gint64 now = g_source_get_time (source);
+	guint i;
+
+	g_source_set_ready_time (source, -1);
+	g_assert (callback == NULL);
+
+	/* the functions may add, remove or schedule clients */
+	due = g_array_new (FALSE, FALSE, sizeof (guint));
+	g_hash_table_iter_init (&iter, tick->clients);
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		UpTickClient *client = value;
+
+		if (client->ready_time < 0 || client->ready_time > now)
+			continue;
+		g_array_append_val (due, client->id);
+	}
+
+	if (due->len > 0) {
+		tick->total_wakeups++;
+		names = g_string_new (NULL);
+	}
+	for (i = 0; i < due->len; i++) {
+		UpTickClient *client;
+		guint64 *count;
+
+		client = g_hash_table_lookup (tick->clients, GUINT_TO_POINTER (g_array_index (due, guint, i)));
+		if (client == NULL || client->ready_time < 0)
+			continue;
+
+		count = g_hash_table_lookup (tick->wakeups, client->name);
+		if (count == NULL) {
+			count = g_new0 (guint64, 1);
+			g_hash_table_insert (tick->wakeups, g_strdup (client->name), count);
+		}
+		(*count)++;
+		g_string_append_printf (names, " %s", client->name);
+
+		client->ready_time = -1;
+		client->func (client->user_data);
+	}
+	if (names != NULL)
+		g_debug ("tick %" G_GUINT64_FORMAT " ran:%s", tick->total_wakeups, names->str);
+
+	/* this does not need a wakeup of its own */
+	if (now - tick->last_summary >= UP_TICK_SUMMARY_INTERVAL) {
+		up_tick_log_summary (tick);
+		tick->last_summary = now;
+	}
+
+	up_tick_update (tick);
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs up_tick_source_funcs = {
+	.prepare = NULL,
+	.check = NULL,
+	.dispatch = up_tick_dispatch,
+	.finalize = NULL,
+};
+
+/**
+ * up_tick_add:
+ * @name: what the wakeups of the client are counted as
+ * @func: what to run when the client is due
+ *
+ * Return value: the id of the client, which is not scheduled yet
+ **/
+guint
+up_tick_add (UpTick *tick, const gchar *name, UpTickFunc func, gpointer user_data)
+{
+	UpTickClient *client;
+
+	g_return_val_if_fail (UP_IS_TICK (tick), 0);
+	g_return_val_if_fail (name != NULL, 0);
+	g_return_val_if_fail (func != NULL, 0);
+
+	client = g_new0 (UpTickClient, 1);
+	client->id = ++tick->last_id;
+	client->name = g_strdup (name);
+	client->func = func;
+	client->user_data = user_data;
+	client->ready_time = -1;
+	g_hash_table_insert (tick->clients, GUINT_TO_POINTER (client->id), client);
+	return client->id;
+}
+
+/**
+ * up_tick_remove:
+ **/
+void
+up_tick_remove (UpTick *tick, guint id)
+{
+	g_return_if_fail (UP_IS_TICK (tick));
+
+	if (g_hash_table_remove (tick->clients, GUINT_TO_POINTER (id)))
+		up_tick_update (tick);
+}
+
+/**
+ * up_tick_schedule:
+ * @ready_time: the monotonic time the client is due at, or -1 to
+ *              unschedule it
+ * @slack: how many seconds late the client may run
+ *
+ * Runs the client once, at @ready_time or up to @slack seconds later,
+ * replacing what was scheduled before.
+ **/
+void
+up_tick_schedule (UpTick *tick, guint id, gint64 ready_time, guint slack)
+{
+	UpTickClient *client;
+
+	g_return_if_fail (UP_IS_TICK (tick));
+
+	client = g_hash_table_lookup (tick->clients, GUINT_TO_POINTER (id));
+	g_return_if_fail (client != NULL);
+
+	if (client->ready_time == ready_time &&
+	    client->slack == (gint64) slack * G_USEC_PER_SEC)
+		return;
+	client->ready_time = ready_time < 0 ? -1 : ready_time;
+	client->slack = (gint64) slack * G_USEC_PER_SEC;
+	up_tick_update (tick);
+}
+
+/**
+ * up_tick_get_ready_time:
+ *
+ * Return value: when the client is due, or -1 if it is not scheduled
+ **/
+gint64
+up_tick_get_ready_time (UpTick *tick, guint id)
+{
+	UpTickClient *client;
+
+	g_return_val_if_fail (UP_IS_TICK (tick), -1);
+
+	client = g_hash_table_lookup (tick->clients, GUINT_TO_POINTER (id));
+	if (client == NULL)
+		return -1;
+	return client->ready_time;
+}
+
+/**
+ * up_tick_get_wakeups:
+ * @name: (nullable): the name clients were added with
+ *
+ * Return value: the number of wakeups in which a client called @name
+ * ran, or the number of all the wakeups if @name is %NULL
+ **/
+guint64
+up_tick_get_wakeups (UpTick *tick, const gchar *name)
+{
+	guint64 *count;
+
+	g_return_val_if_fail (UP_IS_TICK (tick), 0);
+
+	if (name == NULL)
+		return tick->total_wakeups;
+	count = g_hash_table_lookup (tick->wakeups, name);
+	return count != NULL ? *count : 0;
+}
+
+/**
+ * up_tick_finalize:
+ **/
+static void
+up_tick_finalize (GObject *object)
+{
+	UpTick *tick = UP_TICK (object);
+
+	g_clear_pointer (&tick->source, g_source_destroy);
+	g_hash_table_unref (tick->clients);
+	g_hash_table_unref (tick->wakeups);
+
+	G_OBJECT_CLASS (up_tick_parent_class)->finalize (object);
+}
+
+/**
+ * up_tick_class_init:
+ **/
+static void
+up_tick_class_init (UpTickClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+	object_class->finalize = up_tick_finalize;
+}
+
+/**
+ * up_tick_init:
+ **/
+static void
+up_tick_init (UpTick *tick)
+{
+	tick->clients = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+					       (GDestroyNotify) up_tick_client_free);
+	tick->wakeups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	tick->last_summary = g_get_monotonic_time ();
+
+	tick->source = g_source_new (&up_tick_source_funcs, sizeof (GSource));
+	g_source_set_callback (tick->source, NULL, tick, NULL);
+	g_source_set_name (tick->source, "up-tick");
+	g_source_attach (tick->source, NULL);
+	/* g_source_destroy removes the last reference */
+	g_source_unref (tick->source);
+}
+
+/**
+ * up_tick_new:
+ *
+ * Return value: the timer shared by the whole daemon
+ **/
+UpTick *
+up_tick_new (void)
+{
+	if (up_tick_object != NULL) {
+		g_object_ref (up_tick_object);
+	} else {
+		up_tick_object = g_object_new (UP_TYPE_TICK, NULL);
+		g_object_add_weak_pointer (up_tick_object, &up_tick_object);
+	}
+	return UP_TICK (up_tick_object);
+}
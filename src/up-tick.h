@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ * Licensed under the GNU General Public License Version 2
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __UP_TICK_H
+#define __UP_TICK_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define UP_TYPE_TICK	(up_tick_get_type ())
+G_DECLARE_FINAL_TYPE (UpTick, up_tick, UP, TICK, GObject)
+
+/* called once in the main thread when the client is due */
+typedef void (*UpTickFunc) (gpointer user_data);
+
+GType			 up_tick_get_type		(void);
+UpTick			*up_tick_new			(void);
+guint			 up_tick_add			(UpTick			*tick,
+							 const gchar		*name,
+							 UpTickFunc		 func,
+							 gpointer		 user_data);
+void			 up_tick_remove			(UpTick			*tick,
+							 guint			 id);
+void			 up_tick_schedule		(UpTick			*tick,
+							 guint			 id,
+							 gint64			 ready_time,
+							 guint			 slack);
+gint64			 up_tick_get_ready_time		(UpTick			*tick,
+							 guint			 id);
+guint64			 up_tick_get_wakeups		(UpTick			*tick,
+							 const gchar		*name);
+
+G_END_DECLS
+
+#endif /* __UP_TICK_H */
@@ -21,12 +21,15 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <glib/gi18n-lib.h>
 #include <locale.h>
 
@@ -181,6 +184,271 @@ up_tool_do_monitor (UpClient *client)
 	return FALSE;
 }
 
+/* the records of up_device_get_history_fd_sync() */
+typedef struct {
+	guint32			 time;
+	guint32			 state;
+	gdouble			 value;
+} UpToolHistoryRecord;
+
+G_STATIC_ASSERT (sizeof (UpToolHistoryRecord) == 16);
+
+/**
+ * up_tool_parse_time:
+ *
+ * Accepts seconds since the epoch or an ISO 8601 date and time, in
+ * local time unless a timezone is given.
+ **/
+static gboolean
+up_tool_parse_time (const gchar *text, gint64 *time_s)
+{
+	g_autoptr(GDateTime) datetime = NULL;
+	g_autoptr(GTimeZone) tz = NULL;
+	guint64 value;
+
+	if (g_ascii_string_to_unsigned (text, 10, 0, G_MAXUINT32, &value, NULL)) {
+		*time_s = value;
+		return TRUE;
+	}
+	tz = g_time_zone_new_local ();
+	datetime = g_date_time_new_from_iso8601 (text, tz);
+	if (datetime == NULL)
+		return FALSE;
+	*time_s = g_date_time_to_unix (datetime);
+	return TRUE;
+}
+
+/**
+ * up_tool_history_record_compare:
+ **/
+static gint
+up_tool_history_record_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const UpToolHistoryRecord *record_a = a;
+	const UpToolHistoryRecord *record_b = b;
+
+	if (record_a->time < record_b->time)
+		return -1;
+	return record_a->time > record_b->time;
+}
+
+/**
+ * up_tool_history_filter:
+ *
+ * Keeps the records between @since and @until, oldest first.
+ **/
+static void
+up_tool_history_filter (GArray *records, gint64 since, gint64 until)
+{
+	guint len = 0;
+	guint i;
+
+	g_qsort_with_data (records->data, records->len, sizeof (UpToolHistoryRecord),
+			   up_tool_history_record_compare, NULL);
+	for (i = 0; i < records->len; i++) {
+		UpToolHistoryRecord *record = &g_array_index (records, UpToolHistoryRecord, i);
+
+		if (record->time < since || record->time > until)
+			continue;
+		g_array_index (records, UpToolHistoryRecord, len++) = *record;
+	}
+	g_array_set_size (records, len);
+}
+
+/**
+ * up_tool_history_to_csv:
+ **/
+static gboolean
+up_tool_history_to_csv (GArray *records, FILE *file)
+{
+	gchar value[G_ASCII_DTOSTR_BUF_SIZE];
+	guint i;
+
+	fprintf (file, "time,value,state\n");
+	for (i = 0; i < records->len; i++) {
+		const UpToolHistoryRecord *record = &g_array_index (records, UpToolHistoryRecord, i);
+
+		/* not using the locale, so the file can be read back anywhere */
+		g_ascii_dtostr (value, sizeof (value), record->value);
+		fprintf (file, "%u,%s,%s\n", record->time, value,
+			 up_device_state_to_string (record->state));
+	}
+	return fflush (file) == 0;
+}
+
+/**
+ * up_tool_history_from_csv:
+ **/
+static gboolean
+up_tool_history_from_csv (const gchar *data, GArray *records, GError **error)
+{
+	g_auto(GStrv) lines = NULL;
+	guint i;
+
+	lines = g_strsplit (data, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		g_auto(GStrv) fields = NULL;
+		UpToolHistoryRecord record;
+		guint64 value;
+		gchar *end;
+
+		g_strstrip (lines[i]);
+		if (lines[i][0] == '\0' || lines[i][0] == '#' ||
+		    g_str_has_prefix (lines[i], "time,"))
+			continue;
+
+		fields = g_strsplit (lines[i], ",", -1);
+		if (g_strv_length (fields) != 3 ||
+		    !g_ascii_string_to_unsigned (fields[0], 10, 0, G_MAXUINT32, &value, NULL))
+			goto invalid;
+		record.time = value;
+		record.value = g_ascii_strtod (fields[1], &end);
+		if (end == fields[1] || *end != '\0')
+			goto invalid;
+		if (g_ascii_string_to_unsigned (fields[2], 10, 0, UP_DEVICE_STATE_LAST - 1, &value, NULL))
+			record.state = value;
+		else
+			record.state = up_device_state_from_string (fields[2]);
+		g_array_append_val (records, record);
+		continue;
+invalid:
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			     "invalid history on line %u: %s", i + 1, lines[i]);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * up_tool_read_all:
+ **/
+static GByteArray *
+up_tool_read_all (gint fd, GError **error)
+{
+	g_autoptr(GByteArray) data = g_byte_array_new ();
+	guint8 buffer[64 * 1024];
+
+	for (;;) {
+		gssize got = read (fd, buffer, sizeof (buffer));
+
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got < 0) {
+			g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+				     "failed to read history: %s", g_strerror (errno));
+			return NULL;
+		}
+		if (got == 0)
+			break;
+		g_byte_array_append (data, buffer, got);
+	}
+	return g_steal_pointer (&data);
+}
+
+/**
+ * up_tool_export_history:
+ *
+ * Gets the history through a file descriptor, so long histories do not
+ * go through D-Bus one point at a time.
+ **/
+static gboolean
+up_tool_export_history (UpDevice *device, const gchar *type, gint64 since, gint64 until,
+			gboolean binary, GError **error)
+{
+	g_autoptr(GMappedFile) mapped = NULL;
+	g_autoptr(GArray) records = NULL;
+	gint64 now;
+	guint timespan = 0;
+	gsize len;
+	gint fd;
+
+	/* the daemon only returns 95% of the timespan, so ask for more
+	 * and filter here */
+	now = g_get_real_time () / G_USEC_PER_SEC;
+	if (since > 0 && since < now)
+		timespan = MIN ((now - since) * 20 / 19 + 1, G_MAXUINT);
+
+	fd = up_device_get_history_fd_sync (device, type, timespan, G_MAXUINT, NULL, error);
+	if (fd < 0)
+		return FALSE;
+	mapped = g_mapped_file_new_from_fd (fd, FALSE, error);
+	close (fd);
+	if (mapped == NULL)
+		return FALSE;
+
+	len = g_mapped_file_get_length (mapped) / sizeof (UpToolHistoryRecord);
+	records = g_array_sized_new (FALSE, FALSE, sizeof (UpToolHistoryRecord), len);
+	if (len > 0)
+		g_array_append_vals (records, g_mapped_file_get_contents (mapped), len);
+	up_tool_history_filter (records, since, until);
+
+	if (binary) {
+		if (fwrite (records->data, sizeof (UpToolHistoryRecord), records->len, stdout) != records->len ||
+		    fflush (stdout) != 0)
+			goto write_failed;
+		return TRUE;
+	}
+	if (!up_tool_history_to_csv (records, stdout))
+		goto write_failed;
+	return TRUE;
+write_failed:
+	g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		     "failed to write history: %s", g_strerror (errno));
+	return FALSE;
+}
+
+/**
+ * up_tool_import_history:
+ *
+ * Replaces the history with the one read from the standard input; the
+ * daemon has to be running in debug mode.
+ **/
+static gboolean
+up_tool_import_history (UpDevice *device, const gchar *type, gint64 since, gint64 until,
+			gboolean binary, GError **error)
+{
+	g_autoptr(GByteArray) data = NULL;
+	g_autoptr(GArray) records = NULL;
+	g_autofree gchar *filename = NULL;
+	gboolean ret;
+	gint fd;
+
+	data = up_tool_read_all (STDIN_FILENO, error);
+	if (data == NULL)
+		return FALSE;
+
+	records = g_array_new (FALSE, FALSE, sizeof (UpToolHistoryRecord));
+	if (binary) {
+		if (data->len % sizeof (UpToolHistoryRecord) != 0) {
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+					     "history is not made of 16 byte records");
+			return FALSE;
+		}
+		g_array_append_vals (records, data->data, data->len / sizeof (UpToolHistoryRecord));
+	} else {
+		g_byte_array_append (data, (const guint8 *) "", 1);
+		if (!up_tool_history_from_csv ((const gchar *) data->data, records, error))
+			return FALSE;
+	}
+	up_tool_history_filter (records, since, until);
+
+	/* the daemon only reads from regular files */
+	fd = g_file_open_tmp ("upower-history-XXXXXX", &filename, error);
+	if (fd < 0)
+		return FALSE;
+	g_unlink (filename);
+	if (write (fd, records->data, records->len * sizeof (UpToolHistoryRecord)) !=
+	    (gssize) (records->len * sizeof (UpToolHistoryRecord))) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			     "failed to write history: %s", g_strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+	ret = up_device_import_history_sync (device, type, fd, NULL, error);
+	close (fd);
+	return ret;
+}
+
 /**
  * main:
  **/
@@ -195,6 +463,12 @@ main (int argc, char **argv)
 	gboolean opt_monitor = FALSE;
 	gchar *opt_show_info = FALSE;
 	gboolean opt_version = FALSE;
+	gchar *opt_export_history = NULL;
+	gchar *opt_import_history = NULL;
+	gchar *opt_history_type = NULL;
+	gchar *opt_since = NULL;
+	gchar *opt_until = NULL;
+	gchar *opt_format = NULL;
 	gboolean ret;
 	GError *error = NULL;
 	gchar *text = NULL;
@@ -209,6 +483,12 @@ main (int argc, char **argv)
 		{ "monitor-detail", 0, 0, G_OPTION_ARG_NONE, &opt_monitor_detail, _("Monitor with detail"), NULL },
 		{ "show-info", 'i', 0, G_OPTION_ARG_STRING, &opt_show_info, _("Show information about object path"), NULL },
 		{ "version", 'v', 0, G_OPTION_ARG_NONE, &opt_version, "Print version of client and daemon", NULL },
+		{ "export-history", 0, 0, G_OPTION_ARG_STRING, &opt_export_history, _("Write the history of the object path to the standard output"), NULL },
+		{ "import-history", 0, 0, G_OPTION_ARG_STRING, &opt_import_history, _("Replace the history of the object path with the standard input"), NULL },
+		{ "type", 0, 0, G_OPTION_ARG_STRING, &opt_history_type, _("Type of history: charge, rate, time-full or time-empty"), NULL },
+		{ "since", 0, 0, G_OPTION_ARG_STRING, &opt_since, _("Only the history from this time"), NULL },
+		{ "until", 0, 0, G_OPTION_ARG_STRING, &opt_until, _("Only the history up to this time"), NULL },
+		{ "format", 0, 0, G_OPTION_ARG_STRING, &opt_format, _("Format of the history: csv or binary"), NULL },
 		{ NULL }
 	};
 
@@ -291,6 +571,47 @@ main (int argc, char **argv)
 		goto out;
 	}
 
+	if (opt_export_history != NULL || opt_import_history != NULL) {
+		const gchar *path = opt_export_history != NULL ? opt_export_history : opt_import_history;
+		const gchar *type = opt_history_type != NULL ? opt_history_type : "charge";
+		gint64 since = 0;
+		gint64 until = G_MAXUINT32;
+		gboolean binary = FALSE;
+
+		if (opt_since != NULL && !up_tool_parse_time (opt_since, &since)) {
+			g_print ("invalid time: %s\n", opt_since);
+			goto out;
+		}
+		if (opt_until != NULL && !up_tool_parse_time (opt_until, &until)) {
+			g_print ("invalid time: %s\n", opt_until);
+			goto out;
+		}
+		if (g_strcmp0 (opt_format, "binary") == 0) {
+			binary = TRUE;
+		} else if (opt_format != NULL && g_strcmp0 (opt_format, "csv") != 0) {
+			g_print ("invalid format: %s\n", opt_format);
+			goto out;
+		}
+
+		device = up_device_new ();
+		ret = up_device_set_object_path_sync (device, path, NULL, &error);
+		if (ret) {
+			if (opt_export_history != NULL)
+				ret = up_tool_export_history (device, type, since, until, binary, &error);
+			else
+				ret = up_tool_import_history (device, type, since, until, binary, &error);
+		}
+		g_object_unref (device);
+		if (!ret) {
+			g_printerr ("failed to %s history: %s\n",
+				    opt_export_history != NULL ? "export" : "import", error->message);
+			g_error_free (error);
+			goto out;
+		}
+		retval = EXIT_SUCCESS;
+		goto out;
+	}
+
 	if (opt_show_info != NULL) {
 		device = up_device_new ();
 		ret = up_device_set_object_path_sync (device, opt_show_info, NULL, &error);